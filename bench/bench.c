@@ -0,0 +1,240 @@
+/* Benchmark runner for caballa (see "make bench").
+ *
+ *   bench [-n runs] [-a arg]... [-o out.json] [-b baseline.json]
+ *         [-t tolerance] caballa file.cab...
+ *
+ * Runs caballa on each file (with the extra args given by -a, output
+ * discarded) once to warm up, then the given number of times (discarding
+ * messages on stderr too), and reports the median and 95th percentile wall
+ * time and the peak resident set size of the runs. The results are written
+ * as JSON, one benchmark per line so that two result files diff cleanly.
+ * Given a baseline (an earlier result file), a benchmark whose median time
+ * or peak RSS grew by more than the tolerance (a fraction, 0.15 by default)
+ * is a regression: they are all listed and the exit status is 1.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 32
+
+struct result {
+    char name[64];
+    double median_ms;
+    double p95_ms;
+    long max_rss_kb;
+};
+
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Run argv once, with its stderr discarded too if quiet. Returns the wall
+ * time in seconds (and the peak RSS in *rss), or -1 if it could not run or
+ * failed. */
+double run(char **argv, long *rss, int quiet)
+{
+    int status, fd;
+    pid_t pid;
+    struct rusage ru;
+    double start = now();
+
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        fd = open("/dev/null", O_RDWR);
+        dup2(fd, 0);
+        dup2(fd, 1);
+        if (quiet) {
+            dup2(fd, 2);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0 || ! WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    *rss = ru.ru_maxrss;
+    return now() - start;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* The name of a benchmark: its file name, without directory or suffix. */
+void bench_name(char *name, size_t size, const char *path)
+{
+    const char *s = strrchr(path, '/');
+    s = s ? s + 1 : path;
+    snprintf(name, size, "%s", s);
+    if (strrchr(name, '.')) {
+        *strrchr(name, '.') = '\0';
+    }
+}
+
+/* Read the results of a file written by write_results. Returns how many
+ * were read (at most max), or -1 if the file can't be read. */
+int read_results(const char *path, struct result *r, int max)
+{
+    char line[256];
+    int n = 0;
+    FILE *f = fopen(path, "r");
+    if (! f) {
+        return -1;
+    }
+    while (n < max && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " \"%63[^\"]\": {\"median_ms\": %lf, \"p95_ms\": %lf, "
+                   "\"max_rss_kb\": %ld}", r[n].name, &r[n].median_ms,
+                   &r[n].p95_ms, &r[n].max_rss_kb) == 4) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+int write_results(const char *path, struct result *r, int n, int runs)
+{
+    int i;
+    FILE *f = fopen(path, "w");
+    if (! f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"runs\": %d,\n  \"benchmarks\": {\n", runs);
+    for (i = 0; i < n; i++) {
+        fprintf(f, "    \"%s\": {\"median_ms\": %.3f, \"p95_ms\": %.3f, "
+                "\"max_rss_kb\": %ld}%s\n", r[i].name, r[i].median_ms,
+                r[i].p95_ms, r[i].max_rss_kb, i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  }\n}\n");
+    fclose(f);
+    return 0;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "usage: bench [-n runs] [-a arg]... [-o out.json] "
+            "[-b baseline.json] [-t tolerance] caballa file.cab...\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char *args[MAX_ARGS + 3], *out = NULL, *baseline = NULL;
+    int nargs = 0, runs = 5, i, j, k, n, nbase, failed = 0;
+    double tolerance = 0.15, *times;
+    struct result *results, *base;
+    long rss;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:a:o:b:t:")) != -1) {
+        switch (c) {
+            case 'n': runs = atoi(optarg); break;
+            case 'a':
+                if (nargs == MAX_ARGS) {
+                    usage();
+                }
+                args[1 + nargs++] = optarg;
+                break;
+            case 'o': out = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            default: usage();
+        }
+    }
+    if (runs < 1 || argc - optind < 2) {
+        usage();
+    }
+    args[0] = argv[optind++];
+    args[nargs + 2] = NULL;
+
+    n = argc - optind;
+    results = calloc(n, sizeof(struct result));
+    times = malloc(sizeof(double) * runs);
+    printf("%-12s %12s %12s %12s\n", "benchmark", "median ms", "p95 ms",
+           "peak RSS KB");
+    for (i = 0; i < n; i++) {
+        struct result *r = results + i;
+        args[nargs + 1] = argv[optind + i];
+        bench_name(r->name, sizeof(r->name), argv[optind + i]);
+        /* Warm up (the page cache, for one), showing any messages. */
+        if (run(args, &rss, 0) < 0) {
+            fprintf(stderr, "%s: failed\n", argv[optind + i]);
+            return 1;
+        }
+        for (j = 0; j < runs; j++) {
+            times[j] = run(args, &rss, 1);
+            if (times[j] < 0) {
+                fprintf(stderr, "%s: failed\n", argv[optind + i]);
+                return 1;
+            }
+            r->max_rss_kb = rss > r->max_rss_kb ? rss : r->max_rss_kb;
+        }
+        qsort(times, runs, sizeof(double), cmp_double);
+        r->median_ms = 1e3 * (runs % 2 ? times[runs / 2] :
+                              (times[runs / 2 - 1] + times[runs / 2]) / 2);
+        /* Nearest rank. */
+        k = (95 * runs + 99) / 100;
+        r->p95_ms = 1e3 * times[k - 1];
+        printf("%-12s %12.3f %12.3f %12ld\n", r->name, r->median_ms,
+               r->p95_ms, r->max_rss_kb);
+        fflush(stdout);
+    }
+    if (out && write_results(out, results, n, runs) < 0) {
+        return 1;
+    }
+
+    if (! baseline) {
+        return 0;
+    }
+    base = calloc(n + 64, sizeof(struct result));
+    nbase = read_results(baseline, base, n + 64);
+    if (nbase < 0) {
+        printf("No baseline in %s (make bench-baseline stores one).\n", baseline);
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < nbase; j++) {
+            if (strcmp(results[i].name, base[j].name) == 0) {
+                break;
+            }
+        }
+        if (j == nbase) {
+            continue;
+        }
+        if (results[i].median_ms > base[j].median_ms * (1 + tolerance)) {
+            printf("REGRESSION: %s median %.3f ms, baseline %.3f ms (+%.0f%%)\n",
+                   results[i].name, results[i].median_ms, base[j].median_ms,
+                   100 * (results[i].median_ms / base[j].median_ms - 1));
+            failed = 1;
+        }
+        if (results[i].max_rss_kb > base[j].max_rss_kb * (1 + tolerance)) {
+            printf("REGRESSION: %s peak RSS %ld KB, baseline %ld KB (+%.0f%%)\n",
+                   results[i].name, results[i].max_rss_kb, base[j].max_rss_kb,
+                   100 * ((double) results[i].max_rss_kb / base[j].max_rss_kb - 1));
+            failed = 1;
+        }
+    }
+    printf(failed ? "Benchmarks regressed against %s.\n" :
+           "No regressions against %s.\n", baseline);
+    return failed;
+}
@@ -1,7 +1,32 @@
+/* For clock_gettime. */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <mpc.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "caballa.h"
+
+/* SIMD kernels for vectors (see vec_map), unless built with -DVEC_SCALAR. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    ! defined(VEC_SCALAR)
+#define VEC_X86 1
+#include <immintrin.h>
+#else
+#define VEC_X86 0
+#endif
 
 /* Macros */
 #define min(a, b) ((a > b) ? b : a)
@@ -15,10 +40,10 @@
     }
 
 #define LASSERT_TYPE(del, got, expected, num, fn) \
-    LASSERT(del, got->type == expected, \
+    LASSERT(del, LTYPE(got) == expected, \
             "Function '%s' passed incorrect type for argument %d. " \
             "Expected %s, but got %s.", \
-            fn, num, ltype_name(expected), ltype_name(got->type))
+            fn, num, ltype_name(expected), ltype_name(LTYPE(got)))
 
 #define LASSERT_NARGS(del, got, expected, fn) \
     LASSERT(del, got == expected, \
@@ -32,6 +57,9 @@
             "Expected from %d to %d, but got %d.", \
             fn, (got < min ? "few" : "many"), min, max, got)
 
+/* The REPL uses readline: only the caballa binary has one, not the library
+ * (built with -DCABALLA_LIB, see caballa.h). */
+#ifndef CABALLA_LIB
 
 /* *********** WINDOWS SHIT *********** */
 
@@ -60,15 +88,28 @@ void add_history(char *unused) {}
 #include <editline/history.h>
 #endif
 
+/* For the server (see serve_main). */
+#ifdef __linux__
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#endif /* CABALLA_LIB */
+
 /* Forward declarations */
 struct lval;
 struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
-/* lbuiltin is a pointer to a function which takes an environment (lenv)
- * and a lvalue (lval) and returns a lval.
- */
-typedef lval*(*lbuiltin)(lenv *, lval *);
+struct lchunk;
+struct lmemo;
+struct lhamt;
+struct lfuture;
+typedef struct lchunk lchunk;
+typedef struct lmemo lmemo;
+typedef struct lhamt lhamt;
+typedef struct lfuture lfuture;
 
 /* possible lval types
  * LVAL_ERR: an error
@@ -79,42 +120,262 @@ typedef lval*(*lbuiltin)(lenv *, lval *);
  *             (http://www.buildyourownlisp.com/chapter9_s_expressions)
  * LVAL_QEXPR: a quoted expression (Q-Expression) = a "literal list".
  * LVAL_FUN: a function.
+ * LVAL_TAIL: a call in tail position, still to be evaluated (see lval_tail).
+ *            Never seen outside of the evaluator.
+ * LVAL_VEC: a vector, a packed array of 64 bit numbers.
+ * LVAL_MAP: a map, from keys to values (any lvals), which is persistent:
+ *           "changing" it makes a new map, sharing most of the old one.
+ * LVAL_FUT: a future, the value of an expression being evaluated by
+ *           another thread (see builtin_future).
  */
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_DEF };
-/*         0         1         2          3          4          5         6         7     */
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_SEXPR, LVAL_QEXPR,
+/*         0         1         2         3         4           5 */
+       LVAL_FUN, LVAL_DEF, LVAL_TAIL, LVAL_VEC, LVAL_MAP, LVAL_FUT };
+/*         6         7         8          9         10        11 */
 
 /* Struct to hold the result of an evaluation. */
-struct lval {
-    int type;
-
-    /* Basic types */
-    long num;
-    char *err;
-    char *sym;
-    char *str;
-
-    /* Function */
-    lbuiltin builtin_fun;
-    lenv *env;
-    lval *formals;
-    lval *body;
+/* Only the fields of one type are used at a time, so they share a union
+ * and a lval fits in a cache line (LVAL_SIZE bytes). Strings and errors
+ * shorter than LVAL_INLINE bytes are stored inside the lval itself, in
+ * "text", with str (or err) pointing to it. Longer strings may be ropes
+ * (see lval_str_concat), whose text is only put together when needed.
+ */
+#define LVAL_SIZE 64
+#define LVAL_INLINE (LVAL_SIZE - 2 * sizeof(int) - sizeof(char *))
 
-    /* Expression */
-    int count;
-    /* Cell is a pointer to an array of lvals (the children) */
-    struct lval **cell;
+struct lval {
+    unsigned char type;
+    /* Reachable in the current garbage collection (--gc). */
+    unsigned char mark;
+    /* Number of references (with --gc, 2 once it was ever shared). A
+     * shared lval (refs > 1) is immutable. */
+    int refs;
+
+    union {
+        /* Number */
+        long num;
+
+        /* Error and String */
+        struct {
+            union {
+                char *err;
+                char *str;
+            };
+            union {
+                char text[LVAL_INLINE];
+                /* Text not stored inline: rope_len chars, in str (malloc'd)
+                 * or, until the rope is flattened, str is NULL and they
+                 * are rope_left followed by rope_right (a concatenation),
+                 * or the chars of rope_left from rope_start (a substring
+                 * of a flat String, with rope_right NULL). rope_depth is
+                 * the height of the rope, 0 for a flat String. */
+                struct {
+                    long rope_len;
+                    lval *rope_left;
+                    lval *rope_right;
+                    long rope_start;
+                    int rope_depth;
+                };
+            };
+        };
+
+        /* Symbol */
+        struct {
+            char *sym;
+            /* Slot of the binding in the frame of the enclosing function. */
+            int slot;
+        };
+
+        /* Function. A closure: the formals and body never change, env holds
+         * the free variables captured when it was created (see
+         * lenv_capture), and each call gets a fresh frame for the arguments
+         * (see lval_call). */
+        struct {
+            lbuiltin builtin_fun;
+            union {
+                lenv *env;
+                /* Cache of a memoized function (see builtin_memo). */
+                lmemo *memo;
+            };
+            lval *formals;
+            lval *body;
+            /* Compiled body, when running with the bytecode VM (or NULL). */
+            lchunk *chunk;
+            /* For a partial application, the function applied and the
+             * arguments given so far, in a S-Expression. For a memoized
+             * function, the function applied and no arguments. Else NULL. */
+            lval *applied;
+            lval *args;
+        };
+
+        /* Tail call: evaluate tail_expr (or run tail_chunk) in tail_env.
+         * If tail_fun is set, tail_env is the new frame of a call to it,
+         * owned by the tail call. */
+        struct {
+            lval *tail_fun;
+            lenv *tail_env;
+            lval *tail_expr;
+            lchunk *tail_chunk;
+        };
+
+        /* Expression */
+        struct {
+            int count;
+            /* Slots allocated, and slots popped off the front of them. */
+            int capacity;
+            int offset;
+            /* Children past count in the block, added by joins that
+             * extended the expression while it was shared (see lval_join),
+             * which it holds references to as well. */
+            int extra;
+            /* Cell is a pointer to an array of lvals (the children) */
+            struct lval **cell;
+            /* For a slice of another expression, the expression that owns
+             * the cells (see lval_slice), else NULL. */
+            struct lval *base;
+        };
+
+        /* Vector: len numbers, in a block aligned for SIMD loads. */
+        struct {
+            long len;
+            int64_t *nums;
+        };
+
+        /* Map: nkeys keys, in a hash array mapped trie (or NULL). */
+        struct {
+            long nkeys;
+            lhamt *root;
+        };
+
+        /* Future: shared (reference counted) between copies. */
+        lfuture *fut;
+    };
 };
 
-/* Struct to represent an environment (set of symbols and associated values.) */
+typedef char lval_size_check[sizeof(lval) <= LVAL_SIZE ? 1 : -1];
+
+/* Small numbers are not allocated at all: they are stored as "fixnums" in
+ * the lval pointer itself, shifted left by one with the lowest bit set
+ * (real lvals are always aligned, so their lowest bit is clear). Numbers
+ * out of fixnum range are allocated as usual. Either way, use LTYPE and
+ * LNUM instead of reading the type and num fields directly.
+ */
+#define LVAL_IS_FIXNUM(v) ((uintptr_t) (v) & 1)
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+#define LTYPE(v) (LVAL_IS_FIXNUM(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LVAL_IS_FIXNUM(v) ? (long) ((intptr_t) (v) >> 1) : (v)->num)
+
+/* Struct to represent an environment (set of symbols and associated values.)
+ * The symbols are interned names (see sym_intern). Function frames keep
+ * them in arrays, in binding order. The global environment is hashed: "size"
+ * is then the number of slots and empty slots have a NULL symbol.
+ */
 struct lenv {
     int count;
+    int size;
+    int mark;
     char **syms;
     lval **vals;
     lenv *parent;
+    /* For the variables captured by a function, the name it was first
+     * def'd under (see lval_name), or NULL. */
+    char *name;
+};
+
+/* Number of slots of the syms/vals arrays of e. */
+#define LENV_SLOTS(e) ((e)->size ? (e)->size : (e)->count)
+
+/* Evaluate with the bytecode compiler and VM (--vm). */
+int vm_enabled = 0;
+
+/* A piece of code compiled to bytecode (see vm_run). Chunks are immutable
+ * once compiled, and shared (reference counted) between copies of a
+ * function. */
+struct lchunk {
+    int refs;
+
+    int count;
+    int capacity;
+    int *code;
+
+    int nconsts;
+    lval **consts;
+
+    int nsubs;
+    lchunk **subs;
+
+    /* Current and maximum depth of the stack (tracked while compiling). */
+    int sp;
+    int depth;
+
+    /* Last garbage collection that marked the constants. */
+    int mark;
+};
+
+/* Results of a memoized function (see builtin_memo): a hash table from the
+ * arguments of a call to its result, with the entries also in a list from
+ * the most to the least recently used, which is evicted first once there
+ * are "capacity" of them. Shared (reference counted) between copies of
+ * the function. */
+struct lmemo_entry {
+    unsigned long hash;
+    lval *args;
+    lval *val;
+    struct lmemo_entry *next;
+    struct lmemo_entry *newer;
+    struct lmemo_entry *older;
+};
+
+struct lmemo {
+    int refs;
+    int count;
+    int capacity;
+    int nbuckets;
+    struct lmemo_entry **buckets;
+    struct lmemo_entry *newest;
+    struct lmemo_entry *oldest;
+    long hits;
+    long misses;
+    /* Last garbage collection that marked the entries. */
+    int mark;
+    /* Taken to use the cache while threads run (see par_active). */
+    pthread_mutex_t lock;
+};
+
+/* A node of a hash array mapped trie (see hamt_put). Bit i of datamap (or
+ * nodemap) tells if the node has a key-value pair (or a sub-node) for the
+ * keys with i as the next 5 bits of their hash; they are stored in the
+ * order of the bits, the pairs in kv and the sub-nodes in nodes. When the
+ * hash is used up, keys with the same hash go to a collision node, which
+ * just has a list of ncoll pairs. Nodes are immutable and shared (reference
+ * counted) between maps. */
+struct lhamt {
+    int refs;
+    /* Last garbage collection that marked the node. */
+    int mark;
+    uint32_t datamap;
+    uint32_t nodemap;
+    int ncoll;
+    lval **kv;
+    lhamt **nodes;
+};
+
+/* A future (see builtin_future): expr, to be evaluated in env by whichever
+ * thread claims it first, which then sets val and clears pending. */
+struct lfuture {
+    int refs;
+    int claimed;
+    int pending;
+    lval *expr;
+    lenv *env;
+    lval *val;
+    /* Last garbage collection that marked it. */
+    int mark;
 };
 
 /***** Prototypes *****/
-void lval_print(lval *v);
+void lval_print(FILE *f, lval *v);
 lval *lval_add(lval *v, lval *x);
 lval *builtin_eval(lenv *e, lval *a);
 lval *builtin_op(lenv *e, lval *a, char *op);
@@ -123,18 +384,52 @@ lval *builtin_head(lenv *e, lval *a);
 lval *builtin_tail(lenv *e, lval *a);
 lval *builtin_join(lenv *e, lval *a);
 lval *builtin_exit(lenv *e, lval *a);
+lval *builtin_save_image(lenv *e, lval *a);
+lval *vec_op(lval *a, char *op);
+lval *memo_call(lenv *e, lval *f, lval *v);
+void memo_del(lmemo *m);
+void future_del(lfuture *f);
+void par_wait_all(void);
+void hamt_unref(lhamt *n);
+int hamt_npairs(lhamt *n);
+int hamt_popcount(uint32_t x);
+int lval_map_eq(lval *a, lval *b);
+int lenv_eq(lenv *a, lenv *b);
+unsigned long lenv_hash(lenv *e);
+unsigned long lval_map_hash(lval *v);
+void lval_map_print(FILE *f, lval *v);
+lval *lval_map(void);
+lval *lval_map_put(lval *m, lval *k, lval *v);
+long lval_str_len(lval *v);
+char *lval_str_flat(lval *v);
+void rope_each(lval *v, void (*fn)(const char *, long, void *), void *ctx);
 lval *lval_join(lenv *e, lval *x, lval *y);
 lval *lval_eval(lenv *e, lval *v);
+lval *vm_eval(lenv *e, lval *v);
 lval *lval_take(lval *v, int i);
 lval *lval_pop(lval *v, int i);
 void lval_del(lval *v);
 lval *lval_copy(lval *v);
+lval *lval_unshare(lval *v);
+void lval_own_cells(lval *v);
+void lval_trim(lval *v);
+void lval_join_cells(lval **to, lval *y);
+void lval_free_text(lval *v);
+void lval_free_cells(lval *v);
 lval *lenv_get(lenv *e, lval *v);
 
 lenv *lenv_new(void);
 void lenv_del(lenv *v);
+void lenv_free(lenv *e);
 void lenv_put(lenv *e, lval *sym, lval *val);
 lenv *lenv_copy(lenv *v);
+
+lval *lval_apply(lenv *e, lval *v);
+lval *lval_untail(lval *x);
+lval *lval_lookup(lenv *e, lval *k);
+lval *vm_run(lenv *e, lchunk *c);
+lchunk *vm_compile_body(lval *body);
+void chunk_del(lchunk *c);
 /**********************/
 
 char *ltype_name(int t)
@@ -147,1169 +442,7814 @@ char *ltype_name(int t)
         case LVAL_SYM: return "Symbol";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_VEC: return "Vector";
+        case LVAL_MAP: return "Map";
+        case LVAL_FUT: return "Future";
+        case LVAL_TAIL: return "Tail call";
         default: return "Unknown";
     }
 }
 
-/******** Functions to create different types of lvals. *********/
+/*************************** Threads. ****************************/
+
+/* pmap, preduce and future (see par_push) evaluate on several threads at
+ * once. While tasks are unfinished (par_active is set), the values the
+ * threads share are guarded: reference counts change atomically, and the
+ * flattening of ropes takes par_lock (the cache of a memoized function
+ * has a lock of its own). Everything else a thread allocates comes from
+ * its own pools, and is counted in its own stats. When nothing runs in
+ * parallel all this costs a test of par_active (of refs_slow, in
+ * lval_copy and lval_del). The symbol table is always shared, as
+ * different threads may use different interpreters (see caballa_new).
+ */
+int par_active = 0;
+/* This thread is running a parallel task (or evaluating a future). */
+__thread int par_running = 0;
+pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set on the threads evaluating with --gc, and while this thread shares
+ * values with others: while tasks of its interpreter are unfinished, or
+ * while it runs one. lval_copy and lval_del then have more to check (see
+ * lval_del_slow). */
+__thread int refs_slow = 0;
+
+/* par_active is set by the thread pushing tasks, under par.lock, and read
+ * by the threads of other interpreters too, which don't hold any value the
+ * tasks use: for them, either value is right. */
+#define PAR_ACTIVE() __atomic_load_n(&par_active, __ATOMIC_RELAXED)
+
+/* Take a reference, counted in *refs. */
+void refs_inc(int *refs)
+{
+    if (PAR_ACTIVE()) {
+        __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+    } else {
+        (*refs)++;
+    }
+}
 
-/* Construct a pointer to a new Number lval. */
-lval* lval_num(long x)
+/* Drop a reference, returning how many are left. */
+int refs_dec(int *refs)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->num = x;
-    return v;
+    if (PAR_ACTIVE()) {
+        return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL);
+    }
+    return --*refs;
 }
 
-/* Construct a pointer to a new Error lval. */
-lval* lval_err(char *fmt, ...)
+/* References counted in *refs. Once it's the only one left, whoever holds
+ * it may modify the value: what other threads did to it before they
+ * dropped theirs is visible by then. */
+int refs_get(int *refs)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    return PAR_ACTIVE() ? __atomic_load_n(refs, __ATOMIC_ACQUIRE) : *refs;
+}
 
-    /* Create and initialize va list. */
-    va_list va;
-    va_start(va, fmt);
 
-    /* Allocate 2048 bytes of space (max size of error). */
-    v->err = malloc(2048);
-    /* Fill error with the correct string. */
-    vsnprintf(v->err, 2047, fmt, va);
+/*****************************************************************/
+
+/******************** Symbol interning. **************************/
+
+/* Every distinct symbol name is stored exactly once in this table, so
+ * symbols (and the keys of an environment) can be compared and copied by
+ * pointer. Interned names are never freed.
+ * size is always a power of two, and the table is kept at most half full.
+ * Any thread may look names up without locking: names are only ever added
+ * to a table, and published once complete. Adding one takes symtab_lock,
+ * and when the table is full, replaces it by a bigger one (the old one is
+ * kept, as threads may still be reading it).
+ */
+struct symtab {
+    int count;
+    int size;
+    char **names;
+    /* The table this one replaced. */
+    struct symtab *old;
+};
+static struct symtab *symtab;
+static pthread_mutex_t symtab_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    /* Reallocate to number of bytes actually used. */
-    v->err = realloc(v->err, strlen(v->err) + 1);
+/* Well-known symbols, interned once by sym_init. */
+static char *sym_amp;
 
-    /* Destroy va_list and return. */
-    va_end(va);
-    return v;
+/* FNV-1a hash of the n chars at s. */
+unsigned long str_hash(const char *s, size_t n)
+{
+    unsigned long h = 2166136261UL;
+    while (n--) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619UL;
+    }
+    return h;
 }
 
-/* Construct a pointer to a new Symbol lval. */
-lval* lval_sym(char *s)
+/* Replace the symbol table by one twice as big, rehashing every name. */
+void symtab_grow(void)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
+    struct symtab *t = malloc(sizeof(struct symtab));
+    int i;
+
+    t->count = symtab ? symtab->count : 0;
+    t->size = symtab ? symtab->size * 2 : 256;
+    t->names = calloc(t->size, sizeof(char *));
+    t->old = symtab;
+    for (i = 0; symtab && i < symtab->size; i++) {
+        if (symtab->names[i]) {
+            unsigned long j = str_hash(symtab->names[i],
+                                       strlen(symtab->names[i])) &
+                              (t->size - 1);
+            while (t->names[j]) {
+                j = (j + 1) & (t->size - 1);
+            }
+            t->names[j] = symtab->names[i];
+        }
+    }
+    __atomic_store_n(&symtab, t, __ATOMIC_RELEASE);
 }
 
-/* Construct a pointer to a new String lval. */
-lval *lval_str(char *s)
+/* The name made of the n chars at s (whose hash is h) if it's in the
+ * table t, else NULL, with *slot set to where it would go. */
+char *symtab_find(struct symtab *t, const char *s, size_t n, unsigned long h,
+                  unsigned long *slot)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
-    return v;
+    unsigned long i = h & (t->size - 1);
+    char *name;
+    while ((name = __atomic_load_n(&t->names[i], __ATOMIC_ACQUIRE))) {
+        if (strncmp(name, s, n) == 0 && name[n] == '\0') {
+            return name;
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+    *slot = i;
+    return NULL;
 }
 
-/* A pointer to a new empty Sexpr lval. */
-lval* lval_sexpr(void)
+/* Return the unique interned copy of the name made of the n chars at s
+ * (which need not be null-terminated), adding it to the table if needed. */
+char *sym_intern_n(const char *s, size_t n)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    unsigned long h = str_hash(s, n), i;
+    struct symtab *t = __atomic_load_n(&symtab, __ATOMIC_ACQUIRE);
+    char *name;
+
+    if (t && (name = symtab_find(t, s, n, h, &i))) {
+        return name;
+    }
+    pthread_mutex_lock(&symtab_lock);
+    if (! symtab || 2 * (symtab->count + 1) > symtab->size) {
+        symtab_grow();
+    }
+    t = symtab;
+    if (! (name = symtab_find(t, s, n, h, &i))) {
+        name = malloc(n + 1);
+        memcpy(name, s, n);
+        name[n] = '\0';
+        __atomic_store_n(&t->names[i], name, __ATOMIC_RELEASE);
+        t->count++;
+    }
+    pthread_mutex_unlock(&symtab_lock);
+    return name;
 }
 
-/* A pointer to a new empty Qexpr lval. */
-lval *lval_qexpr(void)
+/* Return the unique interned copy of s, adding it to the table if needed. */
+char *sym_intern(const char *s)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    return sym_intern_n(s, strlen(s));
 }
 
-/* A pointer to a lval which contains a ptr to a builtin function. */
-lval *lval_fun(lbuiltin func)
+void sym_init(void)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin_fun = func;
-    return v;
+    sym_amp = sym_intern("&");
 }
 
-/* A pointer to a lval containing a user defined function.
- * formals: a q-expression containing the symbols of the parameters.
- * body: a q-expression containing the function body.
+/*****************************************************************/
+
+/*********************** Statistics. *****************************/
+
+/* Counters of what the interpreter allocates, frees and copies. They are
+ * always kept (each costs an increment) and reported by (stats {}) and, at
+ * exit, by --stats. Counters of lvals are kept by type. Note lval_copy
+ * only takes another reference ("shares" a value): a value is actually
+ * copied by lval_clone, when a shared value is modified (see
+ * lval_unshare). The heap is what the pools hand out (lvals, environments
+ * and the arrays of their children and bindings), plus the texts of
+ * strings, the numbers of vectors and the nodes of maps.
+ * Each thread keeps its own counters: those of the workers are added to
+ * the main thread's once their tasks are finished (see par_settle).
  */
-lval *lval_lambda(lval *formals, lval *body)
-{
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_FUN;
+#define LVAL_TYPES (LVAL_FUT + 1)
+
+struct stats {
+    long allocs[LVAL_TYPES];
+    long frees[LVAL_TYPES];
+    /* References taken (lval_copy) and copies made (lval_clone). */
+    long shares[LVAL_TYPES];
+    long clones[LVAL_TYPES];
+    /* Environments created, freed and copied (lenv_copy). */
+    long envs, env_frees, env_copies;
+    /* Arrays of children that had to grow, or move (in lval_reserve). */
+    long grows;
+    /* Bytes allocated in all, in use, and at most in use. */
+    long bytes, heap, peak;
+};
 
-   /* builtin_fun = null indicates that this is a user defined function, and not a
-    * builtin function. */
-   v->builtin_fun = NULL;
+__thread struct stats stats;
+/* The counters at the last (stats-reset {}): (stats {}) and --stats
+ * report the counts since then, but what is live is live. */
+__thread struct stats stats_base;
 
-   v->env = lenv_new();
+#define STATS_SINCE(s, f) ((s).f - stats_base.f)
 
-   /* Set formalas and body. */
-   v->formals = formals;
-   v->body = body;
-   return v;
+/* With --gc (gc_init sets gc_counting), the bytes of the heap in use in all
+ * threads together, as only one evaluates at a time then: the collector
+ * runs once they pass its threshold (see gc_safepoint). */
+int gc_counting = 0;
+long gc_bytes = 0;
+
+/* n more bytes in use. */
+void stats_alloc(size_t n)
+{
+    if (gc_counting) {
+        gc_bytes += n;
+    }
+    stats.bytes += n;
+    stats.heap += n;
+    if (stats.heap > stats.peak) {
+        stats.peak = stats.heap;
+    }
 }
 
-/*****************************************************************/
-/****************** Functions to handle lvals. ******************/
+/* n fewer bytes in use. */
+void stats_free(size_t n)
+{
+    if (gc_counting) {
+        gc_bytes -= n;
+    }
+    stats.heap -= n;
+}
 
-/* delete a lval and it's children (if it's a S-Expression) */
-void lval_del(lval *v)
+/* lvals allocated so far (for the profiler). */
+long stats_lvals(void)
 {
-    switch (v->type) {
-        /* Do nothing special for number type. */
-        case LVAL_NUM:
-            break;
-        /* For Err or Sym free the string data. */
-        case LVAL_ERR:
-            free(v->err);
-            break;
-        case LVAL_SYM:
-            free(v->sym);
-            break;
-        case LVAL_STR:
-            free(v->str);
-            break;
+    long n = 0;
+    int t;
+    for (t = 0; t < LVAL_TYPES; t++) {
+        n += stats.allocs[t];
+    }
+    return n;
+}
 
-        /* If Qexpr or Sexpr then delete all elements inside. */
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            for (int i = 0; i < v->count; i++) {
-                lval_del(v->cell[i]);
-            }
-            /* Also free the memory allocated to contain the pointers. */
-            free(v->cell);
-            break;
-        case LVAL_FUN:
-            if (! v->builtin_fun) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
-            }
-            break;
+/* Add the counters of from (another thread's) to those of to. The heap
+ * then peaked at most that much higher. */
+void stats_add(struct stats *to, struct stats *from)
+{
+    int t;
+    for (t = 0; t < LVAL_TYPES; t++) {
+        to->allocs[t] += from->allocs[t];
+        to->frees[t] += from->frees[t];
+        to->shares[t] += from->shares[t];
+        to->clones[t] += from->clones[t];
     }
-    /* Free the memory allocated for the "lval" struct itself. */
-    free(v);
+    to->envs += from->envs;
+    to->env_frees += from->env_frees;
+    to->env_copies += from->env_copies;
+    to->grows += from->grows;
+    to->bytes += from->bytes;
+    to->peak = max(to->peak, to->heap + from->peak);
+    to->heap += from->heap;
 }
 
-/* Return pointer to a copy of the lval pointed to by v. */
-lval *lval_copy(lval *v)
+void stats_reset(void)
 {
-    int i;
-    lval *x = malloc(sizeof(lval));
-    x->type = v->type;
+    stats.peak = stats.heap;
+    stats_base = stats;
+}
 
-    switch(v->type) {
-        /* Copy functions and numbers directly. */
-        case LVAL_FUN:
-            x->builtin_fun = v->builtin_fun;
-            if (! x->builtin_fun) {
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
-            }
-            break;
+/* Print the counters on stderr (at exit, with --stats). */
+void stats_report(void)
+{
+    int t;
+    fprintf(stderr, "stats: %-12s %12s %12s %12s %12s %12s\n", "type",
+            "allocs", "frees", "live", "shares", "clones");
+    for (t = 0; t < LVAL_TYPES; t++) {
+        if (stats.allocs[t] || stats.shares[t]) {
+            fprintf(stderr, "stats: %-12s %12ld %12ld %12ld %12ld %12ld\n",
+                    ltype_name(t), STATS_SINCE(stats, allocs[t]),
+                    STATS_SINCE(stats, frees[t]),
+                    stats.allocs[t] - stats.frees[t],
+                    STATS_SINCE(stats, shares[t]),
+                    STATS_SINCE(stats, clones[t]));
+        }
+    }
+    fprintf(stderr, "stats: %-12s %12ld %12ld %12ld %12s %12ld\n",
+            "Environment", STATS_SINCE(stats, envs),
+            STATS_SINCE(stats, env_frees), stats.envs - stats.env_frees, "",
+            STATS_SINCE(stats, env_copies));
+    fprintf(stderr, "stats: %ld lists grown, %ld bytes allocated, heap %ld "
+            "bytes, at most %ld bytes\n", STATS_SINCE(stats, grows),
+            STATS_SINCE(stats, bytes), stats.heap, stats.peak);
+}
 
-        case LVAL_NUM:
-            x->num = v->num;
-            break;
+/*****************************************************************/
 
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
-            break;
+/********************** Memory pools. ****************************/
 
-        /* Copy strings using malloc and strcpy. */
-        case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
-            break;
+/* lvals, lenvs and small arrays (children of expressions, bindings of
+ * frames) are carved out of POOL_SLAB sized slabs. Each power-of-two size
+ * class from 8 to POOL_MAX bytes has its own free list, and the free lists
+ * are per thread so neither allocating nor freeing needs a lock. Larger
+ * blocks are passed on to malloc. Callers give the size of the block back
+ * when freeing it, so blocks carry no header.
+ * Build with -DPOOL_DISABLE to pass every block to malloc (for valgrind).
+ */
+#ifdef POOL_DISABLE
+#define POOL_CLASSES 0
+#define POOL_MAX 0
+#else
+#define POOL_CLASSES 6
+#define POOL_MAX (8 << (POOL_CLASSES - 1))
+#endif
+#define POOL_SLAB (64 * 1024)
 
-        case LVAL_STR:
-            x->str = malloc(strlen(v->err) + 1);
-            strcpy(x->str, v->err);
-            break;
+struct pool_block {
+    struct pool_block *next;
+};
 
-        /* Copy lists by copying each sub-expression. */
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval *) * x->count);
-            for (i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
-            break;
-    }
+static __thread struct pool_block *pool_free_list[POOL_CLASSES + 1];
 
-    return x;
-}
+/* The free lists of the threads that exited, which pool_refill takes
+ * before carving a new slab. Blocks go to the list of whichever thread
+ * frees them, so a slab is never known to be unused and is not given
+ * back; but a host starting a thread per request doesn't grow. */
+static struct pool_block *pool_orphans[POOL_CLASSES + 1];
+static pthread_mutex_t pool_orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static __thread int pool_registered = 0;
 
-/* Given two lvals, "v" and "x", adds "x" to the list of children of "v".
- * Returns v. */
-lval* lval_add(lval *v, lval *x)
+/* Destructor of pool_key, run when a thread that allocated exits. */
+void pool_thread_exit(void *unused)
 {
-    /* Increment the count of children */
-    v->count++;
-    /* Increment accordingly the space allocated for the cells */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    /* Add the lval as the last children */
-    v->cell[v->count - 1] = x;
-    return v;
-}
+    struct pool_block *b;
+    int c;
 
-/* Join two lvalues. */
-lval* lval_join(lenv *e, lval *x, lval *y)
-{
-    while (y->count) {
-        lval_add(x, lval_pop(y, 0));
+    pthread_mutex_lock(&pool_orphans_lock);
+    for (c = 0; c < POOL_CLASSES + 1; c++) {
+        if (! pool_free_list[c]) {
+            continue;
+        }
+        for (b = pool_free_list[c]; b->next; b = b->next) {
+        }
+        b->next = pool_orphans[c];
+        pool_orphans[c] = pool_free_list[c];
+        pool_free_list[c] = NULL;
     }
-
-    /* Delete the empty 'y' and return 'x'. */
-    lval_del(y);
-    return x;
+    pthread_mutex_unlock(&pool_orphans_lock);
 }
 
-/* Returns the ith lval of sepxr "v", removing it from "v" */
-lval* lval_pop(lval *v, int i)
+void pool_key_init(void)
 {
-    /* Find the item at "i". */
-    lval *x = v->cell[i];
-
-    /* Shift memory after the item at "i" over the top. */
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*)*(v->count - i - 1));
-
-    /* Decrease the count of items in the list. */
-    v->count--;
-
-    /* Reallocate the memory used. */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+    pthread_key_create(&pool_key, pool_thread_exit);
 }
 
-/* Returns the ith lval of sexpr "v", destroying "v". */
-lval* lval_take(lval *v, int i)
+/* Have pool_thread_exit run when this thread exits. */
+void pool_register(void)
 {
-    lval *x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+    if (! pool_registered) {
+        pthread_once(&pool_key_once, pool_key_init);
+        pthread_setspecific(pool_key, &pool_registered);
+        pool_registered = 1;
+    }
 }
 
-lval* lval_read_num(mpc_ast_t *t)
+/* Size class of a block of size bytes (0 < size <= POOL_MAX). */
+int pool_class(size_t size)
 {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+    int c = 0;
+    while ((size_t) (8 << c) < size) {
+        c++;
+    }
+    return c;
 }
 
-lval *lval_read_str(mpc_ast_t *t)
+/* Take the blocks of class c of exited threads, or else carve a new slab
+ * into blocks of class c. */
+void pool_refill(int c)
 {
-    /* Cut off the final quote character. */
-    t->contents[strlen(t->contents) - 1] = '\0';
-
-    /* Copy the string missing out the first quote character. */
-    char *unescaped = malloc(strlen(t->contents + 1) + 1);
-    strcpy(unescaped, t->contents+1);
-    /* Pass through the unescape function. */
-    unescaped = mpcf_unescape(unescaped);
-
-    /* Construct a new lval using the string. */
-    lval *str = lval_str(unescaped);
-
-    /* Free the string and return. */
-    free(unescaped);
-    return str;
+    size_t size = 8 << c;
+    char *p, *slab;
+
+    pool_register();
+    pthread_mutex_lock(&pool_orphans_lock);
+    pool_free_list[c] = pool_orphans[c];
+    pool_orphans[c] = NULL;
+    pthread_mutex_unlock(&pool_orphans_lock);
+    if (pool_free_list[c]) {
+        return;
+    }
+    slab = malloc(POOL_SLAB);
+    for (p = slab; p + size <= slab + POOL_SLAB; p += size) {
+        ((struct pool_block *) p)->next = pool_free_list[c];
+        pool_free_list[c] = (struct pool_block *) p;
+    }
 }
 
-lval* lval_read(mpc_ast_t *t)
+void *pool_alloc(size_t size)
 {
-    /* If Symbol or Number return conversion to that type */
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-    if (strstr(t->tag, "string")) { return lval_read_str(t); }
-
-    /* If root (>) or sexpr then create empty list */
-    lval *x = NULL;
-    if (STREQ(t->tag, ">") ||
-        strstr(t->tag, "sexpr")) {
-        x = lval_sexpr();
+    int c;
+    struct pool_block *b;
+    if (size == 0) {
+        return NULL;
     }
-
-    if (strstr(t->tag, "qexpr")) {
-        x = lval_qexpr();
+    stats_alloc(size);
+    if (size > POOL_MAX) {
+        return malloc(size);
     }
+    c = pool_class(size);
+    if (! pool_free_list[c]) {
+        pool_refill(c);
+    }
+    b = pool_free_list[c];
+    pool_free_list[c] = b->next;
+    return b;
+}
 
-    /* Fill this list with any valid expression contained within */
-    for (int i = 0; i < t->children_num; i++) {
-        if (STREQ(t->children[i]->contents, "(") ||
-            STREQ(t->children[i]->contents, ")") ||
-            STREQ(t->children[i]->contents, "}") ||
-            STREQ(t->children[i]->contents, "{") ||
-            STREQ(t->children[i]->tag, "regex")) {
-            continue;
-        }
-        lval_add(x, lval_read(t->children[i]));
+/* Free a block p of size bytes. */
+void pool_free(void *p, size_t size)
+{
+    int c;
+    if (! p) {
+        return;
     }
-    return x;
+    stats_free(size);
+    if (size > POOL_MAX) {
+        free(p);
+        return;
+    }
+    c = pool_class(size);
+    ((struct pool_block *) p)->next = pool_free_list[c];
+    pool_free_list[c] = p;
 }
 
-lval *lval_call(lenv *e, lval *f, lval *v)
+/* Resize a block p of old bytes to size bytes. Within a size class this
+ * does nothing at all (but count). */
+void *pool_realloc(void *p, size_t old, size_t size)
 {
-    int given, total;
-    /* If builtin then simply call that. */
-    if (f->builtin_fun) {
-        return f->builtin_fun(e, v);
+    void *n;
+    if (! p) {
+        return pool_alloc(size);
     }
-    /* Record argument counts. */
-    given = v->count;
-    total = f->formals->count;
+    if (size == 0) {
+        pool_free(p, old);
+        return NULL;
+    }
+    if (old > POOL_MAX && size > POOL_MAX) {
+        stats_free(old);
+        stats_alloc(size);
+        return realloc(p, size);
+    }
+    if (old <= POOL_MAX && size <= POOL_MAX &&
+        pool_class(old) == pool_class(size)) {
+        stats_free(old);
+        stats_alloc(size);
+        return p;
+    }
+    n = pool_alloc(size);
+    memcpy(n, p, min(old, size));
+    pool_free(p, old);
+    return n;
+}
 
-    /* While there are still arguments to be processed... */
-    while (v->count) {
-        /* If we've ran out of formal arguments to bind... */
-        if (f->formals->count == 0) {
-            lval_del(v);
-            return lval_err("Function passed too many arguments. "
-                            "Expected %d, but got %d.", total, given);
-        }
+/*****************************************************************/
 
-        /* Pop the first symbol from the formals. */
-        lval *sym = lval_pop(f->formals, 0);
+/******************** Garbage collector. **************************/
+
+/* By default memory is managed by reference counting (lval_copy and
+ * lval_del). With --gc, lval_del does nothing and values are shared
+ * freely; lval_copy still marks the values it shares (with a count of 2,
+ * which is never dropped), so a value whose count is 1 was never shared
+ * and may still be modified in place (see lval_unshare). Every lval and
+ * lenv is recorded here and a mark-and-sweep collector frees whatever is
+ * not reachable from the root stack, on which main pushes the global
+ * environment and the evaluator its temporaries. Collections only happen
+ * at safe points (gc_safepoint), once the heap (as counted by stats_alloc)
+ * has grown past gc.threshold bytes.
+ */
+enum { GC_LVAL, GC_ENV, GC_CHUNK, GC_STACK };
+
+struct gc_root {
+    int kind;
+    /* Address of the rooted variable; for GC_STACK, start of the stack. */
+    void *ptr;
+    /* GC_STACK: address of the stack pointer (end of the live values). */
+    lval ***end;
+};
 
-        /* Special case to deal with '&' */
-        if (STREQ(sym->sym, "&")) {
+struct gc_heap {
+    int enabled;
+    /* Report every collection on stderr (--gc-verbose). */
+    int verbose;
 
-            /* Ensure '&' is followed by another symbol */
-            if (f->formals->count != 1) {
-                lval_del(v);
-                return lval_err("Function format is invalid. "
-                                "Symbol '&' not followed by single symbol.");
-            }
+    int nvals, capvals;
+    lval **vals;
+    int nenvs, capenvs;
+    lenv **envs;
 
-            /* Next formal should be bound to remaining arguments. */
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, v));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
-        }
+    int nroots, caproots;
+    struct gc_root *roots;
 
+    long threshold;
 
-        /* Pop the next argument from the list. */
-        lval *val = lval_pop(v, 0);
+    /* Statistics. */
+    int collections;
+    double pause_last;
+    double pause_max;
+    double pause_total;
+};
 
-        /* Bind a copy into the function's environment. */
-        lenv_put(f->env, sym, val);
+#ifndef GC_MIN_THRESHOLD
+#define GC_MIN_THRESHOLD (1024 * 1024)
+#endif
 
-        /* Delete symbol and value. */
-        lval_del(sym);
-        lval_del(val);
+static struct gc_heap gc = { 0 };
 
+void gc_track_lval(lval *v)
+{
+    if (gc.nvals == gc.capvals) {
+        gc.capvals = gc.capvals ? gc.capvals * 2 : 1024;
+        gc.vals = realloc(gc.vals, sizeof(lval *) * gc.capvals);
     }
-    /* Argument list is now bound so can be cleaned up. */
-    lval_del(v);
-
-    /* If '&' remains in formal list bind to empty list. */
-    if (f->formals->count > 0 && STREQ(f->formals->cell[0]->sym, "&")) {
-        /* Check to ensure that '&' is not passed invalidly. */
-        if (f->formals->count != 2) {
-            return lval_err("Function format is invalid. "
-                            "Symbol '&' not followed by single symbol.");
-        }
-
-        /* Pop and delete '&' symbol. */
-        lval_del(lval_pop(f->formals, 0));
-
-        /* Pop next symbol and create empty list. */
-        lval *sym = lval_pop(f->formals, 0);
-        lval *val = lval_qexpr();
+    v->mark = 0;
+    gc.vals[gc.nvals++] = v;
+}
 
-        /* Bind to environment and delete. */
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+void gc_track_env(lenv *e)
+{
+    if (gc.nenvs == gc.capenvs) {
+        gc.capenvs = gc.capenvs ? gc.capenvs * 2 : 256;
+        gc.envs = realloc(gc.envs, sizeof(lenv *) * gc.capenvs);
     }
+    e->mark = 0;
+    gc.envs[gc.nenvs++] = e;
+}
 
-
-    /* If all formals have been bound evaluate. */
-    if (f->formals->count == 0) {
-        /* Set environment parent to evaluation environment. */
-        f->env->parent = e;
-
-        /* Evaluate and return. */
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        /* Otherwise return partially evaluated function. */
-        return lval_copy(f);
+/* Push a root. Every push must be matched by a gc_pop. */
+void gc_push(int kind, void *ptr, lval ***end)
+{
+    if (! gc.enabled) {
+        return;
     }
+    if (gc.nroots == gc.caproots) {
+        gc.caproots = gc.caproots ? gc.caproots * 2 : 256;
+        gc.roots = realloc(gc.roots, sizeof(struct gc_root) * gc.caproots);
+    }
+    gc.roots[gc.nroots].kind = kind;
+    gc.roots[gc.nroots].ptr = ptr;
+    gc.roots[gc.nroots].end = end;
+    gc.nroots++;
 }
 
-int lval_eq(lval *a, lval *b)
+/* Pop the last n roots. */
+void gc_pop(int n)
 {
-    /* If type is different, they are different. */
-    if (a->type != b->type) {
-        return 0;
+    if (gc.enabled) {
+        gc.nroots -= n;
     }
+}
 
-    switch(a->type) {
+void gc_mark_env(lenv *e);
+void gc_mark_lval(lval *v);
 
-    case LVAL_NUM:
-        return a->num == b->num;
-    case LVAL_SYM:
-        return STREQ(a->sym, b->sym);
-    case LVAL_ERR:
-        return STREQ(a->err, b->err);
-    case LVAL_STR:
-        return STREQ(a->str, b->str);
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-        if (a->count != b->count) {
-            return 0;
-        }
-        for (int i = 0; i < a->count; i++) {
-            if (! lval_eq(a->cell[i], b->cell[i])) {
-                return 0;
-            }
-        }
-        return 1;
-    case LVAL_FUN:
-        /* If any is a builtin (ptr to a function), then
-         * we can compare these pointers. */
-        if (a->builtin_fun || b->builtin_fun) {
-            return a->builtin_fun == b->builtin_fun;
-        } else {
-            return lval_eq(a->formals, b->formals) &&
-                lval_eq(a->body, b->body);
-        }
+void gc_mark_chunk(lchunk *c)
+{
+    int i;
+    if (c->mark == gc.collections) {
+        return;
+    }
+    c->mark = gc.collections;
+    for (i = 0; i < c->nconsts; i++) {
+        gc_mark_lval(c->consts[i]);
+    }
+    for (i = 0; i < c->nsubs; i++) {
+        gc_mark_chunk(c->subs[i]);
     }
-    return 0;
 }
 
-/*****************************************************************/
-/******************* Functions to print lvals ********************/
-void print_error(char *msg)
+void gc_mark_hamt(lhamt *n)
 {
-    printf("Error: %s\n", msg);
+    int i;
+    if (! n || n->mark == gc.collections) {
+        return;
+    }
+    n->mark = gc.collections;
+    for (i = 0; i < 2 * hamt_npairs(n); i++) {
+        gc_mark_lval(n->kv[i]);
+    }
+    for (i = 0; i < hamt_popcount(n->nodemap); i++) {
+        gc_mark_hamt(n->nodes[i]);
+    }
 }
 
-/* Print a lvalue (with all it's children) between chars open and close
- * (usually '(' and ')')
- */
-void lval_expr_print(lval *v, char open, char close)
+void gc_mark_future(lfuture *f)
 {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        /* Print Value contained within */
-        lval_print(v->cell[i]);
-        /* Don't print trailing space if last element */
-        if (i != (v->count - 1)) {
-            putchar(' ');
-        }
+    if (f->mark == gc.collections) {
+        return;
+    }
+    f->mark = gc.collections;
+    if (f->expr) {
+        gc_mark_lval(f->expr);
+    }
+    if (f->env) {
+        gc_mark_env(f->env);
+    }
+    if (f->val) {
+        gc_mark_lval(f->val);
     }
-    putchar(close);
 }
 
-/* Print an escaped string, with newlines, etc. */
-void lval_print_str(lval *v)
+void gc_mark_memo(lmemo *m)
 {
-    char *escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
-    escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
+    struct lmemo_entry *x;
+    if (m->mark == gc.collections) {
+        return;
+    }
+    m->mark = gc.collections;
+    for (x = m->newest; x; x = x->older) {
+        gc_mark_lval(x->args);
+        gc_mark_lval(x->val);
+    }
 }
 
-/* Handle different representations depending on the type of lval. */
-void lval_print(lval *v)
+void gc_mark_lval(lval *v)
 {
-    switch(v->type) {
-        case LVAL_NUM:
-            printf("%li", v->num);
+    int i;
+    if (! v || LVAL_IS_FIXNUM(v) || v->mark) {
+        return;
+    }
+    v->mark = 1;
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (i = 0; i < v->count; i++) {
+                gc_mark_lval(v->cell[i]);
+            }
+            gc_mark_lval(v->base);
             break;
-        case LVAL_ERR:
-            printf("Error: %s", v->err);
+        case LVAL_FUN:
+            if (! v->builtin_fun && v->args) {
+                gc_mark_lval(v->applied);
+                gc_mark_lval(v->args);
+            } else if (! v->builtin_fun && v->applied) {
+                gc_mark_lval(v->applied);
+                gc_mark_memo(v->memo);
+            } else if (! v->builtin_fun) {
+                gc_mark_env(v->env);
+                gc_mark_lval(v->formals);
+                gc_mark_lval(v->body);
+                if (v->chunk) {
+                    gc_mark_chunk(v->chunk);
+                }
+            }
             break;
-        case LVAL_SYM:
-            printf("%s", v->sym);
+        case LVAL_TAIL:
+            gc_mark_lval(v->tail_fun);
+            gc_mark_env(v->tail_env);
+            gc_mark_lval(v->tail_expr);
             break;
         case LVAL_STR:
-            lval_print_str(v);
+            if (v->str != v->text) {
+                gc_mark_lval(v->rope_left);
+                gc_mark_lval(v->rope_right);
+            }
             break;
-        case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
+        case LVAL_MAP:
+            gc_mark_hamt(v->root);
+            break;
+        case LVAL_FUT:
+            gc_mark_future(v->fut);
+            break;
+    }
+}
+
+void gc_mark_env(lenv *e)
+{
+    int i;
+    while (e && ! e->mark) {
+        e->mark = 1;
+        for (i = 0; i < LENV_SLOTS(e); i++) {
+            if (e->syms[i]) {
+                gc_mark_lval(e->vals[i]);
+            }
+        }
+        e = e->parent;
+    }
+}
+
+/* Free the memory of a single unreachable lval (not its children). */
+void gc_free_lval(lval *v)
+{
+    switch (v->type) {
+        case LVAL_ERR:
+        case LVAL_STR:
+            lval_free_text(v);
             break;
         case LVAL_QEXPR:
-            lval_expr_print(v, '{', '}');
+        case LVAL_SEXPR:
+            if (! v->base) {
+                lval_free_cells(v);
+            }
             break;
         case LVAL_FUN:
-            if (v->builtin_fun) {
-                printf("<function>");
-            } else {
-                printf("(\\ ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+            if (! v->builtin_fun && v->chunk) {
+                chunk_del(v->chunk);
+            }
+            if (! v->builtin_fun && v->applied && ! v->args) {
+                memo_del(v->memo);
             }
             break;
+        case LVAL_VEC:
+            stats_free(sizeof(int64_t) * v->len);
+            free(v->nums);
+            break;
+        case LVAL_MAP:
+            hamt_unref(v->root);
+            break;
+        case LVAL_FUT:
+            future_del(v->fut);
+            break;
     }
+    stats.frees[v->type]++;
+    pool_free(v, sizeof(lval));
 }
 
-/* Print a lval followed by a newline. */
-void lval_println(lval *v)
+double gc_now(void)
 {
-    lval_print(v);
-    putchar('\n');
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
 }
-/*****************************************************************/
-/****************** Functions for evaluation. ********************/
 
-/* Evaluate a S-Expression */
-lval* lval_eval_sexpr(lenv *e, lval *v)
+void gc_collect(void)
 {
-    /* Evaluate children. */
-    int i;
-    for (i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-
-    /* Error checking */
-    for (i = 0; i < v->count; i++) {
-        /* If any children is an error, return it and destroy "v". */
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
+    int i, n;
+    lval **p;
+    struct gc_root *r;
+    double start = gc_now();
+
+    /* Mark. */
+    gc.collections++;
+    for (r = gc.roots; r < gc.roots + gc.nroots; r++) {
+        switch (r->kind) {
+            case GC_LVAL:
+                gc_mark_lval(*(lval **) r->ptr);
+                break;
+            case GC_ENV:
+                gc_mark_env(*(lenv **) r->ptr);
+                break;
+            case GC_CHUNK:
+                gc_mark_chunk(*(lchunk **) r->ptr);
+                break;
+            case GC_STACK:
+                for (p = r->ptr; p < *r->end; p++) {
+                    gc_mark_lval(*p);
+                }
+                break;
         }
     }
 
-    /* Empty expression */
-    if (v->count == 0) {
-        return v;
+    /* Sweep. */
+    for (i = 0, n = 0; i < gc.nvals; i++) {
+        if (gc.vals[i]->mark) {
+            gc.vals[i]->mark = 0;
+            gc.vals[n++] = gc.vals[i];
+        } else {
+            gc_free_lval(gc.vals[i]);
+        }
     }
-
-    /* Single expression: unless it's a function,
-     * return first children, destroy sexpr. */
-    if (v->count == 1) {
-        return lval_take(v, 0);
+    gc.nvals = n;
+    for (i = 0, n = 0; i < gc.nenvs; i++) {
+        if (gc.envs[i]->mark) {
+            gc.envs[i]->mark = 0;
+            gc.envs[n++] = gc.envs[i];
+        } else {
+            lenv_free(gc.envs[i]);
+        }
     }
-
-    /* Ensure first element is a function after evaluation. */
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval *err = lval_err("S-Expression starts with incorrect type. "
-                        "Expected %s, but got %s.",
-                        ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f);
-        return err;
+    gc.nenvs = n;
+
+    /* Collect again once the heap has doubled. */
+    gc.threshold = max(GC_MIN_THRESHOLD, 2 * gc_bytes);
+
+    gc.pause_last = gc_now() - start;
+    gc.pause_max = max(gc.pause_max, gc.pause_last);
+    gc.pause_total += gc.pause_last;
+    if (gc.verbose) {
+        fprintf(stderr, "gc: collection %d: %d values, %d environments "
+                "live, pause %.3f ms\n", gc.collections, gc.nvals, gc.nenvs,
+                gc.pause_last * 1e3);
     }
+}
 
-    /* Call function to get result. */
-    lval *result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+/* Print the collector's statistics on stderr (at exit). */
+void gc_report(void)
+{
+    fprintf(stderr, "gc: %d collections, %ld bytes in heap, pauses: "
+            "total %.3f ms, max %.3f ms, mean %.3f ms\n", gc.collections,
+            gc_bytes, gc.pause_total * 1e3, gc.pause_max * 1e3,
+            gc.collections ? gc.pause_total * 1e3 / gc.collections : 0.0);
 }
 
-lval* lval_eval(lenv *e, lval *v)
+/* A point where every live temporary is reachable from the roots. */
+void gc_safepoint(void)
 {
-    /* Evaluate S-Expressions */
-    if (v->type == LVAL_SYM) {
-        lval *x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+    if (gc.enabled && gc_bytes > gc.threshold) {
+        gc_collect();
     }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
-    }
-    /* All other lval types remain the same. */
-    return v;
 }
 
-/* Evaluate a S-Expression. */
-lval *builtin_eval(lenv *e, lval *a)
+void gc_init(int verbose)
 {
-    LASSERT_NARGS(a, a->count, 1, "eval");
-    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "eval");
-
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    gc.enabled = 1;
+    gc_counting = 1;
+    gc_bytes = stats.heap;
+    refs_slow = 1;
+    gc.verbose = verbose;
+    gc.threshold = GC_MIN_THRESHOLD;
+    atexit(gc_report);
 }
 
+/*********************** Profiler. *******************************/
 
+/* With --profile=file, or inside (profile {expr}), every call is timed:
+ * calls of builtins by lval_call, and calls of lambdas for as long as they
+ * run in the loop of lval_eval (a call in tail position takes over from
+ * its caller, as it does on the stack). Each chain of calls seen is a node
+ * of a tree, so recursion costs a node per level, not per call. Lambdas
+ * are known by the name they were first def'd under (see lval_name).
+ */
+struct prof_node {
+    /* The function called: a builtin, or else a lambda with this name (or
+     * NULL, for "lambda"). */
+    lbuiltin fun;
+    char *name;
+    struct prof_node *parent;
+    struct prof_node *children;
+    struct prof_node *next;
+
+    long calls;
+    /* Seconds and lvals allocated in the calls, with the calls they made. */
+    double time;
+    long allocs;
+    /* Start of the call running, if any. */
+    double start;
+    long start_allocs;
+};
 
-/*****************************************************************/
+struct prof_state {
+    int on;
+    struct prof_node root;
+    /* The node of the call running. */
+    struct prof_node *cur;
+    /* File to write the stacks to at exit (--profile). */
+    const char *path;
+};
 
+/* Profiles are per thread: calls made by the workers (see par_start) are
+ * not timed. */
+__thread struct prof_state prof;
+
+/* Totals of a function, for prof_report. */
+struct prof_fun {
+    lbuiltin fun;
+    char *name;
+    long calls;
+    double time, self;
+    long allocs, self_allocs;
+    /* Calls of it on the chain being added up (to count recursive calls
+     * in the total time once). */
+    int active;
+};
 
-/************** Functions to handle environments. ****************/
-/* Create an environment:
- * count = number of variables.
- * syms = symbols
- * vals = values, in order.
- */
-lenv *lenv_new(void)
+char *builtin_name(lbuiltin fun);
+
+/* Start a call of the function given (see struct prof_node). */
+void prof_enter(lbuiltin fun, char *name)
 {
-    lenv *e = malloc(sizeof(lenv));
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    e->parent = NULL;
-    return e;
+    struct prof_node *n;
+    for (n = prof.cur->children; n; n = n->next) {
+        if (n->fun == fun && n->name == name) {
+            break;
+        }
+    }
+    if (! n) {
+        n = calloc(1, sizeof(struct prof_node));
+        n->fun = fun;
+        n->name = name;
+        n->parent = prof.cur;
+        n->next = prof.cur->children;
+        prof.cur->children = n;
+    }
+    n->calls++;
+    n->start = gc_now();
+    n->start_allocs = stats_lvals();
+    prof.cur = n;
 }
 
-/* Remove an environment with all its content. */
-void lenv_del(lenv *e)
+/* End the call started last. */
+void prof_exit(void)
 {
-    int i;
-    for (i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
-    }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    struct prof_node *n = prof.cur;
+    n->time += gc_now() - n->start;
+    n->allocs += stats_lvals() - n->start_allocs;
+    prof.cur = n->parent;
 }
 
-/* Copy an environment. */
-lenv *lenv_copy(lenv *e)
+/* Call the builtin f, timing it. */
+lval *prof_call(lenv *e, lval *f, lval *v)
 {
-    int i;
-    lenv *n = malloc(sizeof(lenv));
-    n->parent = e->parent;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char *) * n->count);
-    n->vals = malloc(sizeof(lval *) * n->count);
-    for (i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(sizeof(char) * (strlen(e->syms[i]) + 1));
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+    prof_enter(f->builtin_fun, NULL);
+    v = f->builtin_fun(e, v);
+    prof_exit();
+    return v;
+}
+
+const char *prof_name(lbuiltin fun, char *name)
+{
+    const char *s = fun ? builtin_name(fun) : name;
+    return s ? s : fun ? "builtin" : "lambda";
+}
+
+void prof_free(struct prof_node *n)
+{
+    struct prof_node *c, *next;
+    for (c = n->children; c; c = next) {
+        next = c->next;
+        prof_free(c);
+        free(c);
     }
-    return n;
+    n->children = NULL;
 }
 
-/* Get a lval from environment. */
-lval *lenv_get(lenv *e, lval *k)
+/* Write the stacks under n (whose own stack is the len chars of buf) in
+ * the "folded" format of flamegraph.pl: the names of the functions on the
+ * stack, from the outermost, separated by ';', then the time spent in the
+ * last one itself, in microseconds. */
+void prof_fold(FILE *f, struct prof_node *n, char **buf, size_t *size, size_t len)
 {
-    /* Iterate over all items in environment. */
-    int i;
-    for (i = 0; i < e->count; i++) {
-        /* Check if the stored string matches the symbol string. */
-        if (STREQ(e->syms[i], k->sym)) {
-            return lval_copy(e->vals[i]);
-        }
+    struct prof_node *c;
+    double self = n->time;
+    const char *name = prof_name(n->fun, n->name);
+    size_t k = strlen(name);
+
+    if (len + k + 2 > *size) {
+        *size = 2 * (len + k + 2);
+        *buf = realloc(*buf, *size);
     }
-    /* If no symbol found try in parent, else return error. */
-    if (e->parent) {
-        return lenv_get(e->parent, k);
+    if (len) {
+        (*buf)[len++] = ';';
+    }
+    memcpy(*buf + len, name, k + 1);
+    len += k;
+    for (c = n->children; c; c = c->next) {
+        self -= c->time;
+        prof_fold(f, c, buf, size, len);
+    }
+    (*buf)[len] = '\0';
+    if (self * 1e6 >= 0.5) {
+        fprintf(f, "%s %.0f\n", *buf, self * 1e6);
     }
-    return lval_err("unbound symbol: '%s'", k->sym);
 }
 
-/* Put a lval inside an environment:
- * e -> environment
- * k -> symbol
- * v-> value
- */
-void lenv_put(lenv *e, lval *k, lval *v)
+/* Add up the calls under n into the table of funs (of *count, with room
+ * for *size). */
+void prof_sum(struct prof_node *n, struct prof_fun **funs, int *count, int *size)
 {
-    /* Iterate over all items in environment. */
+    struct prof_node *c;
+    struct prof_fun *x;
     int i;
-    for (i = 0; i < e->count; i++) {
-        /* If variable is found delete item at that position. */
-        if (STREQ(e->syms[i], k->sym)) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+
+    for (i = 0; i < *count; i++) {
+        if ((*funs)[i].fun == n->fun && (*funs)[i].name == n->name) {
+            break;
         }
     }
+    if (i == *count) {
+        if (*count == *size) {
+            *size = *size ? 2 * *size : 64;
+            *funs = realloc(*funs, sizeof(struct prof_fun) * *size);
+        }
+        memset(*funs + i, 0, sizeof(struct prof_fun));
+        (*funs)[i].fun = n->fun;
+        (*funs)[i].name = n->name;
+        (*count)++;
+    }
+    x = *funs + i;
+    x->calls += n->calls;
+    x->self += n->time;
+    x->self_allocs += n->allocs;
+    if (! x->active) {
+        x->time += n->time;
+        x->allocs += n->allocs;
+    }
+    x->active++;
+    for (c = n->children; c; c = c->next) {
+        /* The table may move. */
+        (*funs)[i].self -= c->time;
+        (*funs)[i].self_allocs -= c->allocs;
+        prof_sum(c, funs, count, size);
+    }
+    (*funs)[i].active--;
+}
 
-    /* If no existing entry found allocate space for new entry. */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
-
-    /* Copy contents of lval and symbol string into new location. */
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count-1], k->sym);
+int prof_fun_cmp(const void *a, const void *b)
+{
+    double x = ((struct prof_fun *) a)->self, y = ((struct prof_fun *) b)->self;
+    return x < y ? 1 : x > y ? -1 : 0;
 }
 
-/* Define a variable in the global environment. */
-void lenv_def(lenv *e, lval *sym, lval *v)
+/* Print the totals of each function called under root on stderr, the
+ * ones that took the most time themselves first. */
+void prof_report(struct prof_node *root)
 {
-    /* Iterate until reaching global scope. */
-    while (e->parent) {
-        e = e->parent;
+    struct prof_node *c;
+    struct prof_fun *funs = NULL;
+    int i, count = 0, size = 0;
+
+    for (c = root->children; c; c = c->next) {
+        prof_sum(c, &funs, &count, &size);
     }
-    lenv_put(e, sym, v);
+    qsort(funs, count, sizeof(struct prof_fun), prof_fun_cmp);
+    fprintf(stderr, "%10s %12s %12s %12s %12s  %s\n", "calls", "total ms",
+            "self ms", "allocs", "self allocs", "function");
+    for (i = 0; i < count; i++) {
+        fprintf(stderr, "%10ld %12.3f %12.3f %12ld %12ld  %s\n", funs[i].calls,
+                funs[i].time * 1e3, funs[i].self * 1e3, funs[i].allocs,
+                funs[i].self_allocs, prof_name(funs[i].fun, funs[i].name));
+    }
+    free(funs);
 }
 
-/*****************************************************************/
+/* At exit with --profile: end the calls still running (after exit), then
+ * write the stacks to the file and print the totals. */
+void prof_finish(void)
+{
+    struct prof_node *c;
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *f;
 
-/******************** Builtin functions. *************************/
+    while (prof.cur != &prof.root) {
+        prof_exit();
+    }
+    prof.on = 0;
+    f = fopen(prof.path, "w");
+    if (! f) {
+        fprintf(stderr, "Could not write profile '%s': %s\n", prof.path,
+                strerror(errno));
+    } else {
+        for (c = prof.root.children; c; c = c->next) {
+            prof_fold(f, c, &buf, &size, 0);
+        }
+        fclose(f);
+    }
+    prof_report(&prof.root);
+    free(buf);
+    prof_free(&prof.root);
+}
 
-/* Print all the variables in the environment. */
-lval *builtin_getenv(lenv *e, lval *v)
+void prof_init(const char *path)
+{
+    prof.on = 1;
+    prof.cur = &prof.root;
+    prof.path = path;
+    atexit(prof_finish);
+}
+
+/*****************************************************************/
+
+/******** Functions to create different types of lvals. *********/
+
+/* Allocate a new lval of the given type, holding a single reference. */
+lval *lval_new(int type)
+{
+    lval *v = pool_alloc(sizeof(lval));
+    v->type = type;
+    v->refs = 1;
+    if (gc.enabled) {
+        gc_track_lval(v);
+    }
+    stats.allocs[type]++;
+    return v;
+}
+
+/* Turn the expression v into one of the given type (a S-Expression into a
+ * Q-Expression, or back). It then counts as allocated with that type. */
+void lval_set_type(lval *v, int type)
+{
+    stats.allocs[v->type]--;
+    stats.allocs[type]++;
+    v->type = type;
+}
+
+/* Make room in a String or Error lval for a text of len chars (and the
+ * final null), returning where to write it. */
+char *lval_text_alloc(lval *v, size_t len)
+{
+    if (len + 1 <= LVAL_INLINE) {
+        v->str = v->text;
+        return v->str;
+    }
+    v->str = malloc(len + 1);
+    stats_alloc(len + 1);
+    v->rope_len = len;
+    v->rope_left = NULL;
+    v->rope_right = NULL;
+    v->rope_depth = 0;
+    return v->str;
+}
+
+/* Set the text of a String or Error lval to a copy of s. */
+void lval_set_text(lval *v, const char *s)
+{
+    size_t len = strlen(s);
+    memcpy(lval_text_alloc(v, len), s, len + 1);
+}
+
+/* Free the text of a String or Error lval, unless it's stored inline, and
+ * drop the pieces of a rope. */
+void lval_free_text(lval *v)
+{
+    if (v->str != v->text) {
+        if (v->str) {
+            stats_free(v->rope_len + 1);
+            free(v->str);
+        }
+        if (v->rope_left) {
+            lval_del(v->rope_left);
+        }
+        if (v->rope_right) {
+            lval_del(v->rope_right);
+        }
+    }
+}
+
+/* Free the cells of an expression that owns them. Cells popped off the
+ * front (see lval_pop) are still part of the block. */
+void lval_free_cells(lval *v)
+{
+    pool_free(v->cell - v->offset, sizeof(lval *) * v->capacity);
+}
+
+/* Construct a pointer to a new Number lval. Unless x is too big for a
+ * fixnum, this allocates nothing. */
+lval* lval_num(long x)
+{
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+        return (lval *) (((uintptr_t) x << 1) | 1);
+    }
+    lval *v = lval_new(LVAL_NUM);
+    v->num = x;
+    return v;
+}
+
+/* Construct a pointer to a new Error lval. */
+lval* lval_err(char *fmt, ...)
+{
+    lval *v = lval_new(LVAL_ERR);
+
+    /* Create and initialize va list. */
+    va_list va;
+    va_start(va, fmt);
+
+    /* Format into 2048 bytes (max size of error), and copy the number of
+     * bytes actually used. */
+    char buf[2048];
+    vsnprintf(buf, sizeof(buf), fmt, va);
+    lval_set_text(v, buf);
+
+    /* Destroy va_list and return. */
+    va_end(va);
+    return v;
+}
+
+/* Construct a pointer to a new Symbol lval named by the n chars at s. The
+ * name is interned. */
+lval *lval_sym_n(const char *s, size_t n)
+{
+    lval *v = lval_new(LVAL_SYM);
+    v->sym = sym_intern_n(s, n);
+    v->slot = -1;
+    return v;
+}
+
+/* Construct a pointer to a new Symbol lval. */
+lval* lval_sym(char *s)
+{
+    return lval_sym_n(s, strlen(s));
+}
+
+/* Construct a pointer to a new String lval. */
+lval *lval_str(char *s)
+{
+    lval *v = lval_new(LVAL_STR);
+    lval_set_text(v, s);
+    return v;
+}
+
+/* A pointer to a new empty Sexpr lval. */
+lval* lval_sexpr(void)
+{
+    lval *v = lval_new(LVAL_SEXPR);
+    v->count = 0;
+    v->capacity = 0;
+    v->offset = 0;
+    v->extra = 0;
+    v->cell = NULL;
+    v->base = NULL;
+    return v;
+}
+
+/* A pointer to a new empty Qexpr lval. */
+lval *lval_qexpr(void)
+{
+    lval *v = lval_new(LVAL_QEXPR);
+    v->count = 0;
+    v->capacity = 0;
+    v->offset = 0;
+    v->extra = 0;
+    v->cell = NULL;
+    v->base = NULL;
+    return v;
+}
+
+/* Longest vector, in numbers: as long as a list may be. */
+#ifndef VEC_MAX_LEN
+#define VEC_MAX_LEN INT_MAX
+#endif
+
+/* A new Vector lval of len numbers, not initialized. The block is aligned
+ * to 32 bytes (for AVX2). If len is out of range or the block can't be
+ * allocated, the result is an error instead, which callers must check
+ * for. */
+lval *lval_vec(long len)
+{
+    lval *v;
+    int64_t *nums = NULL;
+    if (len < 0 || len > VEC_MAX_LEN ||
+        (len && posix_memalign((void **) &nums, 32, sizeof(int64_t) * len))) {
+        return lval_err("Can't allocate a vector of %ld numbers.", len);
+    }
+    v = lval_new(LVAL_VEC);
+    v->len = len;
+    v->nums = nums;
+    stats_alloc(sizeof(int64_t) * len);
+    return v;
+}
+
+/* A pointer to a lval which contains a ptr to a builtin function. */
+lval *lval_fun(lbuiltin func)
+{
+    lval *v = lval_new(LVAL_FUN);
+    v->builtin_fun = func;
+    v->chunk = NULL;
+    v->applied = NULL;
+    v->args = NULL;
+    return v;
+}
+
+/* A partial application of the function f to the arguments in the
+ * S-Expression args. */
+lval *lval_partial(lval *f, lval *args)
+{
+    lval *v = lval_new(LVAL_FUN);
+    v->builtin_fun = NULL;
+    v->env = NULL;
+    v->formals = NULL;
+    v->body = NULL;
+    v->chunk = NULL;
+    v->applied = f;
+    v->args = args;
+    return v;
+}
+
+/* A tail call: the caller of a builtin (or lval_call) that returns this
+ * lval must carry on by evaluating x in e, or by running the chunk c in e,
+ * as if it was the result. f, if not NULL, is the function called, and e
+ * the frame of the call, which the tail call takes over.
+ * Returning tail calls instead of evaluating them lets lval_eval run calls
+ * in tail position in a loop, instead of recursing on the C stack.
+ */
+lval *lval_tail(lval *f, lenv *e, lval *x, lchunk *c)
+{
+    lval *v = lval_new(LVAL_TAIL);
+    v->tail_fun = f;
+    v->tail_env = e;
+    v->tail_expr = x;
+    v->tail_chunk = c;
+    return v;
+}
+
+/* Resolution pass, run once when a function is created. Every symbol in
+ * body (at any nesting depth) that names one of the formals is annotated
+ * with the slot that formal gets in the function's frame: arguments are
+ * bound in order, so the i-th formal (not counting '&') lands in slot i.
+ * Any other symbol is reset to -1, as it was annotated for an enclosing
+ * function. lenv_get validates the slot before using it, since a quoted
+ * piece of body may end up being evaluated elsewhere (with eval).
+ * Shared parts of body are copied before being annotated; returns the
+ * annotated body, consuming body.
+ */
+lval *lval_resolve(lval *body, lval *formals)
+{
+    int i, slot;
+    lval *x;
+    switch (LTYPE(body)) {
+        case LVAL_SYM:
+            for (i = 0, slot = 0; i < formals->count; i++) {
+                if (formals->cell[i]->sym == sym_amp) {
+                    continue;
+                }
+                if (formals->cell[i]->sym == body->sym) {
+                    break;
+                }
+                slot++;
+            }
+            slot = (i < formals->count ? slot : -1);
+            if (body->slot != slot) {
+                body = lval_unshare(body);
+                body->slot = slot;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (i = 0; i < body->count; i++) {
+                x = lval_resolve(lval_copy(body->cell[i]), formals);
+                if (x != body->cell[i]) {
+                    body = lval_unshare(body);
+                    lval_del(body->cell[i]);
+                    body->cell[i] = x;
+                } else {
+                    lval_del(x);
+                }
+            }
+            break;
+    }
+    return body;
+}
+
+/* A pointer to a lval containing a user defined function.
+ * formals: a q-expression containing the symbols of the parameters.
+ * body: a q-expression containing the function body.
+ */
+lval *lval_lambda(lval *formals, lval *body)
+{
+   lval *v = lval_new(LVAL_FUN);
+
+   /* builtin_fun = null indicates that this is a user defined function, and not a
+    * builtin function. */
+   v->builtin_fun = NULL;
+
+   v->env = lenv_new();
+
+   /* Set formalas and body. */
+   v->formals = formals;
+   v->body = lval_resolve(body, formals);
+   v->chunk = NULL;
+   v->applied = NULL;
+   v->args = NULL;
+   return v;
+}
+
+/* Add to syms (a Q-Expression) the symbols of body that are not formals,
+ * once each: the variables a function may need from where it is created.
+ * This includes the symbols of quoted code, which may be evaluated too. */
+lval *lval_free_syms(lval *syms, lval *body, lval *formals)
+{
+    int i;
+    switch (LTYPE(body)) {
+        case LVAL_SYM:
+            for (i = 0; i < formals->count; i++) {
+                if (formals->cell[i]->sym == body->sym) {
+                    return syms;
+                }
+            }
+            for (i = 0; i < syms->count; i++) {
+                if (syms->cell[i]->sym == body->sym) {
+                    return syms;
+                }
+            }
+            return lval_add(syms, lval_sym(body->sym));
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (i = 0; i < body->count; i++) {
+                syms = lval_free_syms(syms, body->cell[i], formals);
+            }
+            break;
+    }
+    return syms;
+}
+
+/*****************************************************************/
+/****************** Functions to handle lvals. ******************/
+
+/* Delete a lval whose last reference was dropped, releasing its children
+ * (if it's a S-Expression). */
+void lval_free(lval *v)
+{
+    switch (v->type) {
+        /* Do nothing special for number type. */
+        case LVAL_NUM:
+            break;
+        /* For Err or Str free the string data. Symbols are interned. */
+        case LVAL_ERR:
+        case LVAL_STR:
+            lval_free_text(v);
+            break;
+        case LVAL_SYM:
+            break;
+
+        /* If Qexpr or Sexpr then delete all elements inside. */
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            /* A slice holds a reference to the owner of its cells
+             * instead. */
+            if (v->base) {
+                lval_del(v->base);
+                break;
+            }
+            for (int i = 0; i < v->count + v->extra; i++) {
+                lval_del(v->cell[i]);
+            }
+            /* Also free the memory allocated to contain the pointers. */
+            lval_free_cells(v);
+            break;
+        case LVAL_FUN:
+            if (! v->builtin_fun && v->args) {
+                lval_del(v->applied);
+                lval_del(v->args);
+            } else if (! v->builtin_fun && v->applied) {
+                lval_del(v->applied);
+                memo_del(v->memo);
+            } else if (! v->builtin_fun) {
+                lenv_del(v->env);
+                lval_del(v->formals);
+                lval_del(v->body);
+                if (v->chunk) {
+                    chunk_del(v->chunk);
+                }
+            }
+            break;
+        case LVAL_TAIL:
+            if (v->tail_fun) {
+                lval_del(v->tail_fun);
+                lenv_del(v->tail_env);
+            }
+            if (v->tail_expr) {
+                lval_del(v->tail_expr);
+            }
+            break;
+        case LVAL_VEC:
+            stats_free(sizeof(int64_t) * v->len);
+            free(v->nums);
+            break;
+        case LVAL_MAP:
+            hamt_unref(v->root);
+            break;
+        case LVAL_FUT:
+            future_del(v->fut);
+            break;
+    }
+    /* Free the memory allocated for the "lval" struct itself. */
+    stats.frees[v->type]++;
+    pool_free(v, sizeof(lval));
+}
+
+/* lval_del with --gc, which leaves the rest (and the count) to the
+ * garbage collector, or while threads run. Out of line, so that lval_del
+ * (called everywhere) stays cheap enough to inline. */
+__attribute__((noinline))
+void lval_del_slow(lval *v)
+{
+    if (! gc.enabled && refs_dec(&v->refs) == 0) {
+        lval_free(v);
+    }
+}
+
+/* Drop a reference to a lval, deleting it when it was the last one. */
+void lval_del(lval *v)
+{
+    /* Fixnums are not allocated. */
+    if (LVAL_IS_FIXNUM(v)) {
+        return;
+    }
+    if (refs_slow) {
+        lval_del_slow(v);
+        return;
+    }
+    if (--v->refs == 0) {
+        lval_free(v);
+    }
+}
+
+/* lval_copy with --gc or while threads run (see lval_del_slow). */
+__attribute__((noinline))
+lval *lval_copy_slow(lval *v)
+{
+    if (gc.enabled) {
+        /* Shared for good, as the count is never dropped: 2 is enough to
+         * tell (and can't overflow). */
+        v->refs = 2;
+    } else {
+        refs_inc(&v->refs);
+    }
+    stats.shares[v->type]++;
+    return v;
+}
+
+/* Return a new reference to v. lvals are shared instead of copied, so
+ * this is O(1); use lval_unshare before modifying a value. */
+lval *lval_copy(lval *v)
+{
+    if (LVAL_IS_FIXNUM(v)) {
+        return v;
+    }
+    if (refs_slow) {
+        return lval_copy_slow(v);
+    }
+    v->refs++;
+    stats.shares[v->type]++;
+    return v;
+}
+
+/* Return a shallow copy of v: the children, formals, body and bound
+ * values of the copy are shared with v. */
+lval *lval_clone(lval *v)
+{
+    int i;
+    lval *x;
+    if (LVAL_IS_FIXNUM(v)) {
+        return v;
+    }
+    stats.clones[v->type]++;
+    if (v->type == LVAL_VEC) {
+        x = lval_vec(v->len);
+        if (LTYPE(x) == LVAL_VEC && v->len) {
+            memcpy(x->nums, v->nums, sizeof(int64_t) * v->len);
+        }
+        return x;
+    }
+    x = lval_new(v->type);
+
+    switch(v->type) {
+        case LVAL_FUN:
+            x->builtin_fun = v->builtin_fun;
+            x->applied = NULL;
+            x->args = NULL;
+            if (! x->builtin_fun && v->applied) {
+                /* A partial application, or a memoized function (sharing
+                 * the cache). */
+                x->chunk = NULL;
+                x->applied = lval_copy(v->applied);
+                if (v->args) {
+                    x->env = NULL;
+                    x->args = lval_copy(v->args);
+                } else {
+                    x->memo = v->memo;
+                    refs_inc(&x->memo->refs);
+                }
+            } else if (! x->builtin_fun) {
+                x->env = lenv_copy(v->env);
+                x->formals = lval_copy(v->formals);
+                x->body = lval_copy(v->body);
+                /* The compiled body is immutable, share it. */
+                x->chunk = v->chunk;
+                if (x->chunk) {
+                    refs_inc(&x->chunk->refs);
+                }
+            }
+            break;
+
+        case LVAL_NUM:
+            x->num = v->num;
+            break;
+
+        /* Symbols are interned, so just share the name. */
+        case LVAL_SYM:
+            x->sym = v->sym;
+            x->slot = v->slot;
+            break;
+
+        /* Copy strings (inline or with malloc), or share the pieces of a
+         * rope. */
+        case LVAL_ERR:
+        case LVAL_STR:
+            if (v->str) {
+                lval_set_text(x, v->str);
+                break;
+            }
+            x->str = NULL;
+            x->rope_len = v->rope_len;
+            x->rope_left = lval_copy(v->rope_left);
+            x->rope_right = v->rope_right ? lval_copy(v->rope_right) : NULL;
+            x->rope_start = v->rope_start;
+            x->rope_depth = v->rope_depth;
+            break;
+
+        /* Maps are immutable, share the trie. */
+        case LVAL_MAP:
+            x->nkeys = v->nkeys;
+            x->root = v->root;
+            if (x->root) {
+                refs_inc(&x->root->refs);
+            }
+            break;
+
+        /* Share the future. */
+        case LVAL_FUT:
+            x->fut = v->fut;
+            refs_inc(&x->fut->refs);
+            break;
+
+        /* Copy lists by sharing each sub-expression. */
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            x->count = v->count;
+            x->capacity = v->count;
+            x->offset = 0;
+            x->extra = 0;
+            x->base = NULL;
+            x->cell = pool_alloc(sizeof(lval *) * x->count);
+            for (i = 0; i < x->count; i++) {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+            break;
+    }
+
+    return x;
+}
+
+/* Copy on write: return a version of v that the caller owns exclusively
+ * and may modify, consuming the caller's reference to v. */
+lval *lval_unshare(lval *v)
+{
+    lval *x;
+    if (LVAL_IS_FIXNUM(v)) {
+        return v;
+    }
+    if (refs_get(&v->refs) == 1) {
+        if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->base) {
+            lval_own_cells(v);
+        } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            lval_trim(v);
+        }
+        return v;
+    }
+    x = lval_clone(v);
+    lval_del(v);
+    return x;
+}
+
+/* Drop the children that joins added past the end of v (which must not
+ * be shared), now that no slice shows them, so v can be modified. */
+void lval_trim(lval *v)
+{
+    int i;
+    for (i = v->count; i < v->count + v->extra; i++) {
+        lval_del(v->cell[i]);
+    }
+    v->extra = 0;
+}
+
+/* Give the slice v (which must not be shared) its own copy of the cells,
+ * so they can be modified. */
+void lval_own_cells(lval *v)
+{
+    int i;
+    lval **cell = pool_alloc(sizeof(lval *) * v->count);
+    for (i = 0; i < v->count; i++) {
+        cell[i] = lval_copy(v->cell[i]);
+    }
+    lval_del(v->base);
+    v->base = NULL;
+    v->cell = cell;
+    v->capacity = v->count;
+    v->offset = 0;
+}
+
+/* Make room for at least n children in v (which must not be shared).
+ * The cells are moved back to the start of their block when more than
+ * half of it was popped off the front, and the block doubles otherwise,
+ * so adding to the end of a list is amortized O(1). */
+void lval_reserve(lval *v, int n)
+{
+    int capacity;
+    lval **cell;
+    if (v->base) {
+        lval_own_cells(v);
+    }
+    if (v->extra) {
+        lval_trim(v);
+    }
+    if (v->offset + n <= v->capacity) {
+        return;
+    }
+    stats.grows++;
+    if (n <= v->capacity && v->offset >= v->capacity / 2) {
+        memmove(v->cell - v->offset, v->cell, sizeof(lval *) * v->count);
+        v->cell -= v->offset;
+        v->offset = 0;
+        return;
+    }
+    capacity = max(max(n, 2 * v->capacity), 4);
+    if (v->offset == 0) {
+        v->cell = pool_realloc(v->cell, sizeof(lval *) * v->capacity,
+                               sizeof(lval *) * capacity);
+    } else {
+        cell = pool_alloc(sizeof(lval *) * capacity);
+        memcpy(cell, v->cell, sizeof(lval *) * v->count);
+        lval_free_cells(v);
+        v->cell = cell;
+        v->offset = 0;
+    }
+    v->capacity = capacity;
+}
+
+/* Given two lvals, "v" and "x", adds "x" to the list of children of "v".
+ * Returns v, which must not be shared. */
+lval* lval_add(lval *v, lval *x)
+{
+    /* Make room for one more child, if needed. */
+    if (v->base || v->extra || v->offset + v->count == v->capacity) {
+        lval_reserve(v, v->count + 1);
+    }
+    /* Add the lval as the last children */
+    v->cell[v->count++] = x;
+    return v;
+}
+
+/* Put y's children in the slots from "to" on: move them if nobody else has
+ * y (leaving it empty), else copy them. */
+void lval_join_cells(lval **to, lval *y)
+{
+    int i;
+    if (y->count && refs_get(&y->refs) == 1 && ! y->base) {
+        memcpy(to, y->cell, sizeof(lval *) * y->count);
+        y->count = 0;
+    } else {
+        for (i = 0; i < y->count; i++) {
+            to[i] = lval_copy(y->cell[i]);
+        }
+    }
+}
+
+/* Join two lvalues, consuming both. If x is shared (or a slice) and
+ * nothing was added yet past its end in its block, y's children go there
+ * when they fit, and the result is a slice of the block: so the loop
+ * (build (- n 1) (join acc (list n))) doesn't copy acc, which its frame
+ * still holds, on every step. When they don't fit x is copied with room
+ * to double, so that such a loop copies O(log n) times. */
+lval* lval_join(lenv *e, lval *x, lval *y)
+{
+    int i, n = y->count;
+    lval *r, *v, **end;
+
+    /* Nothing to add to: the result is y itself. */
+    if (x->count == 0 && x->type == y->type) {
+        lval_del(x);
+        return y;
+    }
+
+    if (refs_slow && ! gc.enabled) {
+        /* Other threads may extend the block too. */
+        x = lval_unshare(x);
+    } else if (x->base || refs_get(&x->refs) > 1) {
+        r = x->base ? x->base : x;
+        end = x->cell + x->count;
+        if (end == r->cell + r->count + r->extra &&
+            end + n <= r->cell - r->offset + r->capacity) {
+            lval_join_cells(end, y);
+            lval_del(y);
+            r->extra += n;
+            if (x->base && refs_get(&x->refs) == 1) {
+                x->count += n;
+                return x;
+            }
+            v = lval_new(x->type);
+            v->count = x->count + n;
+            v->capacity = 0;
+            v->offset = 0;
+            v->extra = 0;
+            v->cell = x->cell;
+            v->base = lval_copy(r);
+            lval_del(x);
+            return v;
+        }
+        v = x->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+        lval_reserve(v, 2 * (x->count + n));
+        for (i = 0; i < x->count; i++) {
+            v->cell[v->count++] = lval_copy(x->cell[i]);
+        }
+        lval_del(x);
+        x = v;
+    }
+
+    lval_reserve(x, x->count + n);
+    lval_join_cells(x->cell + x->count, y);
+    x->count += n;
+
+    /* Delete the empty 'y' and return 'x'. */
+    lval_del(y);
+    return x;
+}
+
+/* Returns the ith lval of sepxr "v", removing it from "v" (which must not
+ * be shared). Popping the first lval is O(1): v's cells start one slot
+ * later in their block. */
+lval* lval_pop(lval *v, int i)
+{
+    /* Find the item at "i". */
+    lval *x = v->cell[i];
+
+    if (i == 0) {
+        v->cell++;
+        v->offset++;
+        v->count--;
+        /* The cells of a slice are owned (and referenced) by its base. */
+        return v->base ? lval_copy(x) : x;
+    }
+    if (v->base) {
+        lval_own_cells(v);
+        x = v->cell[i];
+    }
+
+    /* Shift memory after the item at "i" over the top. */
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*)*(v->count - i - 1));
+
+    /* Decrease the count of items in the list. */
+    v->count--;
+    return x;
+}
+
+/* Returns the ith lval of sexpr "v", destroying "v". */
+lval* lval_take(lval *v, int i)
+{
+    lval *x = lval_copy(v->cell[i]);
+    lval_del(v);
+    return x;
+}
+
+/* Slices no shorter than this share the cells of the list they are taken
+ * from, shorter ones are copied. */
+#define LVAL_SLICE_MIN 16
+
+/* Returns the children of v from index "from" up to (not including) "to",
+ * as a list of the same type, consuming v. If v isn't shared it's trimmed
+ * in place; otherwise the result is a slice that shares v's cells (and
+ * holds a reference to v, in "base") instead of copying them. Either way
+ * taking the tail of a list is O(1).
+ */
+lval *lval_slice(lval *v, int from, int to)
+{
+    int i;
+    lval *x;
+    if (refs_get(&v->refs) == 1 && ! v->base) {
+        lval_trim(v);
+        for (i = to; i < v->count; i++) {
+            lval_del(v->cell[i]);
+        }
+        for (i = 0; i < from; i++) {
+            lval_del(v->cell[i]);
+        }
+        v->cell += from;
+        v->offset += from;
+        v->count = to - from;
+        return v;
+    }
+    if (refs_get(&v->refs) == 1) {
+        v->cell += from;
+        v->count = to - from;
+        return v;
+    }
+
+    if (to - from < LVAL_SLICE_MIN) {
+        x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+        lval_reserve(x, to - from);
+        for (i = from; i < to; i++) {
+            x->cell[x->count++] = lval_copy(v->cell[i]);
+        }
+        lval_del(v);
+        return x;
+    }
+    x = lval_new(v->type);
+    x->count = to - from;
+    x->capacity = 0;
+    x->offset = 0;
+    x->extra = 0;
+    x->cell = v->cell + from;
+    if (v->base) {
+        x->base = lval_copy(v->base);
+        lval_del(v);
+    } else {
+        x->base = v;
+    }
+    return x;
+}
+
+/*****************************************************************/
+/************************** Reader. ******************************/
+
+/* A single-pass recursive descent reader, building lvals straight from the
+ * source text. Symbols are interned and numbers converted in place, and
+ * strings unescaped directly into their lval, so nothing is copied on the
+ * way. The syntax is:
+ *
+ *   number : /-?[0-9]+/
+ *   symbol : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/
+ *   string : /"(\\.|[^"])*"/
+ *   sexpr  : '(' <expr>* ')'
+ *   qexpr  : '{' <expr>* '}'
+ *   expr   : <number> | <symbol> | <sexpr> | <qexpr> | <string>
+ *
+ * with whitespace between tokens. As with regular expressions, a number is
+ * the longest run of digits: "12ab" is the number 12 then the symbol ab.
+ */
+struct reader {
+    /* Name of the source, for error messages (eg. "<stdin>"). */
+    const char *name;
+    /* The source, and the current position in it. */
+    const char *start;
+    const char *p;
+    /* Line and column where the source starts. */
+    int line;
+    int col;
+    /* More input may follow the end of the source (see stream_eval).
+     * Reaching it in the middle of an expression is then not an error:
+     * partial is set instead. */
+    int more;
+    int partial;
+    /* The first syntax error (an Error lval), or NULL. */
+    lval *err;
+};
+
+void reader_init(struct reader *r, const char *name, const char *s)
+{
+    r->name = name;
+    r->start = s;
+    r->p = s;
+    r->line = 1;
+    r->col = 1;
+    r->more = 0;
+    r->partial = 0;
+    r->err = NULL;
+}
+
+/* Advance the line and column *line and *col over the text from s to p. */
+void reader_locate(const char *s, const char *p, int *line, int *col)
+{
+    for (; s < p; s++) {
+        if (*s == '\n') {
+            (*line)++;
+            *col = 1;
+        } else {
+            (*col)++;
+        }
+    }
+}
+
+/* Record a syntax error at position p, with its line and column. */
+void reader_error(struct reader *r, const char *p, char *msg)
+{
+    int line = r->line, col = r->col;
+    if (r->err) {
+        return;
+    }
+    reader_locate(r->start, p, &line, &col);
+    r->err = lval_err("%s:%d:%d: %s", r->name, line, col, msg);
+}
+
+/* The end of the source was reached in the middle of an expression (which
+ * started at p). */
+void reader_end(struct reader *r, const char *p, char *msg)
+{
+    if (r->more) {
+        r->partial = 1;
+    } else {
+        reader_error(r, p, msg);
+    }
+}
+
+int reader_symchar(int c)
+{
+    return isalnum(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+lval *lval_read_expr(struct reader *r);
+
+lval *lval_read_num(struct reader *r)
+{
+    char *end;
+    long x;
+    errno = 0;
+    x = strtol(r->p, &end, 10);
+    r->p = end;
+    return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+lval *lval_read_sym(struct reader *r)
+{
+    const char *s = r->p;
+    while (reader_symchar((unsigned char) *r->p)) {
+        r->p++;
+    }
+    return lval_sym_n(s, r->p - s);
+}
+
+/* Read a string, unescaping it directly into the lval. */
+lval *lval_read_str(struct reader *r)
+{
+    const char *s, *open = r->p;
+    char *t;
+    lval *v;
+
+    /* Find the closing quote: the text is at most that long. */
+    for (s = open + 1; *s != '"'; s++) {
+        if (*s == '\0' || (*s == '\\' && *++s == '\0')) {
+            reader_end(r, open, "unterminated string");
+            return NULL;
+        }
+    }
+
+    v = lval_new(LVAL_STR);
+    t = lval_text_alloc(v, s - open - 1);
+    for (s = open + 1; *s != '"'; s++) {
+        if (*s != '\\') {
+            *t++ = *s;
+            continue;
+        }
+        switch (*++s) {
+            case 'a': *t++ = '\a'; break;
+            case 'b': *t++ = '\b'; break;
+            case 'f': *t++ = '\f'; break;
+            case 'n': *t++ = '\n'; break;
+            case 'r': *t++ = '\r'; break;
+            case 't': *t++ = '\t'; break;
+            case 'v': *t++ = '\v'; break;
+            default: *t++ = *s; break;
+        }
+    }
+    *t = '\0';
+    if (v->str != v->text) {
+        /* Escapes made it shorter than allocated. */
+        stats_free(v->rope_len - (t - v->str));
+        v->rope_len = t - v->str;
+    }
+    r->p = s + 1;
+    return v;
+}
+
+/* Read the children of x up to the bracket close. */
+lval *lval_read_list(struct reader *r, lval *x, char close)
+{
+    const char *open = r->p++;
+    lval *y;
+    for (;;) {
+        while (isspace((unsigned char) *r->p)) {
+            r->p++;
+        }
+        if (*r->p == close) {
+            r->p++;
+            return x;
+        }
+        if (*r->p == '\0') {
+            reader_end(r, open, close == ')' ? "unclosed '('" : "unclosed '{'");
+            lval_del(x);
+            return NULL;
+        }
+        y = lval_read_expr(r);
+        if (! y) {
+            lval_del(x);
+            return NULL;
+        }
+        lval_add(x, y);
+    }
+}
+
+/* Read the next expression. Returns NULL at the end of the source, or on
+ * a syntax error (then r->err is set), or if the expression goes on past
+ * the end of the source (then r->partial is set). */
+lval *lval_read_expr(struct reader *r)
+{
+    int c;
+    char msg[32];
+    lval *x;
+    while (isspace((unsigned char) *r->p)) {
+        r->p++;
+    }
+    c = (unsigned char) *r->p;
+    if (c == '\0') {
+        return NULL;
+    }
+    if (c == '(') {
+        return lval_read_list(r, lval_sexpr(), ')');
+    }
+    if (c == '{') {
+        return lval_read_list(r, lval_qexpr(), '}');
+    }
+    if (c == '"') {
+        return lval_read_str(r);
+    }
+    /* A number or symbol at the very end may go on in the input to come. */
+    if (reader_symchar(c)) {
+        x = isdigit(c) || (c == '-' && isdigit((unsigned char) r->p[1])) ?
+            lval_read_num(r) : lval_read_sym(r);
+        if (*r->p == '\0' && r->more) {
+            r->partial = 1;
+            lval_del(x);
+            return NULL;
+        }
+        return x;
+    }
+    if (c == ')' || c == '}') {
+        reader_error(r, r->p, "unbalanced bracket");
+    } else {
+        snprintf(msg, sizeof(msg), "unexpected character '%c'", c);
+        reader_error(r, r->p, msg);
+    }
+    return NULL;
+}
+
+/* Read all the expressions in s, as the children of a S-Expression. On a
+ * syntax error, return the error instead. */
+lval *lval_read(const char *name, const char *s)
+{
+    struct reader r;
+    lval *x = lval_sexpr(), *y;
+    reader_init(&r, name, s);
+    while ((y = lval_read_expr(&r))) {
+        lval_add(x, y);
+    }
+    if (r.err) {
+        lval_del(x);
+        return r.err;
+    }
+    return x;
+}
+
+/*****************************************************************/
+
+/* Call f with the arguments in the S-Expression v. A user function gets a
+ * new frame, which holds one slot per formal, in order (see lval_resolve),
+ * and whose parent is the frame of the variables f captured: f itself is
+ * not modified, and the call takes time in the number of arguments only.
+ * Given too few arguments, the result is a partial application of f. */
+lval *lval_call(lenv *e, lval *f, lval *v)
+{
+    int i, fixed, rest;
+    lenv *frame;
+    /* If builtin then simply call that. */
+    if (f->builtin_fun) {
+        return prof.on ? prof_call(e, f, v) : f->builtin_fun(e, v);
+    }
+    if (f->applied && ! f->args) {
+        return memo_call(e, f, v);
+    }
+    /* Add the arguments given so far to a partial application. */
+    if (f->args) {
+        v = lval_join(e, lval_unshare(lval_copy(f->args)), v);
+        f = f->applied;
+    }
+
+    /* Formals before '&' take an argument each, the one after it the rest. */
+    for (fixed = 0; fixed < f->formals->count; fixed++) {
+        if (f->formals->cell[fixed]->sym == sym_amp) {
+            break;
+        }
+    }
+    rest = (fixed < f->formals->count);
+    if (! rest && v->count > fixed) {
+        lval *err = lval_err("Function passed too many arguments. "
+                             "Expected %d, but got %d.", fixed, v->count);
+        lval_del(v);
+        return err;
+    }
+    if (v->count < fixed) {
+        return lval_partial(lval_copy(f), v);
+    }
+    if (rest && f->formals->count != fixed + 2) {
+        lval_del(v);
+        return lval_err("Function format is invalid. "
+                        "Symbol '&' not followed by single symbol.");
+    }
+
+    /* Bind the arguments in a new frame. */
+    frame = lenv_new();
+    frame->parent = f->env;
+    frame->count = fixed + rest;
+    frame->syms = pool_alloc(sizeof(char *) * frame->count);
+    frame->vals = pool_alloc(sizeof(lval *) * frame->count);
+    for (i = 0; i < fixed; i++) {
+        frame->syms[i] = f->formals->cell[i]->sym;
+        frame->vals[i] = lval_pop(v, 0);
+    }
+    if (rest) {
+        /* The remaining arguments, as a list. */
+        frame->syms[fixed] = f->formals->cell[fixed + 1]->sym;
+        frame->vals[fixed] = builtin_list(e, v);
+    } else {
+        lval_del(v);
+    }
+
+    /* Evaluate the body, as a tail call. */
+    if (f->chunk) {
+        return lval_tail(lval_copy(f), frame, NULL, f->chunk);
+    }
+    lval *body = lval_unshare(lval_copy(f->body));
+    lval_set_type(body, LVAL_SEXPR);
+    return lval_tail(lval_copy(f), frame, body, NULL);
+}
+
+int lval_eq(lval *a, lval *b)
+{
+    /* If type is different, they are different. */
+    if (LTYPE(a) != LTYPE(b)) {
+        return 0;
+    }
+
+    switch(LTYPE(a)) {
+
+    case LVAL_NUM:
+        return LNUM(a) == LNUM(b);
+    case LVAL_SYM:
+        return a->sym == b->sym;
+    case LVAL_ERR:
+        return STREQ(a->err, b->err);
+    case LVAL_STR:
+        return lval_str_len(a) == lval_str_len(b) &&
+               STREQ(lval_str_flat(a), lval_str_flat(b));
+    case LVAL_VEC:
+        return a->len == b->len &&
+            (! a->len || memcmp(a->nums, b->nums, sizeof(int64_t) * a->len) == 0);
+    case LVAL_MAP:
+        return lval_map_eq(a, b);
+    case LVAL_FUT:
+        return a->fut == b->fut;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        if (a->count != b->count) {
+            return 0;
+        }
+        for (int i = 0; i < a->count; i++) {
+            if (! lval_eq(a->cell[i], b->cell[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    case LVAL_FUN:
+        /* If any is a builtin (ptr to a function), then
+         * we can compare these pointers. */
+        if (a->builtin_fun || b->builtin_fun) {
+            return a->builtin_fun == b->builtin_fun;
+        } else if (a->args || b->args) {
+            return a->args && b->args && lval_eq(a->applied, b->applied) &&
+                lval_eq(a->args, b->args);
+        } else if (a->applied || b->applied) {
+            /* Memoized functions: the same one (with the same cache). */
+            return a->applied && b->applied && a->memo == b->memo;
+        } else {
+            /* Closures of the same code differ by what they captured. */
+            return lval_eq(a->formals, b->formals) &&
+                lval_eq(a->body, b->body) && lenv_eq(a->env, b->env);
+        }
+    }
+    return 0;
+}
+
+/* Combine the hash h with x. */
+unsigned long hash_mix(unsigned long h, unsigned long x)
+{
+    return h ^ (x + 0x9e3779b9UL + (h << 6) + (h >> 2));
+}
+
+/* Structural hash of v, consistent with lval_eq: equal values have equal
+ * hashes. */
+unsigned long lval_hash(lval *v)
+{
+    long i;
+    unsigned long h = LTYPE(v);
+    switch (LTYPE(v)) {
+        case LVAL_NUM:
+            return hash_mix(h, LNUM(v));
+        case LVAL_SYM:
+            /* By name rather than by address, so that the order of maps
+             * (see lval_map_print) is the same from one run to the next. */
+            return hash_mix(h, str_hash(v->sym, strlen(v->sym)));
+        case LVAL_ERR:
+        case LVAL_STR:
+            return hash_mix(h, str_hash(lval_str_flat(v), lval_str_len(v)));
+        case LVAL_VEC:
+            for (i = 0; i < v->len; i++) {
+                h = hash_mix(h, v->nums[i]);
+            }
+            return h;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (i = 0; i < v->count; i++) {
+                h = hash_mix(h, lval_hash(v->cell[i]));
+            }
+            return h;
+        case LVAL_FUN:
+            if (v->builtin_fun) {
+                return hash_mix(h, (uintptr_t) v->builtin_fun);
+            } else if (v->args) {
+                return hash_mix(lval_hash(v->applied), lval_hash(v->args));
+            } else if (v->applied) {
+                return hash_mix(h, (uintptr_t) v->memo);
+            }
+            h = hash_mix(lval_hash(v->formals), lval_hash(v->body));
+            return hash_mix(h, lenv_hash(v->env));
+        case LVAL_MAP:
+            return hash_mix(h, lval_map_hash(v));
+        case LVAL_FUT:
+            return hash_mix(h, (uintptr_t) v->fut);
+    }
+    return h;
+}
+
+/* Whether the frames a and b bind the same symbols, in the same order, to
+ * equal values: for closures, whether they captured the same variables. */
+int lenv_eq(lenv *a, lenv *b)
+{
+    int i;
+    if (a->count != b->count) {
+        return 0;
+    }
+    for (i = 0; i < a->count; i++) {
+        if (a->syms[i] != b->syms[i] || ! lval_eq(a->vals[i], b->vals[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Hash of the bindings of the frame e, consistent with lenv_eq. */
+unsigned long lenv_hash(lenv *e)
+{
+    int i;
+    unsigned long h = e->count;
+    for (i = 0; i < e->count; i++) {
+        h = hash_mix(h, str_hash(e->syms[i], strlen(e->syms[i])));
+        h = hash_mix(h, lval_hash(e->vals[i]));
+    }
+    return h;
+}
+
+/*****************************************************************/
+/******************* Functions to print lvals ********************/
+void print_error(char *msg)
+{
+    printf("Error: %s\n", msg);
+}
+
+/* Print a lvalue (with all it's children) between chars open and close
+ * (usually '(' and ')')
+ */
+void lval_expr_print(FILE *f, lval *v, char open, char close)
+{
+    fputc(open, f);
+    for (int i = 0; i < v->count; i++) {
+        /* Print Value contained within */
+        lval_print(f, v->cell[i]);
+        /* Don't print trailing space if last element */
+        if (i != (v->count - 1)) {
+            fputc(' ', f);
+        }
+    }
+    fputc(close, f);
+}
+
+/* Print n chars escaped, for lval_print_str (ctx is the FILE). */
+void lval_print_chars(const char *s, long n, void *ctx)
+{
+    for (; n--; s++) {
+        switch (*s) {
+            case '\a': fputs("\\a", ctx); break;
+            case '\b': fputs("\\b", ctx); break;
+            case '\f': fputs("\\f", ctx); break;
+            case '\n': fputs("\\n", ctx); break;
+            case '\r': fputs("\\r", ctx); break;
+            case '\t': fputs("\\t", ctx); break;
+            case '\v': fputs("\\v", ctx); break;
+            case '\\': fputs("\\\\", ctx); break;
+            case '"': fputs("\\\"", ctx); break;
+            default: fputc(*s, ctx); break;
+        }
+    }
+}
+
+/* Print an escaped string, with newlines, etc. (the reverse of
+ * lval_read_str). A rope is printed piece by piece. */
+void lval_print_str(FILE *f, lval *v)
+{
+    fputc('"', f);
+    rope_each(v, lval_print_chars, f);
+    fputc('"', f);
+}
+
+/* Handle different representations depending on the type of lval. */
+void lval_print(FILE *f, lval *v)
+{
+    switch(LTYPE(v)) {
+        case LVAL_NUM:
+            fprintf(f, "%li", LNUM(v));
+            break;
+        case LVAL_ERR:
+            fprintf(f, "Error: %s", v->err);
+            break;
+        case LVAL_SYM:
+            fprintf(f, "%s", v->sym);
+            break;
+        case LVAL_STR:
+            lval_print_str(f, v);
+            break;
+        case LVAL_SEXPR:
+            lval_expr_print(f, v, '(', ')');
+            break;
+        case LVAL_QEXPR:
+            lval_expr_print(f, v, '{', '}');
+            break;
+        case LVAL_MAP:
+            lval_map_print(f, v);
+            break;
+        case LVAL_FUT:
+            fprintf(f, "<future>");
+            break;
+        case LVAL_VEC:
+            fputc('[', f);
+            for (long i = 0; i < v->len; i++) {
+                fprintf(f, i ? " %li" : "%li", (long) v->nums[i]);
+            }
+            fputc(']', f);
+            break;
+        case LVAL_FUN:
+            if (v->builtin_fun) {
+                fprintf(f, "<function>");
+            } else if (v->applied && ! v->args) {
+                fprintf(f, "(memo ");
+                lval_print(f, v->applied);
+                fputc(')', f);
+            } else if (v->args) {
+                /* A partial application: the formals still to be given. */
+                fprintf(f, "(\\ {");
+                for (int i = v->args->count; i < v->applied->formals->count; i++) {
+                    fprintf(f, i > v->args->count ? " %s" : "%s",
+                            v->applied->formals->cell[i]->sym);
+                }
+                fputc('}', f);
+                fputc(' ', f);
+                lval_print(f, v->applied->body);
+                fputc(')', f);
+            } else {
+                fprintf(f, "(\\ ");
+                lval_print(f, v->formals);
+                fputc(' ', f);
+                lval_print(f, v->body);
+                fputc(')', f);
+            }
+            break;
+    }
+}
+
+/* Print a lval followed by a newline. */
+void lval_println(FILE *f, lval *v)
+{
+    lval_print(f, v);
+    fputc('\n', f);
+}
+/*****************************************************************/
+/****************** Functions for evaluation. ********************/
+
+/* Evaluate a S-Expression */
+lval* lval_eval_sexpr(lenv *e, lval *v)
+{
+    /* Evaluate children. */
+    int i;
+    gc_push(GC_LVAL, &v, NULL);
+    gc_push(GC_ENV, &e, NULL);
+    gc_safepoint();
+    for (i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+    gc_pop(2);
+
+    return lval_apply(e, v);
+}
+
+/* Apply a S-Expression whose children have already been evaluated: the
+ * first child is called with the rest as arguments. Builtins are always
+ * given an unshared S-Expression of arguments. The result may be a tail
+ * call (see lval_tail and lval_untail). */
+lval *lval_apply(lenv *e, lval *v)
+{
+    int i;
+    /* Error checking */
+    for (i = 0; i < v->count; i++) {
+        /* If any children is an error, return it and destroy "v". */
+        if (LTYPE(v->cell[i]) == LVAL_ERR) {
+            return lval_take(v, i);
+        }
+    }
+
+    /* Empty expression */
+    if (v->count == 0) {
+        return v;
+    }
+
+    /* Single expression: return first children, destroy sexpr. */
+    if (v->count == 1) {
+        return lval_take(v, 0);
+    }
+
+    /* Ensure first element is a function after evaluation. */
+    lval *f = lval_pop(v, 0);
+    if (LTYPE(f) != LVAL_FUN) {
+        lval *err = lval_err("S-Expression starts with incorrect type. "
+                        "Expected %s, but got %s.",
+                        ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+        lval_del(f);
+        return err;
+    }
+
+    /* Call function to get result. */
+    gc_push(GC_LVAL, &f, NULL);
+    gc_push(GC_LVAL, &v, NULL);
+    lval *result = lval_call(e, f, v);
+    gc_pop(2);
+    lval_del(f);
+    return result;
+}
+
+/* Release a function called from the loop of lval_eval, with the frame
+ * of the call. */
+void lval_frame_del(lval *f, lenv *frame)
+{
+    if (f) {
+        lval_del(f);
+        lenv_del(frame);
+    }
+}
+
+/* How deep lval_eval is nested on this thread, and the most it may be
+ * (see caballa_set_max_depth), or 0 for no limit. */
+__thread int eval_depth = 0;
+__thread int eval_max_depth = 0;
+
+lval* lval_eval(lenv *e, lval *v)
+{
+    lval *t, *f = NULL;
+    lenv *frame = NULL;
+    /* The call of f is timed (see prof_enter). */
+    int profiled = 0;
+    /* Every level of recursion of the evaluated code (both evaluators)
+     * goes through here: stop it before it overflows the C stack. */
+    if (eval_max_depth && eval_depth >= eval_max_depth) {
+        lval_del(v);
+        return lval_err("Evaluation nested more than %d levels deep.",
+                        eval_max_depth);
+    }
+    eval_depth++;
+    gc_push(GC_LVAL, &v, NULL);
+    gc_push(GC_ENV, &e, NULL);
+    gc_push(GC_LVAL, &f, NULL);
+    gc_push(GC_ENV, &frame, NULL);
+    for (;;) {
+        /* Evaluate S-Expressions */
+        if (LTYPE(v) == LVAL_SYM) {
+            t = lenv_get(e, v);
+            lval_del(v);
+            v = t;
+            break;
+        }
+        if (LTYPE(v) == LVAL_SEXPR) {
+            /* Children are replaced by their values as they get evaluated. */
+            v = lval_eval_sexpr(e, lval_unshare(v));
+        }
+        /* All other lval types remain the same. */
+        if (LTYPE(v) != LVAL_TAIL) {
+            break;
+        }
+
+        /* A call in tail position: carry on with it here. A new call takes
+         * over from the function running so far, whose frame nothing can
+         * refer to any more (closures copy the variables they need), so a
+         * function calling itself in tail position runs in constant space. */
+        t = v;
+        if (t->tail_fun) {
+            if (profiled) {
+                prof_exit();
+            }
+            lval_frame_del(f, frame);
+            f = t->tail_fun;
+            frame = t->tail_env;
+            t->tail_fun = NULL;
+            if ((profiled = prof.on)) {
+                prof_enter(NULL, f->env->name);
+            }
+        }
+        e = t->tail_env;
+        if (t->tail_chunk) {
+            v = vm_run(e, t->tail_chunk);
+            lval_del(t);
+            if (LTYPE(v) != LVAL_TAIL) {
+                break;
+            }
+        } else {
+            v = t->tail_expr;
+            t->tail_expr = NULL;
+            lval_del(t);
+        }
+    }
+    gc_pop(4);
+    if (profiled) {
+        prof_exit();
+    }
+    lval_frame_del(f, frame);
+    eval_depth--;
+    return v;
+}
+
+/* Return the value of x, evaluating it first if it's a tail call. */
+lval *lval_untail(lval *x)
+{
+    return LTYPE(x) == LVAL_TAIL ? lval_eval(NULL, x) : x;
+}
+
+/* Evaluate a S-Expression. */
+lval *builtin_eval(lenv *e, lval *a)
+{
+    LASSERT_NARGS(a, a->count, 1, "eval");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "eval");
+
+    lval *x = lval_unshare(lval_take(a, 0));
+    lval_set_type(x, LVAL_SEXPR);
+    return lval_tail(NULL, e, x, NULL);
+}
+
+/* (profile {expr}): evaluate expr, timing every call it makes, and print
+ * the totals of each function on stderr. Returns the value of expr. */
+lval *builtin_profile(lenv *e, lval *a)
+{
+    struct prof_state outer = prof;
+    lval *x;
+
+    LASSERT_NARGS(a, a->count, 1, "profile");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "profile");
+
+    /* A profile of its own, even within another one. */
+    memset(&prof.root, 0, sizeof(prof.root));
+    prof.cur = &prof.root;
+    prof.on = 1;
+    x = lval_unshare(lval_take(a, 0));
+    lval_set_type(x, LVAL_SEXPR);
+    x = lval_eval(e, x);
+    prof_report(&prof.root);
+    prof_free(&prof.root);
+    prof = outer;
+    return x;
+}
+
+/* m with the String key bound to v, consuming m and v. */
+lval *stats_put(lval *m, char *key, lval *v)
+{
+    lval *k = lval_str(key), *x = lval_map_put(m, k, v);
+    lval_del(k);
+    lval_del(v);
+    lval_del(m);
+    return x;
+}
+
+/* (stats {}): the counters of allocations, copies and memory (see struct
+ * stats) since the last (stats-reset {}), in a map. "types" maps the name
+ * of each type allocated to its own counters. The argument is not used: a
+ * builtin alone in an expression is its value, not a call. */
+lval *builtin_stats(lenv *e, lval *a)
+{
+    int t;
+    /* Building the map counts too. */
+    struct stats now = stats;
+    long allocs = 0, frees = 0, live = 0, shares = 0, clones = 0;
+    lval *m, *types = lval_map();
+
+    LASSERT_NARGS(a, a->count, 1, "stats");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "stats");
+    for (t = 0; t < LVAL_TYPES; t++) {
+        if (! now.allocs[t] && ! now.shares[t]) {
+            continue;
+        }
+        m = stats_put(lval_map(), "allocs",
+                      lval_num(STATS_SINCE(now, allocs[t])));
+        m = stats_put(m, "frees", lval_num(STATS_SINCE(now, frees[t])));
+        m = stats_put(m, "live", lval_num(now.allocs[t] - now.frees[t]));
+        m = stats_put(m, "shares", lval_num(STATS_SINCE(now, shares[t])));
+        m = stats_put(m, "clones", lval_num(STATS_SINCE(now, clones[t])));
+        types = stats_put(types, ltype_name(t), m);
+        allocs += STATS_SINCE(now, allocs[t]);
+        frees += STATS_SINCE(now, frees[t]);
+        live += now.allocs[t] - now.frees[t];
+        shares += STATS_SINCE(now, shares[t]);
+        clones += STATS_SINCE(now, clones[t]);
+    }
+    m = stats_put(lval_map(), "allocs", lval_num(allocs));
+    m = stats_put(m, "frees", lval_num(frees));
+    m = stats_put(m, "live", lval_num(live));
+    m = stats_put(m, "shares", lval_num(shares));
+    m = stats_put(m, "clones", lval_num(clones));
+    m = stats_put(m, "envs", lval_num(STATS_SINCE(now, envs)));
+    m = stats_put(m, "env-frees", lval_num(STATS_SINCE(now, env_frees)));
+    m = stats_put(m, "live-envs", lval_num(now.envs - now.env_frees));
+    m = stats_put(m, "env-copies", lval_num(STATS_SINCE(now, env_copies)));
+    m = stats_put(m, "grows", lval_num(STATS_SINCE(now, grows)));
+    m = stats_put(m, "bytes", lval_num(STATS_SINCE(now, bytes)));
+    m = stats_put(m, "heap", lval_num(now.heap));
+    m = stats_put(m, "peak-heap", lval_num(now.peak));
+    m = stats_put(m, "types", types);
+    lval_del(a);
+    return m;
+}
+
+/* (stats-reset {}): count from now on (see stats_base). */
+lval *builtin_stats_reset(lenv *e, lval *a)
+{
+    LASSERT_NARGS(a, a->count, 1, "stats-reset");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "stats-reset");
+    lval_del(a);
+    stats_reset();
+    return lval_sexpr();
+}
+
+
+
+/*****************************************************************/
+
+
+/************** Functions to handle environments. ****************/
+/* Create an environment (a function frame):
+ * count = number of variables.
+ * syms = symbols
+ * vals = values, in order.
+ */
+lenv *lenv_new(void)
+{
+    lenv *e = pool_alloc(sizeof(lenv));
+    if (gc.enabled) {
+        gc_track_env(e);
+    }
+    stats.envs++;
+    e->count = 0;
+    e->size = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    e->parent = NULL;
+    e->name = NULL;
+    return e;
+}
+
+/* Create a hashed environment (the global one). Bindings live in an
+ * open-addressing table of "size" slots keyed by the interned symbol name,
+ * so lookups stay O(1) however many definitions there are.
+ */
+lenv *lenv_new_global(void)
+{
+    lenv *e = lenv_new();
+    e->size = 64;
+    e->syms = pool_alloc(sizeof(char *) * e->size);
+    e->vals = pool_alloc(sizeof(lval *) * e->size);
+    memset(e->syms, 0, sizeof(char *) * e->size);
+    return e;
+}
+
+/* Slot where a hashed environment stores (or would store) symbol k. */
+int lenv_hash_slot(lenv *e, char *k)
+{
+    unsigned long i = ((unsigned long) k >> 3) * 2654435761UL;
+    i &= e->size - 1;
+    while (e->syms[i] && e->syms[i] != k) {
+        i = (i + 1) & (e->size - 1);
+    }
+    return i;
+}
+
+/* Double the number of slots of a hashed environment. */
+void lenv_grow(lenv *e)
+{
+    int i, j, size = e->size;
+    char **syms = e->syms;
+    lval **vals = e->vals;
+
+    e->size *= 2;
+    e->syms = pool_alloc(sizeof(char *) * e->size);
+    e->vals = pool_alloc(sizeof(lval *) * e->size);
+    memset(e->syms, 0, sizeof(char *) * e->size);
+    for (i = 0; i < size; i++) {
+        if (syms[i]) {
+            j = lenv_hash_slot(e, syms[i]);
+            e->syms[j] = syms[i];
+            e->vals[j] = vals[i];
+        }
+    }
+    pool_free(syms, sizeof(char *) * size);
+    pool_free(vals, sizeof(lval *) * size);
+}
+
+/* Free the memory of an environment (not of the values bound in it). */
+void lenv_free(lenv *e)
+{
+    pool_free(e->syms, sizeof(char *) * LENV_SLOTS(e));
+    pool_free(e->vals, sizeof(lval *) * LENV_SLOTS(e));
+    pool_free(e, sizeof(lenv));
+    stats.env_frees++;
+}
+
+/* Remove an environment with all its content. */
+void lenv_del(lenv *e)
+{
+    int i;
+    if (gc.enabled) {
+        return;
+    }
+    for (i = 0; i < LENV_SLOTS(e); i++) {
+        if (e->syms[i]) {
+            lval_del(e->vals[i]);
+        }
+    }
+    lenv_free(e);
+}
+
+/* Copy an environment. */
+lenv *lenv_copy(lenv *e)
+{
+    int i;
+    lenv *n = lenv_new();
+    stats.env_copies++;
+    n->parent = e->parent;
+    n->name = e->name;
+    n->count = e->count;
+    n->size = e->size;
+    n->syms = pool_alloc(sizeof(char *) * LENV_SLOTS(n));
+    n->vals = pool_alloc(sizeof(lval *) * LENV_SLOTS(n));
+    for (i = 0; i < LENV_SLOTS(e); i++) {
+        n->syms[i] = e->syms[i];
+        n->vals[i] = e->syms[i] ? lval_copy(e->vals[i]) : NULL;
+    }
+    return n;
+}
+
+/* Find the value bound to k, without copying it. NULL if unbound. */
+lval *lval_lookup(lenv *e, lval *k)
+{
+    int i;
+    /* The resolution pass (lval_resolve) recorded in which slot of its
+     * function's frame this symbol is bound; trust it if it still holds. */
+    if (k->slot >= 0 && k->slot < e->count && !e->size &&
+        e->syms[k->slot] == k->sym) {
+        return e->vals[k->slot];
+    }
+    while (e) {
+        if (e->size) {
+            i = lenv_hash_slot(e, k->sym);
+            if (e->syms[i]) {
+                return e->vals[i];
+            }
+        } else {
+            /* Compare the stored names with the symbol's (interned) name. */
+            for (i = 0; i < e->count; i++) {
+                if (e->syms[i] == k->sym) {
+                    return e->vals[i];
+                }
+            }
+        }
+        /* If no symbol found try in parent. */
+        e = e->parent;
+    }
+    return NULL;
+}
+
+/* Get a lval from environment. */
+lval *lenv_get(lenv *e, lval *k)
+{
+    lval *v = lval_lookup(e, k);
+    if (v) {
+        return lval_copy(v);
+    }
+    return lval_err("unbound symbol: '%s'", k->sym);
+}
+
+/* Put a lval inside an environment:
+ * e -> environment
+ * k -> symbol
+ * v-> value
+ */
+void lenv_put(lenv *e, lval *k, lval *v)
+{
+    int i;
+    if (e->size) {
+        i = lenv_hash_slot(e, k->sym);
+        if (e->syms[i]) {
+            lval_del(e->vals[i]);
+            e->vals[i] = lval_copy(v);
+            return;
+        }
+        e->syms[i] = k->sym;
+        e->vals[i] = lval_copy(v);
+        if (2 * ++e->count > e->size) {
+            lenv_grow(e);
+        }
+        return;
+    }
+
+    /* Iterate over all items in environment. */
+    for (i = 0; i < e->count; i++) {
+        /* If variable is found delete item at that position. */
+        if (e->syms[i] == k->sym) {
+            lval_del(e->vals[i]);
+            e->vals[i] = lval_copy(v);
+            return;
+        }
+    }
+
+    /* If no existing entry found allocate space for new entry. */
+    e->count++;
+    e->vals = pool_realloc(e->vals, sizeof(lval *) * (e->count - 1),
+                           sizeof(lval *) * e->count);
+    e->syms = pool_realloc(e->syms, sizeof(char *) * (e->count - 1),
+                           sizeof(char *) * e->count);
+
+    /* Copy contents of lval and share the interned symbol name. */
+    e->vals[e->count-1] = lval_copy(v);
+    e->syms[e->count-1] = k->sym;
+}
+
+/* Capture into c, the frame of a closure created in e, the variables of
+ * syms (see lval_free_syms) bound in the frames of the functions being
+ * called there. Their values are copied: later assignments (with '=') are
+ * not seen by the closure. The global environment is not copied but made
+ * the parent of c, so global definitions are always current. */
+void lenv_capture(lenv *c, lenv *e, lval *syms)
+{
+    int i, j;
+    lenv *f;
+    for (i = 0; i < syms->count; i++) {
+        for (f = e; f->parent; f = f->parent) {
+            for (j = 0; j < f->count && f->syms[j] != syms->cell[i]->sym; j++) {
+            }
+            if (j < f->count) {
+                lenv_put(c, syms->cell[i], f->vals[j]);
+                break;
+            }
+        }
+    }
+    while (e->parent) {
+        e = e->parent;
+    }
+    c->parent = e;
+}
+
+/* Name the function v after the symbol name, unless it has a name
+ * already. Partial applications and memoized functions name the function
+ * they apply. Names are only used by the profiler. */
+void lval_name(lval *v, char *name)
+{
+    while (LTYPE(v) == LVAL_FUN && ! v->builtin_fun && v->applied) {
+        v = v->applied;
+    }
+    if (LTYPE(v) == LVAL_FUN && ! v->builtin_fun && ! v->env->name) {
+        v->env->name = name;
+    }
+}
+
+/* Define a variable in the global environment. */
+void lenv_def(lenv *e, lval *sym, lval *v)
+{
+    /* Iterate until reaching global scope. */
+    while (e->parent) {
+        e = e->parent;
+    }
+    lval_name(v, sym->sym);
+    lenv_put(e, sym, v);
+}
+
+/*****************************************************************/
+
+/******************** Builtin functions. *************************/
+
+/* Print all the variables in the environment. */
+lval *builtin_getenv(lenv *e, lval *v)
+{
+    int i;
+    for (i = 0; i < LENV_SLOTS(e); i++) {
+        if (! e->syms[i]) {
+            continue;
+        }
+        printf("(\"%s\" . ", e->syms[i]);
+        lval_print(stdout, e->vals[i]);
+        printf("\")\n");
+    }
+    return lval_sexpr();
+}
+
+
+/* Given an environment, a symbol (or set of symbols) inside a Q-Expression,
+ * and the same name of values, assign each value to each symbol in order inside the
+ * provided environment.
+ */
+lval *builtin_var(lenv *e, lval *a, char *op)
+{
+    int i;
+    lval *sym, *val;
+    LASSERT(a, (a->count >= 2),
+            "'def' must have at least two arguments: a quoted expression"
+            " and an expression");
+
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "def");
+    LASSERT(a, (a->cell[0]->count > 0),
+            "first argument of 'def' cannot be the empty Q-Expression {}");
+    LASSERT(a, (a->cell[0]->count == a->count - 1),
+            "number of symbols in Q-Expression must match the number of values");
+    for (i = 0; i < a->cell[0]->count; i++) {
+        LASSERT_TYPE(a, a->cell[0]->cell[i], LVAL_SYM, i, "def");
+    }
+    /* Other threads may be reading the globals (see par_push): they
+     * can't be defined in a parallel task, and are only defined once the
+     * tasks are finished. */
+    LASSERT(a, ! (par_running && STREQ(op, "def")),
+            "Function 'def' called from a parallel task. Globals can't be "
+            "defined there.");
+    if (STREQ(op, "def") || ! e->parent) {
+        par_wait_all();
+    }
+    /* Add all the symbols to the environment. */
+    a->cell[0] = lval_unshare(a->cell[0]);
+    while (a->count > 1) {
+        sym = lval_pop(a->cell[0], 0);
+        val = lval_pop(a, 1);
+        if (STREQ(op, "def")) {
+            lenv_def(e, sym, val);
+        }
+        if (STREQ(op, "=")) {
+            lenv_put(e, sym, val);
+        }
+        lval_del(sym);
+        lval_del(val);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_def(lenv *e, lval *a)
+{
+    return builtin_var(e, a, "def");
+}
+
+lval *builtin_put(lenv *e, lval *a)
+{
+    return builtin_var(e, a, "=");
+}
+
+lval *builtin_op(lenv *e, lval *a, char *op)
+{
+    /* Ensure all arguments are numbers, or work elementwise on vectors. */
+    int i;
+    for (i = 0; i < a->count; i++) {
+        if (LTYPE(a->cell[i]) == LVAL_VEC) {
+            return vec_op(a, op);
+        }
+        LASSERT_TYPE(a, a->cell[i], LVAL_NUM, i, op);
+    }
+    LASSERT(a, a->count,
+            "Function '%s' passed too few arguments. Expected at least 1, "
+            "but got 0.", op);
+
+    /* Numbers may be shared, so accumulate the result in x. */
+    long x = LNUM(a->cell[0]);
+
+    /* If no arguments and sub then perform unary negation. */
+    if (STREQ(op, "-") && a->count == 1) {
+        x = - x;
+    }
+
+    /* For each of the remaining elements... */
+    for (i = 1; i < a->count; i++) {
+        long y = LNUM(a->cell[i]);
+
+        switch (*op) {
+            case '+': x += y; break;
+            case '-': x -= y; break;
+            case '*': x *= y; break;
+            case '/':
+                /* Ensure we're not dividing by zero. */
+                if (y == 0) {
+                    lval_del(a);
+                    return lval_err("Division by zero!");
+                }
+                x /= y;
+                break;
+        }
+    }
+    lval_del(a);
+    return lval_num(x);
+}
+
+
+lval *builtin_add(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "+");
+}
+
+lval *builtin_sub(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "-");
+}
+
+lval *builtin_mul(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "*");
+}
+
+lval *builtin_div(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "/");
+}
+
+lval* builtin_head(lenv *e, lval *a)
+{
+    /* Check error conditions. */
+    LASSERT_NARGS(a, a->count, 1, "head");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "head");
+    LASSERT(a, a->cell[0]->count != 0,
+            "Function 'head' expected a non-emtpy Q-Expr, but was passed '{}'.");
+
+    /* Otherwise take first argument, and keep only its first element. */
+    lval *v = lval_take(a, 0);
+    return lval_slice(v, 0, 1);
+}
+
+lval* builtin_tail(lenv *e, lval *a)
+{
+    /* Check error conditions. */
+    LASSERT_NARGS(a, a->count, 1, "tail");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "tail");
+    LASSERT(a, a->cell[0]->count != 0,
+            "Function 'tail' expected a non-emtpy Q-Expr, but was passed '{}'.");
+
+    /* Take first argument, and drop its first element. */
+    lval *v = lval_take(a, 0);
+    return lval_slice(v, 1, v->count);
+}
+
+/* Turn an S-Expression into a Q-Expression. */
+lval* builtin_list(lenv *e, lval *a)
+{
+    lval_set_type(a, LVAL_QEXPR);
+    return a;
+}
+
+/* Join two Q-Expressions. */
+lval* builtin_join(lenv *e, lval *a)
+{
+    int i;
+    for (i = 0; i < a->count; i++) {
+        LASSERT_TYPE(a, a->cell[i], LVAL_QEXPR, i, "join");
+    }
+    LASSERT(a, a->count,
+            "Function 'join' passed too few arguments. Expected at least 1, "
+            "but got 0.");
+
+    lval *x = lval_pop(a, 0);
+
+    while (a->count) {
+        x = lval_join(e, x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+/* Exit from the program. */
+lval *builtin_exit(lenv *e, lval *v)
+{
+    int out = 0;
+    LASSERT_NARGS_RANGE(v, v->count, 0, 1, "exit");
+    if (v->count) {
+        LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, "exit");
+        out = LNUM(v->cell[0]);
+    }
+    exit(out);
+}
+
+lval *builtin_lambda(lenv *e, lval *a)
+{
+    int i;
+    /* Check for two arguments, each a Q-Expression. */
+    LASSERT_NARGS(a, a->count, 2, "\\");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "\\");
+    LASSERT_TYPE(a, a->cell[1], LVAL_QEXPR, 1, "\\");
+
+    /* Check first Q-Expression contains only Symbols. */
+    for (i = 0; i < a->cell[0]->count; i++) {
+        LASSERT_TYPE(a, a->cell[0]->cell[i], LVAL_SYM, i, "\\");
+    }
+
+    /* Pop first two arguments and pass them to lval_lambda */
+    lval *formals = lval_pop(a, 0);
+    lval *body = lval_pop(a, 0);
+    lval_del(a);
+
+    lval *f = lval_lambda(formals, body);
+    lval *syms = lval_free_syms(lval_qexpr(), f->body, f->formals);
+    lenv_capture(f->env, e, syms);
+    lval_del(syms);
+    if (vm_enabled) {
+        f->chunk = vm_compile_body(f->body);
+    }
+    return f;
+}
+
+/*** Builtins for comparison ***/
+
+lval *builtin_ord(lenv *e, lval *v, char *op)
+{
+    LASSERT_NARGS(v, v->count, 2, op);
+    /* Comparing vectors gives a mask: a vector of 1 where it holds, else 0. */
+    if (LTYPE(v->cell[0]) == LVAL_VEC || LTYPE(v->cell[1]) == LVAL_VEC) {
+        return vec_op(v, op);
+    }
+    LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, op);
+    LASSERT_TYPE(v, v->cell[1], LVAL_NUM, 1, op);
+
+    int r = 0;
+    long a = LNUM(v->cell[0]);
+    long b = LNUM(v->cell[1]);
+    lval_del(v);
+
+    if (STREQ(op, "equal")) {
+        r = (a == b);
+    }
+    if (STREQ(op, "<=")) {
+        r = (a <= b);
+    }
+    if (STREQ(op, ">=")) {
+        r = (a >= b);
+    }
+    if (STREQ(op, "<")) {
+        r = (a < b);
+    }
+    if (STREQ(op, ">")) {
+        r = (a > b);
+    }
+
+    return lval_num(r);
+}
+
+/* equal */
+lval *builtin_eq(lenv *e, lval *v)
+{
+    LASSERT_NARGS(v, v->count, 2, "eq");
+    int res = lval_eq(v->cell[0], v->cell[1]);
+    lval_del(v);
+    return lval_num(res);
+}
+
+/* greater */
+lval *builtin_gt(lenv *e, lval *v)
+{
+    return builtin_ord(e, v, ">");
+}
+
+/* lesser */
+lval *builtin_lt(lenv *e, lval *v)
+{
+    return builtin_ord(e, v, "<");
+}
+
+/* greater or equal */
+lval *builtin_ge(lenv *e, lval *v)
+{
+    return builtin_ord(e, v, ">=");
+}
+
+/* lesser or equal */
+lval *builtin_le(lenv *e, lval *v)
+{
+    return builtin_ord(e, v, "<=");
+}
+
+/* negation */
+lval *builtin_not(lenv *e, lval *v)
+{
+    /* Check for one argument, a number. */
+    LASSERT_NARGS(v, v->count, 1, "not");
+    LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, "not");
+
+    lval *x = lval_num(! LNUM(v->cell[0]));
+    lval_del(v);
+    return x;
+}
+
+/* and */
+lval *builtin_and(lenv *e, lval *v)
+{
+    int i;
+    lval *res;
+    /* Ensure all arguments are of type num. */
+    for (i = 0; i < v->count; i++) {
+        LASSERT_TYPE(v, v->cell[i], LVAL_NUM, i, "and");
+    }
+    LASSERT(v, v->count,
+            "Function 'and' passed too few arguments. Expected at least 1, "
+            "but got 0.");
+    for (i = 0; i < v->count; i++) {
+        if (!LNUM(v->cell[i])) {
+            res = lval_pop(v, i);
+            lval_del(v);
+            return res;
+        }
+    }
+    res = lval_pop(v, v->count-1);
+    lval_del(v);
+    return res;
+}
+
+/* or */
+lval *builtin_or(lenv *e, lval *v)
+{
+    int i;
+    lval *res;
+    /* Ensure all arguments are of type num. */
+    for (i = 0; i < v->count; i++) {
+        LASSERT_TYPE(v, v->cell[i], LVAL_NUM, i, "or");
+    }
+    for (i = 0; i < v->count; i++) {
+        if (LNUM(v->cell[i])) {
+            res = lval_pop(v, i);
+            lval_del(v);
+            return res;
+        }
+    }
+    lval_del(v);
+    return lval_num(0);
+}
+
+/* conditional (if (condition) {consequence} {alternative}) */
+lval *builtin_if(lenv *e, lval *v)
+{
+    /* Ensure we have 2 or three arguments,
+     * first is bool (number) and the other one
+     * or two are qexprs (code) */
+    LASSERT_NARGS_RANGE(v, v->count, 2, 3, "if");
+    LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, "if");
+    LASSERT_TYPE(v, v->cell[1], LVAL_QEXPR, 1, "if");
+    lval *code = NULL;
+    if (LNUM(v->cell[0])) {
+        code = lval_pop(v, 1);
+    } else if (v->count == 3) {
+        LASSERT_TYPE(v, v->cell[2], LVAL_QEXPR, 2, "if");
+        code = lval_pop(v, 2);
+    }
+    code = (code ? lval_unshare(code) : lval_sexpr());
+    lval_set_type(code, LVAL_SEXPR);
+    lval_del(v);
+    return lval_tail(NULL, e, code, NULL);
+}
+
+/*************** Vectors. *************************************/
+
+/* A vector is a packed array of numbers, for the operators to work on
+ * whole arrays at a time: (+ v w), (* v 2), (< v 10), (sum v)... The
+ * kernels below do the work, on 4 numbers at a time with AVX2 when the
+ * CPU has it (2 with SSE2 for some), and a number at a time after that or
+ * otherwise. Numbers wrap around on overflow, like the SIMD instructions.
+ */
+enum { VEC_ADD, VEC_SUB, VEC_MUL, VEC_DIV, VEC_LT, VEC_GT, VEC_LE, VEC_GE, VEC_EQ };
+enum { VEC_SUM, VEC_MIN, VEC_MAX };
+
+/* Kernel for the operator op (by name). */
+int vec_opcode(char *op)
+{
+    static char *names[] = { "+", "-", "*", "/", "<", ">", "<=", ">=", "vec-eq" };
+    int k;
+    for (k = 0; k < VEC_EQ && ! STREQ(names[k], op); k++) {
+    }
+    return k;
+}
+
+#if VEC_X86
+/* Whether the CPU has AVX2 (checked once). */
+int vec_avx2(void)
+{
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return avx2;
+}
+
+/* AVX2 has no 64 bit multiplication: make it of 32 bit ones. With
+ * a = ah:al and b = bh:bl, the low 64 bits of a * b are
+ * al * bl + ((al * bh + ah * bl) << 32). */
+__attribute__((target("avx2")))
+static __m256i vec_mul_avx2(__m256i a, __m256i b)
+{
+    __m256i cross = _mm256_mullo_epi32(a, _mm256_shuffle_epi32(b, 0xB1));
+    cross = _mm256_hadd_epi32(cross, _mm256_setzero_si256());
+    cross = _mm256_shuffle_epi32(cross, 0x73);
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b), cross);
+}
+
+#define VEC_LOOP_AVX2(expr) \
+    for (; i + 4 <= n; i += 4) { \
+        if (xs) { \
+            a = _mm256_loadu_si256((const __m256i *) (x + i)); \
+        } \
+        if (ys) { \
+            b = _mm256_loadu_si256((const __m256i *) (y + i)); \
+        } \
+        _mm256_storeu_si256((__m256i *) (out + i), (expr)); \
+    } \
+    break
+
+/* The part of vec_map done with AVX2, returning how many numbers it did. */
+__attribute__((target("avx2")))
+long vec_map_avx2(int op, int64_t *out, const int64_t *x, int xs,
+                  const int64_t *y, int ys, long n)
+{
+    long i = 0;
+    __m256i a, b, one;
+    if (n < 4) {
+        return 0;
+    }
+    a = _mm256_set1_epi64x(x[0]);
+    b = _mm256_set1_epi64x(y[0]);
+    one = _mm256_set1_epi64x(1);
+    switch (op) {
+        case VEC_ADD: VEC_LOOP_AVX2(_mm256_add_epi64(a, b));
+        case VEC_SUB: VEC_LOOP_AVX2(_mm256_sub_epi64(a, b));
+        case VEC_MUL: VEC_LOOP_AVX2(vec_mul_avx2(a, b));
+        case VEC_LT: VEC_LOOP_AVX2(_mm256_and_si256(_mm256_cmpgt_epi64(b, a), one));
+        case VEC_GT: VEC_LOOP_AVX2(_mm256_and_si256(_mm256_cmpgt_epi64(a, b), one));
+        case VEC_LE: VEC_LOOP_AVX2(_mm256_andnot_si256(_mm256_cmpgt_epi64(a, b), one));
+        case VEC_GE: VEC_LOOP_AVX2(_mm256_andnot_si256(_mm256_cmpgt_epi64(b, a), one));
+        case VEC_EQ: VEC_LOOP_AVX2(_mm256_and_si256(_mm256_cmpeq_epi64(a, b), one));
+        /* There is no SIMD integer division. */
+    }
+    return i;
+}
+
+/* The part of vec_map done with SSE2 (only additions and subtractions: it
+ * has no 64 bit comparisons or multiplication). */
+#ifdef __SSE2__
+#define VEC_LOOP_SSE2(expr) \
+    for (; i + 2 <= n; i += 2) { \
+        if (xs) { \
+            a = _mm_loadu_si128((const __m128i *) (x + i)); \
+        } \
+        if (ys) { \
+            b = _mm_loadu_si128((const __m128i *) (y + i)); \
+        } \
+        _mm_storeu_si128((__m128i *) (out + i), (expr)); \
+    } \
+    break
+
+long vec_map_sse2(int op, int64_t *out, const int64_t *x, int xs,
+                  const int64_t *y, int ys, long n)
+{
+    long i = 0;
+    __m128i a, b;
+    if (n < 2) {
+        return 0;
+    }
+    a = _mm_set1_epi64x(x[0]);
+    b = _mm_set1_epi64x(y[0]);
+    switch (op) {
+        case VEC_ADD: VEC_LOOP_SSE2(_mm_add_epi64(a, b));
+        case VEC_SUB: VEC_LOOP_SSE2(_mm_sub_epi64(a, b));
+    }
+    return i;
+}
+#endif
+
+/* The part of vec_reduce done with AVX2: the result of the first n / 4 * 4
+ * numbers (n >= 4) is left in *r, and the count returned. */
+__attribute__((target("avx2")))
+long vec_reduce_avx2(int op, const int64_t *x, long n, int64_t *r)
+{
+    long i;
+    int64_t lanes[4];
+    __m256i acc, v;
+    acc = op == VEC_SUM ? _mm256_setzero_si256() : _mm256_loadu_si256((const __m256i *) x);
+    for (i = 0; i + 4 <= n; i += 4) {
+        v = _mm256_loadu_si256((const __m256i *) (x + i));
+        switch (op) {
+            case VEC_SUM:
+                acc = _mm256_add_epi64(acc, v);
+                break;
+            case VEC_MIN:
+                acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(acc, v));
+                break;
+            case VEC_MAX:
+                acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(v, acc));
+                break;
+        }
+    }
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    switch (op) {
+        case VEC_SUM:
+            *r = (int64_t) ((uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+            break;
+        case VEC_MIN:
+            *r = min(min(lanes[0], lanes[1]), min(lanes[2], lanes[3]));
+            break;
+        case VEC_MAX:
+            *r = max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+            break;
+    }
+    return i;
+}
+
+/* The part of vec_dot done with AVX2, as vec_reduce_avx2. */
+__attribute__((target("avx2")))
+long vec_dot_avx2(const int64_t *x, const int64_t *y, long n, int64_t *r)
+{
+    long i;
+    int64_t lanes[4];
+    __m256i acc = _mm256_setzero_si256();
+    for (i = 0; i + 4 <= n; i += 4) {
+        acc = _mm256_add_epi64(acc, vec_mul_avx2(
+                  _mm256_loadu_si256((const __m256i *) (x + i)),
+                  _mm256_loadu_si256((const __m256i *) (y + i))));
+    }
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    *r = (int64_t) ((uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    return i;
+}
+
+/* The part of vec_gather done with AVX2. */
+__attribute__((target("avx2")))
+long vec_gather_avx2(int64_t *out, const int64_t *x, const int64_t *idx, long n)
+{
+    long i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_i64gather_epi64((const long long *) x,
+                        _mm256_loadu_si256((const __m256i *) (idx + i)), 8);
+        _mm256_storeu_si256((__m256i *) (out + i), v);
+    }
+    return i;
+}
+#endif
+
+#define VEC_LOOP(expr) \
+    for (; i < n; i++) { \
+        a = x[xs ? i : 0]; \
+        b = y[ys ? i : 0]; \
+        out[i] = (expr); \
+    } \
+    break
+
+/* out[i] = x[i] op y[i] for i < n, where x (or y) is a single number used
+ * for every i when xs (or ys) is 0. out may be x or y. For VEC_DIV, y must
+ * not contain 0. */
+void vec_map(int op, int64_t *out, const int64_t *x, int xs,
+             const int64_t *y, int ys, long n)
+{
+    long i = 0;
+    int64_t a, b;
+#if VEC_X86
+    if (vec_avx2()) {
+        i = vec_map_avx2(op, out, x, xs, y, ys, n);
+    }
+#ifdef __SSE2__
+    else {
+        i = vec_map_sse2(op, out, x, xs, y, ys, n);
+    }
+#endif
+#endif
+    switch (op) {
+        case VEC_ADD: VEC_LOOP((int64_t) ((uint64_t) a + (uint64_t) b));
+        case VEC_SUB: VEC_LOOP((int64_t) ((uint64_t) a - (uint64_t) b));
+        case VEC_MUL: VEC_LOOP((int64_t) ((uint64_t) a * (uint64_t) b));
+        case VEC_DIV: VEC_LOOP(a / b);
+        case VEC_LT: VEC_LOOP(a < b);
+        case VEC_GT: VEC_LOOP(a > b);
+        case VEC_LE: VEC_LOOP(a <= b);
+        case VEC_GE: VEC_LOOP(a >= b);
+        case VEC_EQ: VEC_LOOP(a == b);
+    }
+}
+
+/* The sum, minimum or maximum of the n numbers at x (n > 0 but for the
+ * sum). */
+int64_t vec_reduce(int op, const int64_t *x, long n)
+{
+    long i = 0;
+    int64_t r = op == VEC_SUM ? 0 : x[0];
+#if VEC_X86
+    if (n >= 4 && vec_avx2()) {
+        i = vec_reduce_avx2(op, x, n, &r);
+    }
+#endif
+    for (; i < n; i++) {
+        switch (op) {
+            case VEC_SUM: r = (int64_t) ((uint64_t) r + x[i]); break;
+            case VEC_MIN: r = min(r, x[i]); break;
+            case VEC_MAX: r = max(r, x[i]); break;
+        }
+    }
+    return r;
+}
+
+/* The sum of x[i] * y[i] for i < n. */
+int64_t vec_dot(const int64_t *x, const int64_t *y, long n)
+{
+    long i = 0;
+    int64_t r = 0;
+#if VEC_X86
+    if (vec_avx2()) {
+        i = vec_dot_avx2(x, y, n, &r);
+    }
+#endif
+    for (; i < n; i++) {
+        r = (int64_t) ((uint64_t) r + (uint64_t) x[i] * (uint64_t) y[i]);
+    }
+    return r;
+}
+
+/* out[i] = x[idx[i]] for i < n. The indices must be valid. */
+void vec_gather(int64_t *out, const int64_t *x, const int64_t *idx, long n)
+{
+    long i = 0;
+#if VEC_X86
+    if (vec_avx2()) {
+        i = vec_gather_avx2(out, x, idx, n);
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = x[idx[i]];
+    }
+}
+
+/* Whether the n indices at idx are all within a vector of len numbers. */
+int vec_in_bounds(const int64_t *idx, long n, long len)
+{
+    return n == 0 || (vec_reduce(VEC_MIN, idx, n) >= 0 &&
+                      vec_reduce(VEC_MAX, idx, n) < len);
+}
+
+/* Whether the number or vector v is (or has a) 0. */
+int vec_has_zero(lval *v)
+{
+    long i;
+    if (LTYPE(v) == LVAL_NUM) {
+        return LNUM(v) == 0;
+    }
+    for (i = 0; i < v->len; i++) {
+        if (v->nums[i] == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Apply the operator op (an arithmetic operator, a comparison or vec-eq)
+ * to the numbers and vectors in a, from left to right. The vectors must
+ * all have the same length, numbers are used for every element. */
+lval *vec_op(lval *a, char *op)
+{
+    int i, k = vec_opcode(op);
+    long n = -1;
+    int64_t nx, ny, t;
+    lval *x, *y, *r;
+
+    for (i = 0; i < a->count; i++) {
+        y = a->cell[i];
+        LASSERT(a, LTYPE(y) == LVAL_NUM || LTYPE(y) == LVAL_VEC,
+                "Function '%s' passed incorrect type for argument %d. "
+                "Expected Number or Vector, but got %s.",
+                op, i, ltype_name(LTYPE(y)));
+        if (LTYPE(y) == LVAL_VEC) {
+            LASSERT(a, n < 0 || y->len == n,
+                    "Function '%s' passed vectors of different lengths "
+                    "(%li and %li).", op, n, y->len);
+            n = y->len;
+        }
+    }
+
+    x = lval_pop(a, 0);
+    /* Unary minus. */
+    if (k == VEC_SUB && a->count == 0) {
+        a = lval_add(a, x);
+        x = lval_num(0);
+    }
+    while (a->count) {
+        y = lval_pop(a, 0);
+        if (k == VEC_DIV && vec_has_zero(y)) {
+            lval_del(x);
+            lval_del(y);
+            lval_del(a);
+            return lval_err("Division by zero!");
+        }
+        nx = LTYPE(x) == LVAL_NUM ? LNUM(x) : 0;
+        ny = LTYPE(y) == LVAL_NUM ? LNUM(y) : 0;
+        if (LTYPE(x) == LVAL_NUM && LTYPE(y) == LVAL_NUM) {
+            vec_map(k, &t, &nx, 0, &ny, 0, 1);
+            r = lval_num(t);
+        } else {
+            /* Reuse a vector no one else refers to for the result. */
+            if (LTYPE(x) == LVAL_VEC && refs_get(&x->refs) == 1) {
+                r = x;
+            } else if (LTYPE(y) == LVAL_VEC && refs_get(&y->refs) == 1) {
+                r = y;
+            } else if (LTYPE(r = lval_vec(n)) == LVAL_ERR) {
+                lval_del(x);
+                lval_del(y);
+                lval_del(a);
+                return r;
+            }
+            vec_map(k, r->nums, LTYPE(x) == LVAL_VEC ? x->nums : &nx, LTYPE(x) == LVAL_VEC,
+                    LTYPE(y) == LVAL_VEC ? y->nums : &ny, LTYPE(y) == LVAL_VEC, n);
+        }
+        if (r != x) {
+            lval_del(x);
+        }
+        if (r != y) {
+            lval_del(y);
+        }
+        x = r;
+    }
+    lval_del(a);
+    return x;
+}
+
+/* (vec 1 2 3) or (vec {1 2 3}): a vector of the numbers given. */
+lval *builtin_vec(lenv *e, lval *a)
+{
+    long i;
+    lval *v, *l = a;
+    if (a->count == 1 && LTYPE(a->cell[0]) == LVAL_QEXPR) {
+        l = a->cell[0];
+    }
+    for (i = 0; i < l->count; i++) {
+        LASSERT_TYPE(a, l->cell[i], LVAL_NUM, (int) i, "vec");
+    }
+    v = lval_vec(l->count);
+    for (i = 0; LTYPE(v) == LVAL_VEC && i < l->count; i++) {
+        v->nums[i] = LNUM(l->cell[i]);
+    }
+    lval_del(a);
+    return v;
+}
+
+/* (vec-range n): the vector 0 1 ... n-1, (vec-range from to) from ... to-1. */
+lval *builtin_vec_range(lenv *e, lval *a)
+{
+    long i, from = 0, to;
+    lval *v;
+    LASSERT_NARGS_RANGE(a, a->count, 1, 2, "vec-range");
+    for (i = 0; i < a->count; i++) {
+        LASSERT_TYPE(a, a->cell[i], LVAL_NUM, (int) i, "vec-range");
+    }
+    to = LNUM(a->cell[a->count - 1]);
+    if (a->count == 2) {
+        from = LNUM(a->cell[0]);
+    }
+    lval_del(a);
+    /* to - from must not overflow. */
+    if (from < 0 && to > LONG_MAX + from) {
+        return lval_err("Function 'vec-range' passed a range too long.");
+    }
+    v = lval_vec(to > from ? to - from : 0);
+    for (i = 0; LTYPE(v) == LVAL_VEC && i < v->len; i++) {
+        v->nums[i] = from + i;
+    }
+    return v;
+}
+
+/* The numbers of a vector, in a Q-Expression. */
+lval *builtin_vec_list(lenv *e, lval *a)
+{
+    long i;
+    lval *v, *l;
+    LASSERT_NARGS(a, a->count, 1, "vec-list");
+    LASSERT_TYPE(a, a->cell[0], LVAL_VEC, 0, "vec-list");
+    v = a->cell[0];
+    l = lval_qexpr();
+    lval_reserve(l, v->len);
+    for (i = 0; i < v->len; i++) {
+        lval_add(l, lval_num(v->nums[i]));
+    }
+    lval_del(a);
+    return l;
+}
+
+lval *builtin_vec_len(lenv *e, lval *a)
+{
+    long len;
+    LASSERT_NARGS(a, a->count, 1, "vec-len");
+    LASSERT_TYPE(a, a->cell[0], LVAL_VEC, 0, "vec-len");
+    len = a->cell[0]->len;
+    lval_del(a);
+    return lval_num(len);
+}
+
+/* (sum v), (min v), (max v) of the numbers of the vector v, or of numbers
+ * given as arguments: (min 1 2 3). */
+lval *builtin_reduce(lenv *e, lval *a, int op, char *name)
+{
+    int i;
+    int64_t r;
+    if (a->count == 1 && LTYPE(a->cell[0]) == LVAL_VEC) {
+        LASSERT(a, op == VEC_SUM || a->cell[0]->len,
+                "Function '%s' passed an empty vector.", name);
+        r = vec_reduce(op, a->cell[0]->nums, a->cell[0]->len);
+        lval_del(a);
+        return lval_num(r);
+    }
+    LASSERT(a, op == VEC_SUM || a->count,
+            "Function '%s' passed too few arguments. Expected at least 1, "
+            "but got 0.", name);
+    for (i = 0; i < a->count; i++) {
+        LASSERT_TYPE(a, a->cell[i], LVAL_NUM, i, name);
+    }
+    r = a->count ? LNUM(a->cell[0]) : 0;
+    for (i = 1; i < a->count; i++) {
+        switch (op) {
+            case VEC_SUM: r += LNUM(a->cell[i]); break;
+            case VEC_MIN: r = min(r, LNUM(a->cell[i])); break;
+            case VEC_MAX: r = max(r, LNUM(a->cell[i])); break;
+        }
+    }
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval *builtin_sum(lenv *e, lval *a)
+{
+    return builtin_reduce(e, a, VEC_SUM, "sum");
+}
+
+lval *builtin_min(lenv *e, lval *a)
+{
+    return builtin_reduce(e, a, VEC_MIN, "min");
+}
+
+lval *builtin_max(lenv *e, lval *a)
+{
+    return builtin_reduce(e, a, VEC_MAX, "max");
+}
+
+/* Dot product of two vectors. */
+lval *builtin_dot(lenv *e, lval *a)
+{
+    int64_t r;
+    LASSERT_NARGS(a, a->count, 2, "dot");
+    LASSERT_TYPE(a, a->cell[0], LVAL_VEC, 0, "dot");
+    LASSERT_TYPE(a, a->cell[1], LVAL_VEC, 1, "dot");
+    LASSERT(a, a->cell[0]->len == a->cell[1]->len,
+            "Function 'dot' passed vectors of different lengths (%li and %li).",
+            a->cell[0]->len, a->cell[1]->len);
+    r = vec_dot(a->cell[0]->nums, a->cell[1]->nums, a->cell[0]->len);
+    lval_del(a);
+    return lval_num(r);
+}
+
+/* (vec-eq v w): mask of the elements of v equal to those of w. */
+lval *builtin_vec_eq(lenv *e, lval *a)
+{
+    LASSERT_NARGS(a, a->count, 2, "vec-eq");
+    return vec_op(a, "vec-eq");
+}
+
+/* (gather v idx): the vector of the numbers of v at the indices in the
+ * vector idx, or the single number at the index idx. */
+lval *builtin_gather(lenv *e, lval *a)
+{
+    lval *v, *idx, *r;
+    LASSERT_NARGS(a, a->count, 2, "gather");
+    LASSERT_TYPE(a, a->cell[0], LVAL_VEC, 0, "gather");
+    v = a->cell[0];
+    idx = a->cell[1];
+    if (LTYPE(idx) == LVAL_NUM) {
+        LASSERT(a, LNUM(idx) >= 0 && LNUM(idx) < v->len,
+                "Function 'gather' passed index %li out of bounds.", LNUM(idx));
+        r = lval_num(v->nums[LNUM(idx)]);
+        lval_del(a);
+        return r;
+    }
+    LASSERT_TYPE(a, idx, LVAL_VEC, 1, "gather");
+    LASSERT(a, vec_in_bounds(idx->nums, idx->len, v->len),
+            "Function 'gather' passed an index out of bounds.");
+    r = lval_vec(idx->len);
+    if (LTYPE(r) == LVAL_VEC) {
+        vec_gather(r->nums, v->nums, idx->nums, idx->len);
+    }
+    lval_del(a);
+    return r;
+}
+
+/* (scatter v idx x): v with the numbers at the indices in the vector idx
+ * replaced by those of the vector x (in order, the last one wins), or all
+ * by the number x. */
+lval *builtin_scatter(lenv *e, lval *a)
+{
+    long i;
+    lval *v, *idx, *x;
+    LASSERT_NARGS(a, a->count, 3, "scatter");
+    LASSERT_TYPE(a, a->cell[0], LVAL_VEC, 0, "scatter");
+    LASSERT_TYPE(a, a->cell[1], LVAL_VEC, 1, "scatter");
+    idx = a->cell[1];
+    x = a->cell[2];
+    LASSERT(a, vec_in_bounds(idx->nums, idx->len, a->cell[0]->len),
+            "Function 'scatter' passed an index out of bounds.");
+    if (LTYPE(x) != LVAL_NUM) {
+        LASSERT_TYPE(a, x, LVAL_VEC, 2, "scatter");
+        LASSERT(a, x->len == idx->len,
+                "Function 'scatter' passed %li indices for %li numbers.",
+                idx->len, x->len);
+    }
+    /* There is no AVX2 scatter, and it would not keep the order anyway. */
+    v = lval_unshare(lval_pop(a, 0));
+    if (LTYPE(v) == LVAL_ERR) {
+        /* There was no memory for a copy. */
+        lval_del(a);
+        return v;
+    }
+    if (LTYPE(x) == LVAL_NUM) {
+        for (i = 0; i < idx->len; i++) {
+            v->nums[idx->nums[i]] = LNUM(x);
+        }
+    } else {
+        for (i = 0; i < idx->len; i++) {
+            v->nums[idx->nums[i]] = x->nums[i];
+        }
+    }
+    lval_del(a);
+    return v;
+}
+
+/*************** Memoization. *********************************/
+
+/* (memo f) is f, remembering the results of its last calls: called again
+ * with arguments equal (lval_eq) to those of a remembered call, it returns
+ * the same result without calling f. Only for pure functions! Recursive
+ * functions defined with a memoized version of themselves, like
+ *   (def {fib} (memo (\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})))
+ * then compute each result once. (memo-stats f) tells how well it works.
+ */
+#ifndef MEMO_CAPACITY
+#define MEMO_CAPACITY 4096
+#endif
+
+/* A memoized version of f, remembering up to capacity results. */
+lval *lval_memo(lval *f, int capacity)
+{
+    lmemo *m = malloc(sizeof(lmemo));
+    m->refs = 1;
+    m->count = 0;
+    m->capacity = capacity;
+    m->nbuckets = 16;
+    while (m->nbuckets < capacity && m->nbuckets < 65536) {
+        m->nbuckets *= 2;
+    }
+    m->buckets = calloc(m->nbuckets, sizeof(struct lmemo_entry *));
+    m->newest = NULL;
+    m->oldest = NULL;
+    m->hits = 0;
+    m->misses = 0;
+    m->mark = 0;
+    pthread_mutex_init(&m->lock, NULL);
+
+    lval *v = lval_new(LVAL_FUN);
+    v->builtin_fun = NULL;
+    v->memo = m;
+    v->formals = NULL;
+    v->body = NULL;
+    v->chunk = NULL;
+    v->applied = f;
+    v->args = NULL;
+    return v;
+}
+
+/* Take the entry x out of the list of m. */
+void memo_unlink(lmemo *m, struct lmemo_entry *x)
+{
+    if (x->newer) {
+        x->newer->older = x->older;
+    } else {
+        m->newest = x->older;
+    }
+    if (x->older) {
+        x->older->newer = x->newer;
+    } else {
+        m->oldest = x->newer;
+    }
+}
+
+/* Put the entry x at the front of the list of m. */
+void memo_link(lmemo *m, struct lmemo_entry *x)
+{
+    x->newer = NULL;
+    x->older = m->newest;
+    if (m->newest) {
+        m->newest->newer = x;
+    } else {
+        m->oldest = x;
+    }
+    m->newest = x;
+}
+
+/* Remove the entry x from m. */
+void memo_remove(lmemo *m, struct lmemo_entry *x)
+{
+    struct lmemo_entry **p = &m->buckets[x->hash & (m->nbuckets - 1)];
+    while (*p != x) {
+        p = &(*p)->next;
+    }
+    *p = x->next;
+    memo_unlink(m, x);
+    lval_del(x->args);
+    lval_del(x->val);
+    free(x);
+    m->count--;
+}
+
+/* Drop a reference to the cache m. */
+void memo_del(lmemo *m)
+{
+    if (refs_dec(&m->refs) > 0) {
+        return;
+    }
+    while (m->oldest) {
+        memo_remove(m, m->oldest);
+    }
+    pthread_mutex_destroy(&m->lock);
+    free(m->buckets);
+    free(m);
+}
+
+/* Call the memoized function f with the arguments v (see lval_call). */
+lval *memo_call(lenv *e, lval *f, lval *v)
+{
+    lmemo *m = f->memo;
+    unsigned long hash = lval_hash(v);
+    struct lmemo_entry *x;
+    lval *r;
+    int locked = PAR_ACTIVE();
+
+    if (locked) {
+        pthread_mutex_lock(&m->lock);
+    }
+    x = m->buckets[hash & (m->nbuckets - 1)];
+    while (x && ! (x->hash == hash && lval_eq(x->args, v))) {
+        x = x->next;
+    }
+    if (x) {
+        m->hits++;
+        memo_unlink(m, x);
+        memo_link(m, x);
+        lval_del(v);
+        r = lval_copy(x->val);
+        if (locked) {
+            pthread_mutex_unlock(&m->lock);
+        }
+        return r;
+    }
+
+    /* The call may use (and evict entries of) the cache too: keep v, and
+     * don't hold on to any entry meanwhile. */
+    m->misses++;
+    if (locked) {
+        pthread_mutex_unlock(&m->lock);
+    }
+    r = lval_untail(lval_call(e, f->applied, lval_clone(v)));
+    if (LTYPE(r) == LVAL_ERR) {
+        lval_del(v);
+        return r;
+    }
+    /* The call may have pushed tasks (see builtin_future). */
+    locked = PAR_ACTIVE();
+    if (locked) {
+        pthread_mutex_lock(&m->lock);
+    }
+    if (m->count == m->capacity) {
+        memo_remove(m, m->oldest);
+    }
+    x = malloc(sizeof(struct lmemo_entry));
+    x->hash = hash;
+    x->args = v;
+    x->val = lval_copy(r);
+    x->next = m->buckets[hash & (m->nbuckets - 1)];
+    m->buckets[hash & (m->nbuckets - 1)] = x;
+    memo_link(m, x);
+    m->count++;
+    if (locked) {
+        pthread_mutex_unlock(&m->lock);
+    }
+    return r;
+}
+
+/* (memo f) or (memo f capacity): see above. */
+lval *builtin_memo(lenv *e, lval *a)
+{
+    int capacity = MEMO_CAPACITY;
+    LASSERT_NARGS_RANGE(a, a->count, 1, 2, "memo");
+    LASSERT_TYPE(a, a->cell[0], LVAL_FUN, 0, "memo");
+    LASSERT(a, ! a->cell[0]->builtin_fun,
+            "Function 'memo' passed a builtin function. Expected a user "
+            "defined one.");
+    if (a->count == 2) {
+        LASSERT_TYPE(a, a->cell[1], LVAL_NUM, 1, "memo");
+        LASSERT(a, LNUM(a->cell[1]) >= 1 && LNUM(a->cell[1]) <= INT_MAX,
+                "Function 'memo' passed an invalid capacity %li.",
+                LNUM(a->cell[1]));
+        capacity = LNUM(a->cell[1]);
+    }
+    return lval_memo(lval_take(a, 0), capacity);
+}
+
+/* (memo-stats f): {hits misses entries capacity} of the memoized f. */
+lval *builtin_memo_stats(lenv *e, lval *a)
+{
+    lmemo *m;
+    lval *r;
+    LASSERT_NARGS(a, a->count, 1, "memo-stats");
+    LASSERT_TYPE(a, a->cell[0], LVAL_FUN, 0, "memo-stats");
+    LASSERT(a, ! a->cell[0]->builtin_fun && a->cell[0]->applied &&
+            ! a->cell[0]->args,
+            "Function 'memo-stats' passed a function that is not memoized.");
+    m = a->cell[0]->memo;
+    r = lval_qexpr();
+    lval_add(r, lval_num(m->hits));
+    lval_add(r, lval_num(m->misses));
+    lval_add(r, lval_num(m->count));
+    lval_add(r, lval_num(m->capacity));
+    lval_del(a);
+    return r;
+}
+
+/*************** Maps. ****************************************/
+
+/* Getting a key follows its hash down at most 7 levels of lhamt nodes.
+ * Maps are never modified: putting or deleting a key copies the nodes on
+ * its path only, the rest is shared with the old map. Nodes are kept
+ * canonical (a sub-node always has more than one key), so maps with the
+ * same keys have the same shape.
+ */
+
+/* Number of bits set in x. */
+int hamt_popcount(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f;
+    return (x * 0x01010101) >> 24;
+}
+
+/* The 32 bits of hash used for key k. */
+uint32_t hamt_hash(lval *k)
+{
+    unsigned long h = lval_hash(k);
+    return (uint32_t) (h ^ (h >> 16 >> 16));
+}
+
+/* Number of key-value pairs in the node n. */
+int hamt_npairs(lhamt *n)
+{
+    return n->ncoll ? n->ncoll : hamt_popcount(n->datamap);
+}
+
+/* A new node, with room for the pairs and sub-nodes of the maps given (or
+ * ncoll pairs for a collision node). The caller fills them. */
+lhamt *hamt_new(uint32_t datamap, uint32_t nodemap, int ncoll)
+{
+    int npairs = ncoll ? ncoll : hamt_popcount(datamap);
+    int nnodes = hamt_popcount(nodemap);
+    size_t size = sizeof(lhamt) + sizeof(void *) * (2 * npairs + nnodes);
+    lhamt *n = malloc(size);
+    stats_alloc(size);
+    n->refs = 1;
+    n->mark = 0;
+    n->datamap = datamap;
+    n->nodemap = nodemap;
+    n->ncoll = ncoll;
+    n->kv = (lval **) (n + 1);
+    n->nodes = (lhamt **) (n->kv + 2 * npairs);
+    return n;
+}
+
+/* Drop a reference to the node n (which may be NULL). */
+void hamt_unref(lhamt *n)
+{
+    int i;
+    if (! n || refs_dec(&n->refs) > 0) {
+        return;
+    }
+    for (i = 0; i < 2 * hamt_npairs(n); i++) {
+        lval_del(n->kv[i]);
+    }
+    for (i = 0; i < hamt_popcount(n->nodemap); i++) {
+        hamt_unref(n->nodes[i]);
+    }
+    stats_free(sizeof(lhamt) + sizeof(void *) *
+               (2 * hamt_npairs(n) + hamt_popcount(n->nodemap)));
+    free(n);
+}
+
+/* A copy of n with the maps given, leaving out pair "skip" and sub-node
+ * "skipnode" (or none, if -1) and inserting a free slot for pair "pair"
+ * and sub-node "node" (or none, if -1) instead. The other pairs and
+ * sub-nodes are shared. */
+lhamt *hamt_copy(lhamt *n, uint32_t datamap, uint32_t nodemap, int ncoll,
+                 int skip, int pair, int skipnode, int node)
+{
+    int i, j;
+    lhamt *x = hamt_new(datamap, nodemap, ncoll);
+    for (i = 0, j = 0; i < hamt_npairs(n); i++) {
+        if (j == pair) {
+            j++;
+        }
+        if (i != skip) {
+            x->kv[2 * j] = lval_copy(n->kv[2 * i]);
+            x->kv[2 * j + 1] = lval_copy(n->kv[2 * i + 1]);
+            j++;
+        }
+    }
+    for (i = 0, j = 0; i < hamt_popcount(n->nodemap); i++) {
+        if (j == node) {
+            j++;
+        }
+        if (i != skipnode) {
+            x->nodes[j] = n->nodes[i];
+            refs_inc(&x->nodes[j]->refs);
+            j++;
+        }
+    }
+    return x;
+}
+
+/* The value of key k (with hash h) under node n, at the level using the
+ * bits of h from shift, or NULL. */
+lval *hamt_get(lhamt *n, lval *k, uint32_t h, int shift)
+{
+    int i;
+    uint32_t bit;
+    while (n) {
+        if (n->ncoll) {
+            for (i = 0; i < n->ncoll; i++) {
+                if (lval_eq(n->kv[2 * i], k)) {
+                    return n->kv[2 * i + 1];
+                }
+            }
+            return NULL;
+        }
+        bit = 1u << ((h >> shift) & 31);
+        if (n->datamap & bit) {
+            i = hamt_popcount(n->datamap & (bit - 1));
+            return lval_eq(n->kv[2 * i], k) ? n->kv[2 * i + 1] : NULL;
+        }
+        if (! (n->nodemap & bit)) {
+            return NULL;
+        }
+        n = n->nodes[hamt_popcount(n->nodemap & (bit - 1))];
+        shift += 5;
+    }
+    return NULL;
+}
+
+/* A node with the two pairs k1 v1 and k2 v2 (with hashes h1 and h2), at
+ * the level using the bits from shift. */
+lhamt *hamt_pair(lval *k1, lval *v1, uint32_t h1, lval *k2, lval *v2,
+                 uint32_t h2, int shift)
+{
+    lhamt *n;
+    uint32_t b1, b2;
+    if (shift >= 32) {
+        n = hamt_new(0, 0, 2);
+    } else {
+        b1 = 1u << ((h1 >> shift) & 31);
+        b2 = 1u << ((h2 >> shift) & 31);
+        if (b1 == b2) {
+            n = hamt_new(0, b1, 0);
+            n->nodes[0] = hamt_pair(k1, v1, h1, k2, v2, h2, shift + 5);
+            return n;
+        }
+        n = hamt_new(b1 | b2, 0, 0);
+        if (b2 < b1) {
+            lval *t = k1;
+            k1 = k2;
+            k2 = t;
+            t = v1;
+            v1 = v2;
+            v2 = t;
+        }
+    }
+    n->kv[0] = lval_copy(k1);
+    n->kv[1] = lval_copy(v1);
+    n->kv[2] = lval_copy(k2);
+    n->kv[3] = lval_copy(v2);
+    return n;
+}
+
+/* A new node: n (which may be NULL) with key k (with hash h) bound to v.
+ * *added is set if k was not there already. */
+lhamt *hamt_put(lhamt *n, lval *k, lval *v, uint32_t h, int shift, int *added)
+{
+    int i, j;
+    uint32_t bit;
+    lhamt *x;
+
+    *added = 0;
+    if (! n) {
+        *added = 1;
+        x = shift >= 32 ? hamt_new(0, 0, 1) : hamt_new(1u << ((h >> shift) & 31), 0, 0);
+        x->kv[0] = lval_copy(k);
+        x->kv[1] = lval_copy(v);
+        return x;
+    }
+    if (n->ncoll) {
+        for (i = 0; i < n->ncoll && ! lval_eq(n->kv[2 * i], k); i++) {
+        }
+        if (i < n->ncoll) {
+            x = hamt_copy(n, 0, 0, n->ncoll, i, i, -1, -1);
+        } else {
+            *added = 1;
+            x = hamt_copy(n, 0, 0, n->ncoll + 1, -1, i, -1, -1);
+        }
+        x->kv[2 * i] = lval_copy(k);
+        x->kv[2 * i + 1] = lval_copy(v);
+        return x;
+    }
+
+    bit = 1u << ((h >> shift) & 31);
+    if (n->datamap & bit) {
+        i = hamt_popcount(n->datamap & (bit - 1));
+        if (lval_eq(n->kv[2 * i], k)) {
+            /* Same key: replace the value. */
+            x = hamt_copy(n, n->datamap, n->nodemap, 0, i, i, -1, -1);
+            x->kv[2 * i] = lval_copy(k);
+            x->kv[2 * i + 1] = lval_copy(v);
+            return x;
+        }
+        /* Another key with the same bits here: both go to a sub-node. */
+        *added = 1;
+        j = hamt_popcount(n->nodemap & (bit - 1));
+        x = hamt_copy(n, n->datamap & ~bit, n->nodemap | bit, 0, i, -1, -1, j);
+        x->nodes[j] = hamt_pair(n->kv[2 * i], n->kv[2 * i + 1],
+                                hamt_hash(n->kv[2 * i]), k, v, h, shift + 5);
+        return x;
+    }
+    if (n->nodemap & bit) {
+        i = hamt_popcount(n->nodemap & (bit - 1));
+        x = hamt_copy(n, n->datamap, n->nodemap, 0, -1, -1, i, i);
+        x->nodes[i] = hamt_put(n->nodes[i], k, v, h, shift + 5, added);
+        return x;
+    }
+    *added = 1;
+    i = hamt_popcount(n->datamap & (bit - 1));
+    x = hamt_copy(n, n->datamap | bit, n->nodemap, 0, -1, i, -1, -1);
+    x->kv[2 * i] = lval_copy(k);
+    x->kv[2 * i + 1] = lval_copy(v);
+    return x;
+}
+
+/* A new reference to node n without key k (with hash h), or NULL if
+ * nothing is left. *removed is set if k was there. */
+lhamt *hamt_del(lhamt *n, lval *k, uint32_t h, int shift, int *removed)
+{
+    int i, j;
+    uint32_t bit;
+    lhamt *x, *sub;
+
+    *removed = 0;
+    if (n->ncoll) {
+        for (i = 0; i < n->ncoll && ! lval_eq(n->kv[2 * i], k); i++) {
+        }
+        if (i == n->ncoll) {
+            refs_inc(&n->refs);
+            return n;
+        }
+        *removed = 1;
+        return n->ncoll == 1 ? NULL : hamt_copy(n, 0, 0, n->ncoll - 1, i, -1, -1, -1);
+    }
+
+    bit = 1u << ((h >> shift) & 31);
+    if ((n->datamap & bit) &&
+        lval_eq(n->kv[2 * (i = hamt_popcount(n->datamap & (bit - 1)))], k)) {
+        *removed = 1;
+        if (n->datamap == bit && ! n->nodemap) {
+            return NULL;
+        }
+        return hamt_copy(n, n->datamap & ~bit, n->nodemap, 0, i, -1, -1, -1);
+    }
+    if (! (n->nodemap & bit)) {
+        refs_inc(&n->refs);
+        return n;
+    }
+
+    j = hamt_popcount(n->nodemap & (bit - 1));
+    sub = hamt_del(n->nodes[j], k, h, shift + 5, removed);
+    if (! *removed) {
+        hamt_unref(sub);
+        refs_inc(&n->refs);
+        return n;
+    }
+    if (sub && (sub->nodemap || hamt_npairs(sub) > 1)) {
+        x = hamt_copy(n, n->datamap, n->nodemap, 0, -1, -1, j, j);
+        x->nodes[j] = sub;
+        return x;
+    }
+    if (! sub && ! n->datamap && n->nodemap == bit) {
+        return NULL;
+    }
+    /* A sub-node left with a single pair (or none) is merged into n. */
+    i = hamt_popcount(n->datamap & (bit - 1));
+    x = hamt_copy(n, n->datamap | (sub ? bit : 0), n->nodemap & ~bit, 0,
+                  -1, sub ? i : -1, j, -1);
+    if (sub) {
+        x->kv[2 * i] = lval_copy(sub->kv[0]);
+        x->kv[2 * i + 1] = lval_copy(sub->kv[1]);
+        hamt_unref(sub);
+    }
+    return x;
+}
+
+/* Call fn(k, v, ctx) for each pair under node n, in the order of the
+ * hashes. Stops (returning 0) when fn returns 0. */
+int hamt_each(lhamt *n, int (*fn)(lval *, lval *, void *), void *ctx)
+{
+    int i;
+    if (! n) {
+        return 1;
+    }
+    for (i = 0; i < hamt_npairs(n); i++) {
+        if (! fn(n->kv[2 * i], n->kv[2 * i + 1], ctx)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < hamt_popcount(n->nodemap); i++) {
+        if (! hamt_each(n->nodes[i], fn, ctx)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* An empty map. */
+lval *lval_map(void)
+{
+    lval *v = lval_new(LVAL_MAP);
+    v->nkeys = 0;
+    v->root = NULL;
+    return v;
+}
+
+/* A new map: m with k bound to v. */
+lval *lval_map_put(lval *m, lval *k, lval *v)
+{
+    int added;
+    lval *x = lval_map();
+    x->root = hamt_put(m->root, k, v, hamt_hash(k), 0, &added);
+    x->nkeys = m->nkeys + added;
+    return x;
+}
+
+/* A new map: m without k. */
+lval *lval_map_del(lval *m, lval *k)
+{
+    int removed;
+    lval *x = lval_map();
+    x->root = m->root ? hamt_del(m->root, k, hamt_hash(k), 0, &removed) : NULL;
+    x->nkeys = m->nkeys - (m->root && removed);
+    return x;
+}
+
+/* The value of k in m (not copied), or NULL. */
+lval *lval_map_get(lval *m, lval *k)
+{
+    return hamt_get(m->root, k, hamt_hash(k), 0);
+}
+
+int lval_map_eq_pair(lval *k, lval *v, void *b)
+{
+    lval *w = lval_map_get(b, k);
+    return w && lval_eq(v, w);
+}
+
+/* Maps are equal if they have equal keys, bound to equal values. */
+int lval_map_eq(lval *a, lval *b)
+{
+    return a->nkeys == b->nkeys && hamt_each(a->root, lval_map_eq_pair, b);
+}
+
+int lval_map_hash_pair(lval *k, lval *v, void *h)
+{
+    /* Added up, as the order of the pairs does not matter to lval_eq. */
+    *(unsigned long *) h += hash_mix(lval_hash(k), lval_hash(v));
+    return 1;
+}
+
+unsigned long lval_map_hash(lval *v)
+{
+    unsigned long h = 0;
+    hamt_each(v->root, lval_map_hash_pair, &h);
+    return h;
+}
+
+/* Where lval_map_print is, for lval_map_print_pair. */
+struct map_printer {
+    FILE *f;
+    int first;
+};
+
+int lval_map_print_pair(lval *k, lval *v, void *ctx)
+{
+    struct map_printer *p = ctx;
+    if (! p->first) {
+        fputc(' ', p->f);
+    }
+    p->first = 0;
+    lval_print(p->f, k);
+    fputc(' ', p->f);
+    lval_print(p->f, v);
+    return 1;
+}
+
+/* Print a map as #{key value key value...}. */
+void lval_map_print(FILE *f, lval *v)
+{
+    struct map_printer p = { f, 1 };
+    fputs("#{", f);
+    hamt_each(v->root, lval_map_print_pair, &p);
+    fputc('}', f);
+}
+
+int lval_map_add_key(lval *k, lval *v, void *keys)
+{
+    lval_add(keys, lval_copy(k));
+    return 1;
+}
+
+/* (map-new k v k v...) or (map-new {k v k v...}): a map of the keys given,
+ * each bound to the value that follows it. */
+lval *builtin_map_new(lenv *e, lval *a)
+{
+    int i;
+    lval *m, *x, *l = a;
+    if (a->count == 1 && LTYPE(a->cell[0]) == LVAL_QEXPR) {
+        l = a->cell[0];
+    }
+    LASSERT(a, l->count % 2 == 0,
+            "Function 'map-new' passed a key without a value.");
+    m = lval_map();
+    for (i = 0; i < l->count; i += 2) {
+        x = lval_map_put(m, l->cell[i], l->cell[i + 1]);
+        lval_del(m);
+        m = x;
+    }
+    lval_del(a);
+    return m;
+}
+
+/* (map-get m k): the value of k in m, or (map-get m k default). */
+lval *builtin_map_get(lenv *e, lval *a)
+{
+    lval *v;
+    LASSERT_NARGS_RANGE(a, a->count, 2, 3, "map-get");
+    LASSERT_TYPE(a, a->cell[0], LVAL_MAP, 0, "map-get");
+    v = lval_map_get(a->cell[0], a->cell[1]);
+    if (v) {
+        v = lval_copy(v);
+    } else if (a->count == 3) {
+        v = lval_pop(a, 2);
+    } else {
+        v = lval_err("Function 'map-get' passed a key not in the map.");
+    }
+    lval_del(a);
+    return v;
+}
+
+/* (map-put m k v k v...): m with the keys bound to the values. */
+lval *builtin_map_put(lenv *e, lval *a)
+{
+    int i;
+    lval *m, *x;
+    LASSERT(a, a->count >= 3 && a->count % 2 == 1,
+            "Function 'map-put' passed %d arguments. Expected a map, then "
+            "keys each followed by a value.", a->count);
+    LASSERT_TYPE(a, a->cell[0], LVAL_MAP, 0, "map-put");
+    m = lval_copy(a->cell[0]);
+    for (i = 1; i < a->count; i += 2) {
+        x = lval_map_put(m, a->cell[i], a->cell[i + 1]);
+        lval_del(m);
+        m = x;
+    }
+    lval_del(a);
+    return m;
+}
+
+/* (map-del m k k...): m without the keys. */
+lval *builtin_map_del(lenv *e, lval *a)
+{
+    int i;
+    lval *m, *x;
+    LASSERT(a, a->count >= 2,
+            "Function 'map-del' passed too few arguments. Expected at least 2, "
+            "but got %d.", a->count);
+    LASSERT_TYPE(a, a->cell[0], LVAL_MAP, 0, "map-del");
+    m = lval_copy(a->cell[0]);
+    for (i = 1; i < a->count; i++) {
+        x = lval_map_del(m, a->cell[i]);
+        lval_del(m);
+        m = x;
+    }
+    lval_del(a);
+    return m;
+}
+
+/* (map-keys m): the keys of m, in a Q-Expression. */
+lval *builtin_map_keys(lenv *e, lval *a)
+{
+    lval *keys;
+    LASSERT_NARGS(a, a->count, 1, "map-keys");
+    LASSERT_TYPE(a, a->cell[0], LVAL_MAP, 0, "map-keys");
+    keys = lval_qexpr();
+    lval_reserve(keys, a->cell[0]->nkeys);
+    hamt_each(a->cell[0]->root, lval_map_add_key, keys);
+    lval_del(a);
+    return keys;
+}
+
+/* (map-count m): the number of keys of m. */
+lval *builtin_map_count(lenv *e, lval *a)
+{
+    long n;
+    LASSERT_NARGS(a, a->count, 1, "map-count");
+    LASSERT_TYPE(a, a->cell[0], LVAL_MAP, 0, "map-count");
+    n = a->cell[0]->nkeys;
+    lval_del(a);
+    return lval_num(n);
+}
+
+/*************** Strings. *************************************/
+
+/* Long strings are ropes: concatenating two strings, or taking a substring
+ * of one, makes a new node pointing to them instead of copying their
+ * chars. The chars are put together (the rope "flattened") only when the
+ * text is needed as a C string, by lval_str_flat; printing a rope, or
+ * writing it to an image, walks its pieces instead. Strings shorter than
+ * ROPE_LEAF are always flat, and ropes deeper than ROPE_MAX_DEPTH are
+ * rebalanced, so walking them stays cheap however they were built.
+ */
+#ifndef ROPE_LEAF
+#define ROPE_LEAF 256
+#endif
+#define ROPE_MAX_DEPTH 45
+
+/* rope_min_len[d]: a rope of depth d is balanced if it has at least that
+ * many chars (Fibonacci numbers, as in Boehm et al's "Ropes: an
+ * Alternative to Strings"). */
+long rope_min_len[ROPE_MAX_DEPTH + 2];
+
+/* Fill in rope_min_len, the first time (par_start does it before threads
+ * run). */
+void rope_init(void)
+{
+    int i;
+    if (! rope_min_len[0]) {
+        rope_min_len[0] = 1;
+        rope_min_len[1] = 2;
+        for (i = 2; i < ROPE_MAX_DEPTH + 2; i++) {
+            rope_min_len[i] = rope_min_len[i - 1] + rope_min_len[i - 2];
+        }
+    }
+}
+
+/* Whether the String v is stored inline. Another thread may be
+ * flattening v meanwhile (see lval_str_flat), which doesn't change that. */
+int lval_str_inline(lval *v)
+{
+    return __atomic_load_n(&v->str, __ATOMIC_RELAXED) == v->text;
+}
+
+/* Number of chars of the String v. */
+long lval_str_len(lval *v)
+{
+    return lval_str_inline(v) ? (long) strlen(v->text) : v->rope_len;
+}
+
+int rope_depth(lval *v)
+{
+    return lval_str_inline(v) ? 0 : v->rope_depth;
+}
+
+/* Call fn(s, n, ctx) for each piece of the String v, in order. */
+void rope_each(lval *v, void (*fn)(const char *, long, void *), void *ctx)
+{
+    while (! v->str && v->rope_right) {
+        rope_each(v->rope_left, fn, ctx);
+        v = v->rope_right;
+    }
+    if (v->str) {
+        fn(v->str, lval_str_len(v), ctx);
+    } else {
+        fn(v->rope_left->str + v->rope_start, v->rope_len, ctx);
+    }
+}
+
+/* Copy the len chars of the String v from start to t. */
+void rope_copy_range(lval *v, long start, long len, char *t)
+{
+    long ll;
+    while (! v->str) {
+        if (! v->rope_right) {
+            start += v->rope_start;
+            v = v->rope_left;
+        } else if (start + len <= (ll = lval_str_len(v->rope_left))) {
+            v = v->rope_left;
+        } else if (start >= ll) {
+            start -= ll;
+            v = v->rope_right;
+        } else {
+            rope_copy_range(v->rope_left, start, ll - start, t);
+            t += ll - start;
+            len -= ll - start;
+            start = 0;
+            v = v->rope_right;
+        }
+    }
+    memcpy(t, v->str + start, len);
+}
+
+/* The text of the String v, flattening it first if it's a rope. While
+ * threads run, another one may be reading the rope: the text is published
+ * once it's complete, and the pieces are kept until v is freed. */
+char *lval_str_flat(lval *v)
+{
+    char *s = __atomic_load_n(&v->str, __ATOMIC_ACQUIRE);
+    if (s) {
+        return s;
+    }
+    if (PAR_ACTIVE()) {
+        pthread_mutex_lock(&par_lock);
+        if (! v->str) {
+            s = malloc(v->rope_len + 1);
+            stats_alloc(v->rope_len + 1);
+            rope_copy_range(v, 0, v->rope_len, s);
+            s[v->rope_len] = '\0';
+            __atomic_store_n(&v->str, s, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&par_lock);
+        return v->str;
+    }
+    s = malloc(v->rope_len + 1);
+    stats_alloc(v->rope_len + 1);
+    rope_copy_range(v, 0, v->rope_len, s);
+    s[v->rope_len] = '\0';
+    /* The same string, so this is fine even if v is shared. */
+    lval_del(v->rope_left);
+    if (v->rope_right) {
+        lval_del(v->rope_right);
+    }
+    v->rope_left = NULL;
+    v->rope_right = NULL;
+    v->rope_depth = 0;
+    v->str = s;
+    return s;
+}
+
+/* A new flat String of the len chars of v from start. */
+lval *lval_str_copy(lval *v, long start, long len)
+{
+    lval *x = lval_new(LVAL_STR);
+    char *t = lval_text_alloc(x, len);
+    rope_copy_range(v, start, len, t);
+    t[len] = '\0';
+    return x;
+}
+
+/* A rope node for a followed by b (either may be NULL), taking over the
+ * references. */
+lval *rope_node(lval *a, lval *b)
+{
+    lval *x;
+    if (! a || ! b) {
+        return a ? a : b;
+    }
+    x = lval_new(LVAL_STR);
+    x->str = NULL;
+    x->rope_len = lval_str_len(a) + lval_str_len(b);
+    x->rope_left = a;
+    x->rope_right = b;
+    x->rope_start = 0;
+    x->rope_depth = 1 + max(rope_depth(a), rope_depth(b));
+    return x;
+}
+
+/* Add the rope v (a reference) to the forest used by rope_balance: slot i
+ * holds a balanced rope of at least rope_min_len[i] chars, and the ropes
+ * in the slots, taken from the last one to the first, are the text so
+ * far. */
+void rope_add_leaf(lval *v, lval **forest)
+{
+    int i;
+    lval *tiny = NULL;
+    long len = lval_str_len(v);
+
+    for (i = 0; i < ROPE_MAX_DEPTH && len >= rope_min_len[i + 1]; i++) {
+        if (forest[i]) {
+            tiny = rope_node(forest[i], tiny);
+            forest[i] = NULL;
+        }
+    }
+    v = rope_node(tiny, v);
+    for (;; i++) {
+        if (forest[i]) {
+            v = rope_node(forest[i], v);
+            forest[i] = NULL;
+        }
+        if (i == ROPE_MAX_DEPTH || lval_str_len(v) < rope_min_len[i + 1]) {
+            forest[i] = v;
+            return;
+        }
+    }
+}
+
+/* Add the pieces of v to the forest, keeping balanced sub-ropes whole. */
+void rope_add(lval *v, lval **forest)
+{
+    if (v->str || ! v->rope_right ||
+        (v->rope_depth <= ROPE_MAX_DEPTH &&
+         v->rope_len >= rope_min_len[v->rope_depth])) {
+        rope_add_leaf(lval_copy(v), forest);
+        return;
+    }
+    rope_add(v->rope_left, forest);
+    rope_add(v->rope_right, forest);
+}
+
+/* A balanced rope with the text of v, which it takes over. */
+lval *rope_balance(lval *v)
+{
+    int i;
+    lval *forest[ROPE_MAX_DEPTH + 1] = { NULL }, *x = NULL;
+
+    rope_init();
+    rope_add(v, forest);
+    lval_del(v);
+    for (i = 0; i <= ROPE_MAX_DEPTH; i++) {
+        if (forest[i]) {
+            x = rope_node(forest[i], x);
+        }
+    }
+    return x;
+}
+
+/* The String a followed by b, taking over both. Short results are copied,
+ * and so is a short b into the last piece of a, if that is short too;
+ * else the result is a rope node sharing a and b. */
+lval *lval_str_concat(lval *a, lval *b)
+{
+    lval *x;
+    long la = lval_str_len(a), lb = lval_str_len(b);
+
+    if (la == 0 || lb == 0) {
+        x = la == 0 ? b : a;
+        lval_del(la == 0 ? a : b);
+        return x;
+    }
+    if (la + lb < ROPE_LEAF) {
+        char *t;
+        x = lval_new(LVAL_STR);
+        t = lval_text_alloc(x, la + lb);
+        rope_copy_range(a, 0, la, t);
+        rope_copy_range(b, 0, lb, t + la);
+        t[la + lb] = '\0';
+        lval_del(a);
+        lval_del(b);
+        return x;
+    }
+    if (! a->str && a->rope_right && lval_str_len(a->rope_right) + lb < ROPE_LEAF) {
+        x = rope_node(lval_copy(a->rope_left),
+                      lval_str_concat(lval_copy(a->rope_right), b));
+        lval_del(a);
+        return x;
+    }
+    x = rope_node(a, b);
+    return x->rope_depth > ROPE_MAX_DEPTH ? rope_balance(x) : x;
+}
+
+/* The len chars of the String v from start (which must be in range),
+ * taking over v. Short results are copied, else the result shares the
+ * chars of v. */
+lval *lval_str_sub(lval *v, long start, long len)
+{
+    lval *x;
+    long ll;
+
+    if (start == 0 && len == lval_str_len(v)) {
+        return v;
+    }
+    if (len < ROPE_LEAF) {
+        x = lval_str_copy(v, start, len);
+    } else if (v->str) {
+        x = lval_new(LVAL_STR);
+        x->str = NULL;
+        x->rope_len = len;
+        x->rope_left = lval_copy(v);
+        x->rope_right = NULL;
+        x->rope_start = start;
+        x->rope_depth = 1;
+    } else if (! v->rope_right) {
+        x = lval_str_sub(lval_copy(v->rope_left), v->rope_start + start, len);
+    } else if (start + len <= (ll = lval_str_len(v->rope_left))) {
+        x = lval_str_sub(lval_copy(v->rope_left), start, len);
+    } else if (start >= ll) {
+        x = lval_str_sub(lval_copy(v->rope_right), start - ll, len);
+    } else {
+        x = lval_str_concat(lval_str_sub(lval_copy(v->rope_left), start, ll - start),
+                            lval_str_sub(lval_copy(v->rope_right), 0,
+                                         len - (ll - start)));
+    }
+    lval_del(v);
+    return x;
+}
+
+/* (str-concat s s...): the strings one after the other. */
+lval *builtin_str_concat(lenv *e, lval *a)
+{
+    lval *x;
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE(a, a->cell[i], LVAL_STR, i, "str-concat");
+    }
+    LASSERT(a, a->count,
+            "Function 'str-concat' passed too few arguments. Expected at "
+            "least 1, but got 0.");
+    x = lval_pop(a, 0);
+    while (a->count) {
+        x = lval_str_concat(x, lval_pop(a, 0));
+    }
+    lval_del(a);
+    return x;
+}
+
+/* (str-join {s s...} sep): the strings of the list, with sep (or nothing)
+ * between them. */
+lval *builtin_str_join(lenv *e, lval *a)
+{
+    lval *l, *x;
+    int i;
+    LASSERT_NARGS_RANGE(a, a->count, 1, 2, "str-join");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "str-join");
+    if (a->count == 2) {
+        LASSERT_TYPE(a, a->cell[1], LVAL_STR, 1, "str-join");
+    }
+    l = a->cell[0];
+    for (i = 0; i < l->count; i++) {
+        LASSERT(a, LTYPE(l->cell[i]) == LVAL_STR,
+                "Function 'str-join' passed incorrect type for element %d. "
+                "Expected %s, but got %s.", i, ltype_name(LVAL_STR),
+                ltype_name(LTYPE(l->cell[i])));
+    }
+    x = lval_str("");
+    for (i = 0; i < l->count; i++) {
+        if (i > 0 && a->count == 2) {
+            x = lval_str_concat(x, lval_copy(a->cell[1]));
+        }
+        x = lval_str_concat(x, lval_copy(l->cell[i]));
+    }
+    lval_del(a);
+    return x;
+}
+
+/* (substr s start len): the len chars of s from start, or all of them
+ * to the end without len. */
+lval *builtin_substr(lenv *e, lval *a)
+{
+    long start, len, n;
+    LASSERT_NARGS_RANGE(a, a->count, 2, 3, "substr");
+    LASSERT_TYPE(a, a->cell[0], LVAL_STR, 0, "substr");
+    LASSERT_TYPE(a, a->cell[1], LVAL_NUM, 1, "substr");
+    n = lval_str_len(a->cell[0]);
+    start = LNUM(a->cell[1]);
+    LASSERT(a, start >= 0 && start <= n,
+            "Function 'substr' passed start %li, out of the string (of %li "
+            "chars).", start, n);
+    len = n - start;
+    if (a->count == 3) {
+        LASSERT_TYPE(a, a->cell[2], LVAL_NUM, 2, "substr");
+        len = LNUM(a->cell[2]);
+        LASSERT(a, len >= 0 && len <= n - start,
+                "Function 'substr' passed length %li, out of the string (of "
+                "%li chars from %li).", len, n - start, start);
+    }
+    return lval_str_sub(lval_take(a, 0), start, len);
+}
+
+/* (str-len s): the number of chars of s. */
+lval *builtin_str_len(lenv *e, lval *a)
+{
+    long n;
+    LASSERT_NARGS(a, a->count, 1, "str-len");
+    LASSERT_TYPE(a, a->cell[0], LVAL_STR, 0, "str-len");
+    n = lval_str_len(a->cell[0]);
+    lval_del(a);
+    return lval_num(n);
+}
+
+/* (str-find s t start): the first position of t in s from start (or 0),
+ * or -1. */
+lval *builtin_str_find(lenv *e, lval *a)
+{
+    long start = 0, n;
+    char *s, *t, *p;
+    LASSERT_NARGS_RANGE(a, a->count, 2, 3, "str-find");
+    LASSERT_TYPE(a, a->cell[0], LVAL_STR, 0, "str-find");
+    LASSERT_TYPE(a, a->cell[1], LVAL_STR, 1, "str-find");
+    n = lval_str_len(a->cell[0]);
+    if (a->count == 3) {
+        LASSERT_TYPE(a, a->cell[2], LVAL_NUM, 2, "str-find");
+        start = LNUM(a->cell[2]);
+        LASSERT(a, start >= 0 && start <= n,
+                "Function 'str-find' passed start %li, out of the string (of "
+                "%li chars).", start, n);
+    }
+    s = lval_str_flat(a->cell[0]);
+    t = lval_str_flat(a->cell[1]);
+    p = strstr(s + start, t);
+    lval_del(a);
+    return lval_num(p ? p - s : -1);
+}
+
+/*************** Parallel evaluation. *************************/
+
+/* Work is shared by a pool of threads: the workers, started on first use
+ * (one per processor but the calling thread, or --threads=N in all), and
+ * any thread waiting for work to finish, which runs tasks meanwhile. Each
+ * thread has a deque of tasks: it pushes and takes its own at the bottom,
+ * and when it has none left steals the oldest task of another thread,
+ * which in divide and conquer code is the largest piece of work. A thread
+ * only sleeps when there is nothing left to take.
+ * Each thread allocates from its own pools (see pool_alloc), and all of
+ * them share the values and the global environment read-only: def is an
+ * error in a task, and outside of one first waits for every task of the
+ * interpreter (see par_owner) to finish. With --gc, whose collector can't
+ * run alongside other threads, everything runs on the calling thread.
+ */
+
+struct par_task {
+    void (*run)(void *);
+    void *arg;
+    /* The par_owner it was pushed for, and the eval_max_depth. */
+    int *owner;
+    int max_depth;
+};
+
+/* The tasks of a thread, from the oldest (at top) to the newest (at
+ * bottom - 1). */
+struct par_deque {
+    pthread_mutex_t lock;
+    struct par_task *tasks;
+    int top;
+    int bottom;
+    int capacity;
+};
+
+struct par_pool {
+    pthread_mutex_t lock;
+    /* Broadcast when a task is pushed, and when one is finished. */
+    pthread_cond_t wake;
+    /* Threads (-1 until par_start), each with its deque. The first is the
+     * main thread's. */
+    int nthreads;
+    struct par_deque *deques;
+    /* Tasks pushed but not taken yet, and not finished yet. */
+    int queued;
+    int unfinished;
+    /* Counters of the workers, for the main thread (see stats_add). */
+    struct stats stats;
+};
+
+/* Number of threads (--threads), 0 for one per processor. */
+int par_threads = 0;
+struct par_pool par = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1
+};
+/* Index of the deque of this thread. */
+__thread int par_self = 0;
+/* The unfinished tasks of the interpreter this thread evaluates for (see
+ * caballa_eval_string), which is what par_wait_all waits for: tasks of
+ * other interpreters don't use its environment. */
+int par_unowned = 0;
+__thread int *par_owner = &par_unowned;
+
+/* Wake the threads waiting for work (see par_wait). */
+void par_wake(void)
+{
+    pthread_mutex_lock(&par.lock);
+    pthread_cond_broadcast(&par.wake);
+    pthread_mutex_unlock(&par.lock);
+}
+
+/* Push a task on the deque of this thread. */
+void par_push(void (*run)(void *), void *arg)
+{
+    struct par_deque *d = par.deques + par_self;
+
+    /* Under par.lock, so that par_settle doesn't miss the task. */
+    pthread_mutex_lock(&par.lock);
+    __atomic_add_fetch(&par.unfinished, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(par_owner, 1, __ATOMIC_RELAXED);
+    if (! PAR_ACTIVE()) {
+        __atomic_store_n(&par_active, 1, __ATOMIC_RELAXED);
+    }
+    refs_slow = 1;
+    pthread_mutex_unlock(&par.lock);
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->capacity) {
+        if (d->top > 0 && d->top >= d->capacity / 2) {
+            memmove(d->tasks, d->tasks + d->top,
+                    sizeof(struct par_task) * (d->bottom - d->top));
+            d->bottom -= d->top;
+            d->top = 0;
+        } else {
+            d->capacity = d->capacity ? 2 * d->capacity : 64;
+            d->tasks = realloc(d->tasks, sizeof(struct par_task) * d->capacity);
+        }
+    }
+    d->tasks[d->bottom].run = run;
+    d->tasks[d->bottom].arg = arg;
+    d->tasks[d->bottom].owner = par_owner;
+    d->tasks[d->bottom].max_depth = eval_max_depth;
+    d->bottom++;
+    pthread_mutex_unlock(&d->lock);
+    __atomic_add_fetch(&par.queued, 1, __ATOMIC_RELAXED);
+    par_wake();
+}
+
+/* Take a task: the newest of this thread, or else the oldest of another
+ * one. Returns 0 if there is none. */
+int par_take(struct par_task *t)
+{
+    struct par_deque *d;
+    int i, found = 0;
+
+    for (i = 0; i < par.nthreads && ! found; i++) {
+        d = par.deques + (par_self + i) % par.nthreads;
+        pthread_mutex_lock(&d->lock);
+        if (d->top < d->bottom) {
+            *t = i == 0 ? d->tasks[--d->bottom] : d->tasks[d->top++];
+            if (d->top == d->bottom) {
+                d->top = d->bottom = 0;
+            }
+            found = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    if (found) {
+        __atomic_sub_fetch(&par.queued, 1, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+/* Run a task taken by par_take. The counters of a worker are handed over
+ * before the task counts as finished (see par_settle). */
+void par_run_task(struct par_task *t)
+{
+    int outer = par_running, slow = refs_slow, *owner = par_owner;
+    int max_depth = eval_max_depth;
+
+    /* Tasks it pushes are its interpreter's too. */
+    par_running = 1;
+    refs_slow = 1;
+    par_owner = t->owner;
+    eval_max_depth = t->max_depth;
+    t->run(t->arg);
+    par_running = outer;
+    refs_slow = slow;
+    par_owner = owner;
+    eval_max_depth = max_depth;
+    if (par_self != 0) {
+        pthread_mutex_lock(&par.lock);
+        stats_add(&par.stats, &stats);
+        memset(&stats, 0, sizeof(stats));
+        pthread_mutex_unlock(&par.lock);
+    }
+    __atomic_sub_fetch(&par.unfinished, 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(t->owner, 1, __ATOMIC_RELEASE);
+    par_wake();
+}
+
+/* Run tasks until *count (of unfinished work) is down to 0. */
+void par_wait(int *count)
+{
+    struct par_task t;
+
+    while (__atomic_load_n(count, __ATOMIC_ACQUIRE) > 0) {
+        if (par_take(&t)) {
+            par_run_task(&t);
+            continue;
+        }
+        pthread_mutex_lock(&par.lock);
+        while (__atomic_load_n(count, __ATOMIC_ACQUIRE) > 0 &&
+               __atomic_load_n(&par.queued, __ATOMIC_RELAXED) <= 0) {
+            pthread_cond_wait(&par.wake, &par.lock);
+        }
+        pthread_mutex_unlock(&par.lock);
+    }
+}
+
+void *par_worker(void *arg)
+{
+    struct par_task t;
+
+    par_self = (int) (intptr_t) arg;
+    for (;;) {
+        if (par_take(&t)) {
+            par_run_task(&t);
+            continue;
+        }
+        pthread_mutex_lock(&par.lock);
+        while (__atomic_load_n(&par.queued, __ATOMIC_RELAXED) <= 0) {
+            pthread_cond_wait(&par.wake, &par.lock);
+        }
+        pthread_mutex_unlock(&par.lock);
+    }
+    return NULL;
+}
+
+/* Stack size of the threads started here and by the server: evaluation
+ * recurses on the C stack (see eval_max_depth). */
+#ifndef THREAD_STACK
+#define THREAD_STACK (64L * 1024 * 1024)
+#endif
+
+/* Run fn(arg) on a new detached thread with a THREAD_STACK stack. Returns
+ * 0, or an error number. */
+int thread_start(void *(*fn)(void *), void *arg)
+{
+    pthread_t t;
+    pthread_attr_t attr;
+    int err;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&t, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+/* Start the workers, the first time. */
+void par_start(void)
+{
+    int i, n = par_threads;
+
+    if (__atomic_load_n(&par.nthreads, __ATOMIC_ACQUIRE) >= 0) {
+        return;
+    }
+    /* Other interpreters may be starting them too. */
+    pthread_mutex_lock(&par.lock);
+    if (par.nthreads >= 0) {
+        pthread_mutex_unlock(&par.lock);
+        return;
+    }
+    if (n <= 0) {
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    n = max(n, 1);
+    par.deques = calloc(n, sizeof(struct par_deque));
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&par.deques[i].lock, NULL);
+    }
+    __atomic_store_n(&par.nthreads, n, __ATOMIC_RELEASE);
+    for (i = 1; i < n; i++) {
+        if (thread_start(par_worker, (void *) (intptr_t) i) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&par.lock);
+}
+
+/* Once every task of the interpreter is finished, this thread goes back
+ * to running alone; once every task is, so does the process. Only done
+ * outside of tasks, by the thread that pushed them (or with several
+ * interpreters, by any of theirs: the counters of the workers then go to
+ * that one). */
+void par_settle(void)
+{
+    if (par_running || __atomic_load_n(par_owner, __ATOMIC_ACQUIRE) > 0) {
+        return;
+    }
+    refs_slow = gc.enabled;
+    if (! PAR_ACTIVE() ||
+        __atomic_load_n(&par.unfinished, __ATOMIC_ACQUIRE) > 0) {
+        return;
+    }
+    pthread_mutex_lock(&par.lock);
+    if (__atomic_load_n(&par.unfinished, __ATOMIC_ACQUIRE) == 0) {
+        stats_add(&stats, &par.stats);
+        memset(&par.stats, 0, sizeof(par.stats));
+        __atomic_store_n(&par_active, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&par.lock);
+}
+
+/* Wait for every task of the interpreter to finish, unless in one. */
+void par_wait_all(void)
+{
+    if (PAR_ACTIVE() && ! par_running) {
+        par_wait(par_owner);
+        par_settle();
+    }
+}
+
+/* (pmap f {list}) and (preduce f init {list}) split the list into chunks
+ * (PAR_CHUNKS_PER_THREAD per thread), which the calling thread evaluates
+ * together with tasks pushed for the other threads. The results are put
+ * together in the order of the list, so as long as f has no side effects
+ * (and for preduce, is associative) they are the same as in a sequential
+ * run.
+ */
+#ifndef PAR_CHUNKS_PER_THREAD
+#define PAR_CHUNKS_PER_THREAD 4
+#endif
+
+struct par_job {
+    lenv *e;
+    lval *f;
+    /* preduce: the initial value; NULL for pmap. */
+    lval *init;
+    lval **items;
+    int count;
+    /* Items per chunk, and how many chunks. */
+    int chunk;
+    int nchunks;
+    /* pmap: the value of each item; preduce: of each chunk. */
+    lval **results;
+    /* Next chunk to take, and the first of results that is an error (or
+     * count for none), taken atomically. */
+    int next;
+    int failed;
+    /* Tasks pushed to help, not finished yet. */
+    int helpers;
+};
+
+/* Record that results[i] is an error, keeping the first one. */
+void par_fail(struct par_job *job, int i)
+{
+    int failed = __atomic_load_n(&job->failed, __ATOMIC_RELAXED);
+    while (i < failed &&
+           ! __atomic_compare_exchange_n(&job->failed, &failed, i, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* Call f with the arguments x and y (y may be NULL), taking them over.
+ * Assignments at the top level (with =) go to the frame e, not to the
+ * caller's environment, which other threads share. */
+lval *par_call(lenv *e, lval *f, lval *x, lval *y)
+{
+    lval *v = lval_add(lval_sexpr(), x);
+    if (y) {
+        v = lval_add(v, y);
+    }
+    /* As in lval_apply. */
+    gc_push(GC_LVAL, &v, NULL);
+    x = lval_call(e, f, v);
+    gc_pop(1);
+    return lval_untail(x);
+}
+
+/* Evaluate chunk k of the job. */
+void par_chunk(struct par_job *job, lenv *e, int k)
+{
+    int i = k * job->chunk, end = min(i + job->chunk, job->count);
+    lval *x;
+
+    if (! job->init) {
+        for (; i < end; i++) {
+            x = par_call(e, job->f, lval_copy(job->items[i]), NULL);
+            job->results[i] = x;
+            if (LTYPE(x) == LVAL_ERR) {
+                par_fail(job, i);
+                return;
+            }
+        }
+        return;
+    }
+    /* The first chunk starts from init, the others from their first
+     * item; the chunks are combined in order by builtin_preduce. */
+    x = lval_copy(k == 0 ? job->init : job->items[i++]);
+    for (; i < end && LTYPE(x) != LVAL_ERR; i++) {
+        x = par_call(e, job->f, x, lval_copy(job->items[i]));
+    }
+    job->results[k] = x;
+    if (LTYPE(x) == LVAL_ERR) {
+        par_fail(job, k);
+    }
+}
+
+/* Take chunks of the job until there are none left (or one failed
+ * before them). */
+void par_work(struct par_job *job)
+{
+    int k, outer = par_running;
+    lenv *e = lenv_new();
+
+    e->parent = job->e;
+    gc_push(GC_ENV, &e, NULL);
+    par_running = 1;
+    for (;;) {
+        k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (k >= job->nchunks ||
+            k * (job->init ? 1 : job->chunk) >
+            __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+            break;
+        }
+        par_chunk(job, e, k);
+    }
+    par_running = outer;
+    gc_pop(1);
+    lenv_del(e);
+}
+
+/* A task helping with a job (see par_run). */
+void par_job_help(void *arg)
+{
+    struct par_job *job = arg;
+    par_work(job);
+    __atomic_sub_fetch(&job->helpers, 1, __ATOMIC_RELEASE);
+}
+
+/* Run the job on the calling thread, with as many other threads helping
+ * as there are chunks for, and wait for them. With --gc (see above), the
+ * calling thread runs it alone. */
+void par_run(struct par_job *job)
+{
+    int i, n = gc.enabled ? 0 : min(par.nthreads, job->nchunks) - 1;
+
+    job->helpers = n;
+    for (i = 0; i < n; i++) {
+        par_push(par_job_help, job);
+    }
+    par_work(job);
+    par_wait(&job->helpers);
+    par_settle();
+}
+
+/* Set up a job of f over the items of the list l (see par_job). */
+void par_job_init(struct par_job *job, lenv *e, lval *f, lval *init, lval *l)
+{
+    int threads;
+
+    job->e = e;
+    job->f = f;
+    job->init = init;
+    job->items = l->cell;
+    job->count = l->count;
+    threads = gc.enabled ? 1 : par.nthreads;
+    job->chunk = max(1, (l->count + PAR_CHUNKS_PER_THREAD * threads - 1) /
+                     (PAR_CHUNKS_PER_THREAD * threads));
+    job->nchunks = (l->count + job->chunk - 1) / job->chunk;
+    job->next = 0;
+    job->failed = init ? job->nchunks : job->count;
+    job->results = calloc((init ? job->nchunks : job->count) + 1,
+                          sizeof(lval *));
+}
+
+/* Free the results of a job but the n given to the caller. */
+void par_job_free(struct par_job *job, int n)
+{
+    int i;
+    for (i = n; i < (job->init ? job->nchunks : job->count); i++) {
+        if (job->results[i]) {
+            lval_del(job->results[i]);
+        }
+    }
+    free(job->results);
+}
+
+/* (pmap f {list}): the list of (f x) for each x of the list, evaluated in
+ * parallel (see above). Returns the error of the first item that failed,
+ * if any. */
+lval *builtin_pmap(lenv *e, lval *a)
+{
+    struct par_job job;
+    lval *x, **end;
+    int i;
+
+    LASSERT_NARGS(a, a->count, 2, "pmap");
+    LASSERT_TYPE(a, a->cell[0], LVAL_FUN, 0, "pmap");
+    LASSERT_TYPE(a, a->cell[1], LVAL_QEXPR, 1, "pmap");
+
+    par_start();
+    par_job_init(&job, e, a->cell[0], NULL, a->cell[1]);
+    end = job.results + job.count;
+    gc_push(GC_STACK, job.results, &end);
+    par_run(&job);
+    gc_pop(1);
+    if (job.failed < job.count) {
+        x = job.results[job.failed];
+        job.results[job.failed] = NULL;
+        par_job_free(&job, 0);
+        lval_del(a);
+        return x;
+    }
+    x = lval_qexpr();
+    lval_reserve(x, job.count);
+    for (i = 0; i < job.count; i++) {
+        x->cell[x->count++] = job.results[i];
+    }
+    par_job_free(&job, job.count);
+    lval_del(a);
+    return x;
+}
+
+/* (preduce f init {list}): f applied to init and the first item, then to
+ * that and the next item, and so on, as foldl would. The chunks are
+ * reduced in parallel, the first from init and the others from their
+ * first item, and their results are then combined in order, so f must be
+ * associative. Returns the error of the first chunk that failed, if any. */
+lval *builtin_preduce(lenv *e, lval *a)
+{
+    struct par_job job;
+    lval *x, **end;
+    int k;
+
+    LASSERT_NARGS(a, a->count, 3, "preduce");
+    LASSERT_TYPE(a, a->cell[0], LVAL_FUN, 0, "preduce");
+    LASSERT_TYPE(a, a->cell[2], LVAL_QEXPR, 2, "preduce");
+
+    par_start();
+    par_job_init(&job, e, a->cell[0], a->cell[1], a->cell[2]);
+    end = job.results + job.nchunks;
+    gc_push(GC_STACK, job.results, &end);
+    par_run(&job);
+    if (job.nchunks == 0) {
+        x = lval_copy(job.init);
+    } else if (job.failed < job.nchunks) {
+        x = job.results[job.failed];
+        job.results[job.failed] = NULL;
+    } else {
+        x = job.results[0];
+        job.results[0] = NULL;
+        gc_push(GC_LVAL, &x, NULL);
+        for (k = 1; k < job.nchunks && LTYPE(x) != LVAL_ERR; k++) {
+            x = par_call(e, job.f, x, job.results[k]);
+            job.results[k] = NULL;
+        }
+        gc_pop(1);
+    }
+    gc_pop(1);
+    par_job_free(&job, 0);
+    lval_del(a);
+    return x;
+}
+
+/* (future {expr}): a future, for the value of expr, which is pushed as a
+ * task for the other threads to evaluate. The variables of expr are
+ * captured as a lambda's are (see lenv_capture): the future has its own
+ * copy of them, so that whatever the thread evaluating it assigns is not
+ * seen by the others, and shares only the globals. As it may run at any
+ * time until touched, expr should have no side effects.
+ * (touch f): the value of the future f, once evaluated. A thread touching
+ * a future that no thread has claimed yet evaluates it itself; one whose
+ * future is being evaluated elsewhere runs other tasks meanwhile (see
+ * par_wait). Values other than futures are returned as they are.
+ * With --gc, or a single thread, expr is evaluated right away.
+ */
+lval *lval_future(lval *expr, lenv *env)
+{
+    lval *v = lval_new(LVAL_FUT);
+    v->fut = malloc(sizeof(lfuture));
+    v->fut->refs = 1;
+    v->fut->claimed = 0;
+    v->fut->pending = 1;
+    v->fut->expr = expr;
+    v->fut->env = env;
+    v->fut->val = NULL;
+    v->fut->mark = 0;
+    return v;
+}
+
+void future_del(lfuture *f)
+{
+    if (refs_dec(&f->refs) > 0) {
+        return;
+    }
+    if (f->expr) {
+        lval_del(f->expr);
+        lenv_del(f->env);
+    }
+    if (f->val) {
+        lval_del(f->val);
+    }
+    free(f);
+}
+
+/* Evaluate the future f, which this thread has claimed. */
+void future_eval(lfuture *f)
+{
+    int outer = par_running;
+    lval *x = f->expr;
+
+    f->expr = NULL;
+    par_running = 1;
+    x = vm_enabled ? vm_eval(f->env, x) : lval_eval(f->env, x);
+    par_running = outer;
+    lenv_del(f->env);
+    f->env = NULL;
+    f->val = x;
+    __atomic_store_n(&f->pending, 0, __ATOMIC_RELEASE);
+    if (PAR_ACTIVE()) {
+        par_wake();
+    }
+}
+
+/* Claim the future f for this thread, unless another one did. */
+int future_claim(lfuture *f)
+{
+    return ! __atomic_exchange_n(&f->claimed, 1, __ATOMIC_ACQ_REL);
+}
+
+/* The task of a future: it holds a reference to it. */
+void future_task(void *arg)
+{
+    lfuture *f = arg;
+    if (future_claim(f)) {
+        future_eval(f);
+    }
+    future_del(f);
+}
+
+lval *builtin_future(lenv *e, lval *a)
+{
+    lval *expr, *formals, *syms, *v;
+    lenv *env;
+
+    LASSERT_NARGS(a, a->count, 1, "future");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "future");
+
+    expr = lval_unshare(lval_take(a, 0));
+    lval_set_type(expr, LVAL_SEXPR);
+    env = lenv_new();
+    formals = lval_qexpr();
+    syms = lval_free_syms(lval_qexpr(), expr, formals);
+    lenv_capture(env, e, syms);
+    lval_del(syms);
+    lval_del(formals);
+    v = lval_future(expr, env);
+
+    par_start();
+    if (gc.enabled || par.nthreads == 1) {
+        gc_push(GC_LVAL, &v, NULL);
+        future_claim(v->fut);
+        future_eval(v->fut);
+        gc_pop(1);
+        return v;
+    }
+    refs_inc(&v->fut->refs);
+    par_push(future_task, v->fut);
+    return v;
+}
+
+lval *builtin_touch(lenv *e, lval *a)
+{
+    lfuture *f;
+    lval *x;
+
+    LASSERT_NARGS(a, a->count, 1, "touch");
+    if (LTYPE(a->cell[0]) != LVAL_FUT) {
+        return lval_take(a, 0);
+    }
+    f = a->cell[0]->fut;
+    if (__atomic_load_n(&f->pending, __ATOMIC_ACQUIRE)) {
+        if (future_claim(f)) {
+            future_eval(f);
+        } else {
+            par_wait(&f->pending);
+        }
+    }
+    x = lval_copy(f->val);
+    lval_del(a);
+    par_settle();
+    return x;
+}
+
+/*************** Bytecode compiler and VM ********************/
+
+/* Instead of walking (and rebuilding) the S-Expression tree on every
+ * evaluation, code can be compiled once into a chunk of bytecode for a small
+ * stack machine. Code is still data here: "+" or "if" may be redefined at
+ * any time. So the specialised instructions check that the operator still
+ * names the expected builtin, and otherwise fall back to a generic call with
+ * exactly the arguments the tree evaluator would have used.
+ *
+ * Instructions (operands follow the opcode in the code array):
+ * OP_CONST k          push a copy of constant k
+ * OP_LOAD k           push the value of symbol constant k
+ * OP_SEXPR            push an empty S-Expression
+ * OP_CALL n           apply the n values on top of the stack (lval_apply)
+ * OP_TAIL n           same as OP_CALL, in tail position: return the
+ *                     result, even if it's a tail call (see lval_tail)
+ * OP_ADD..OP_EQ k n   apply builtin operator constant k to n values
+ * OP_IF k t f el end  pop the condition, continue into the "then" code
+ *                     or jump to el; t and f are the branch constants
+ *                     (f is -1 if missing) for the generic fallback
+ * OP_JUMP l           continue at l
+ * OP_LAMBDA k f b s v push a new function with formals f, body b,
+ *                     compiled body (sub-chunk) s, capturing the symbols
+ *                     of constant v (see lenv_capture)
+ * OP_RETURN           return the value on top of the stack
+ */
+enum { OP_CONST, OP_LOAD, OP_SEXPR, OP_CALL, OP_TAIL,
+       OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_LT, OP_GT, OP_LE, OP_GE, OP_EQ,
+       OP_IF, OP_JUMP, OP_LAMBDA, OP_RETURN };
+
+/* Operators with their own instruction. */
+struct vm_prim {
+    char *name;
+    int op;
+    lbuiltin fun;
+};
+
+static struct vm_prim vm_prims[] = {
+    { "+", OP_ADD, builtin_add },
+    { "-", OP_SUB, builtin_sub },
+    { "*", OP_MUL, builtin_mul },
+    { "/", OP_DIV, builtin_div },
+    { "<", OP_LT, builtin_lt },
+    { ">", OP_GT, builtin_gt },
+    { "<=", OP_LE, builtin_le },
+    { ">=", OP_GE, builtin_ge },
+    { "eq", OP_EQ, builtin_eq },
+    { NULL, 0, NULL }
+};
+
+lchunk *chunk_new(void)
+{
+    lchunk *c = malloc(sizeof(lchunk));
+    c->refs = 1;
+    c->count = 0;
+    c->capacity = 16;
+    c->code = malloc(sizeof(int) * c->capacity);
+    c->nconsts = 0;
+    c->consts = NULL;
+    c->nsubs = 0;
+    c->subs = NULL;
+    c->sp = 0;
+    c->depth = 0;
+    c->mark = 0;
+    return c;
+}
+
+void chunk_del(lchunk *c)
 {
     int i;
-    for (i = 0; i < e->count; i++) {
-        printf("(\"%s\" . ", e->syms[i]);
-        lval_print(e->vals[i]);
-        printf("\")\n");
+    if (refs_dec(&c->refs) > 0) {
+        return;
+    }
+    for (i = 0; i < c->nconsts; i++) {
+        lval_del(c->consts[i]);
+    }
+    for (i = 0; i < c->nsubs; i++) {
+        chunk_del(c->subs[i]);
+    }
+    free(c->consts);
+    free(c->subs);
+    free(c->code);
+    free(c);
+}
+
+/* Append a word to the code, returning its position. */
+int chunk_emit(lchunk *c, int word)
+{
+    if (c->count == c->capacity) {
+        c->capacity *= 2;
+        c->code = realloc(c->code, sizeof(int) * c->capacity);
+    }
+    c->code[c->count] = word;
+    return c->count++;
+}
+
+/* Add a copy of v to the constants, returning its index. */
+int chunk_const(lchunk *c, lval *v)
+{
+    c->nconsts++;
+    c->consts = realloc(c->consts, sizeof(lval *) * c->nconsts);
+    c->consts[c->nconsts - 1] = lval_copy(v);
+    return c->nconsts - 1;
+}
+
+/* Account for n values pushed to (or popped from, if n < 0) the stack. */
+void chunk_push(lchunk *c, int n)
+{
+    c->sp += n;
+    c->depth = max(c->depth, c->sp);
+}
+
+void vm_compile_expr(lchunk *c, lval *v);
+
+/* Compile the children of v as the S-Expression they form when evaluated.
+ * If tail is set, its value is the value of the whole chunk. */
+void vm_compile_sexpr(lchunk *c, lval *v, int tail)
+{
+    int i, el, end, jump;
+    struct vm_prim *p;
+    lval *x, *head = v->count ? v->cell[0] : NULL;
+
+    if (v->count == 0) {
+        chunk_emit(c, OP_SEXPR);
+        chunk_push(c, 1);
+        return;
+    }
+    if (v->count == 1) {
+        vm_compile_expr(c, head);
+        return;
+    }
+
+    /* (if cond {then} {else}) */
+    if (LTYPE(head) == LVAL_SYM && STREQ(head->sym, "if") &&
+        (v->count == 3 || v->count == 4) &&
+        LTYPE(v->cell[2]) == LVAL_QEXPR &&
+        (v->count == 3 || LTYPE(v->cell[3]) == LVAL_QEXPR)) {
+        vm_compile_expr(c, v->cell[1]);
+        chunk_emit(c, OP_IF);
+        chunk_emit(c, chunk_const(c, head));
+        chunk_emit(c, chunk_const(c, v->cell[2]));
+        chunk_emit(c, v->count == 4 ? chunk_const(c, v->cell[3]) : -1);
+        el = chunk_emit(c, 0);
+        end = chunk_emit(c, 0);
+        /* The generic fallback pushes "if" and both branches. */
+        chunk_push(c, 3);
+        chunk_push(c, -4);
+
+        vm_compile_sexpr(c, v->cell[2], tail);
+        chunk_push(c, -1);
+        chunk_emit(c, tail ? OP_RETURN : OP_JUMP);
+        jump = chunk_emit(c, 0);
+        c->code[el] = c->count;
+        if (v->count == 4) {
+            vm_compile_sexpr(c, v->cell[3], tail);
+        } else {
+            chunk_emit(c, OP_SEXPR);
+            chunk_push(c, 1);
+        }
+        c->code[jump] = c->count;
+        c->code[end] = c->count;
+        return;
+    }
+
+    /* (\ {formals} {body}) */
+    if (LTYPE(head) == LVAL_SYM && STREQ(head->sym, "\\") && v->count == 3 &&
+        LTYPE(v->cell[1]) == LVAL_QEXPR && LTYPE(v->cell[2]) == LVAL_QEXPR) {
+        for (i = 0; i < v->cell[1]->count; i++) {
+            if (LTYPE(v->cell[1]->cell[i]) != LVAL_SYM) {
+                break;
+            }
+        }
+        if (i == v->cell[1]->count) {
+            chunk_emit(c, OP_LAMBDA);
+            chunk_emit(c, chunk_const(c, head));
+            chunk_emit(c, chunk_const(c, v->cell[1]));
+            i = chunk_const(c, v->cell[2]);
+            chunk_emit(c, i);
+            c->consts[i] = lval_resolve(c->consts[i], v->cell[1]);
+            c->nsubs++;
+            c->subs = realloc(c->subs, sizeof(lchunk *) * c->nsubs);
+            c->subs[c->nsubs - 1] = vm_compile_body(c->consts[i]);
+            chunk_emit(c, c->nsubs - 1);
+            x = lval_free_syms(lval_qexpr(), c->consts[i], v->cell[1]);
+            chunk_emit(c, chunk_const(c, x));
+            lval_del(x);
+            /* The generic fallback pushes the lambda builtin and both
+             * arguments. */
+            chunk_push(c, 3);
+            chunk_push(c, -2);
+            return;
+        }
+    }
+
+    /* Operators with their own instruction. */
+    if (LTYPE(head) == LVAL_SYM) {
+        for (p = vm_prims; p->name; p++) {
+            if (STREQ(head->sym, p->name)) {
+                break;
+            }
+        }
+        if (p->name) {
+            for (i = 1; i < v->count; i++) {
+                vm_compile_expr(c, v->cell[i]);
+            }
+            chunk_emit(c, p->op);
+            chunk_emit(c, chunk_const(c, head));
+            chunk_emit(c, v->count - 1);
+            chunk_push(c, 2 - v->count);
+            return;
+        }
+    }
+
+    /* Generic call. */
+    for (i = 0; i < v->count; i++) {
+        vm_compile_expr(c, v->cell[i]);
+    }
+    chunk_emit(c, tail ? OP_TAIL : OP_CALL);
+    chunk_emit(c, v->count);
+    chunk_push(c, 1 - v->count);
+}
+
+void vm_compile_expr(lchunk *c, lval *v)
+{
+    switch (LTYPE(v)) {
+        case LVAL_SYM:
+            chunk_emit(c, OP_LOAD);
+            chunk_emit(c, chunk_const(c, v));
+            chunk_push(c, 1);
+            break;
+        case LVAL_SEXPR:
+            vm_compile_sexpr(c, v, 0);
+            break;
+        default:
+            chunk_emit(c, OP_CONST);
+            chunk_emit(c, chunk_const(c, v));
+            chunk_push(c, 1);
+            break;
+    }
+}
+
+/* Compile a function body (a Q-Expression evaluated as S-Expression). */
+lchunk *vm_compile_body(lval *body)
+{
+    lchunk *c = chunk_new();
+    vm_compile_sexpr(c, body, 1);
+    chunk_emit(c, OP_RETURN);
+    return c;
+}
+
+/* Compile and evaluate v in e (as lval_eval does), deleting v. */
+lval *vm_eval(lenv *e, lval *v)
+{
+    lchunk *c = chunk_new();
+    vm_compile_expr(c, v);
+    chunk_emit(c, OP_RETURN);
+    lval_del(v);
+    v = lval_untail(vm_run(e, c));
+    chunk_del(c);
+    return v;
+}
+
+/* Build the S-Expression (f args...) from n values on the stack. f may be
+ * NULL if it's already on the stack. */
+lval *vm_sexpr(lval *f, lval **args, int n)
+{
+    int i;
+    lval *v = lval_sexpr();
+    v->count = n + (f != NULL);
+    v->capacity = v->count;
+    v->cell = pool_alloc(sizeof(lval *) * v->count);
+    if (f) {
+        v->cell[0] = f;
+    }
+    for (i = 0; i < n; i++) {
+        v->cell[i + (f != NULL)] = args[i];
+    }
+    return v;
+}
+
+/* Apply (f args...), see vm_sexpr. */
+lval *vm_apply(lenv *e, lval *f, lval **args, int n)
+{
+    return lval_untail(lval_apply(e, vm_sexpr(f, args, n)));
+}
+
+/* Fast path of the operators with their own instruction, or NULL if the
+ * arguments are not suitable (then the builtin itself reports the error). */
+lval *vm_prim(int op, lval **args, int n)
+{
+    int i;
+    long x;
+    for (i = 0; i < n; i++) {
+        if (LTYPE(args[i]) != LVAL_NUM) {
+            return op == OP_EQ && n == 2 ? lval_num(lval_eq(args[0], args[1])) : NULL;
+        }
+    }
+    if (op >= OP_LT && n != 2) {
+        return NULL;
+    }
+    x = LNUM(args[0]);
+    switch (op) {
+        case OP_LT: return lval_num(x < LNUM(args[1]));
+        case OP_GT: return lval_num(x > LNUM(args[1]));
+        case OP_LE: return lval_num(x <= LNUM(args[1]));
+        case OP_GE: return lval_num(x >= LNUM(args[1]));
+        case OP_EQ: return lval_num(x == LNUM(args[1]));
+    }
+    if (op == OP_SUB && n == 1) {
+        return lval_num(-x);
+    }
+    for (i = 1; i < n; i++) {
+        switch (op) {
+            case OP_ADD: x += LNUM(args[i]); break;
+            case OP_SUB: x -= LNUM(args[i]); break;
+            case OP_MUL: x *= LNUM(args[i]); break;
+            case OP_DIV:
+                if (LNUM(args[i]) == 0) {
+                    return lval_err("Division by zero!");
+                }
+                x /= LNUM(args[i]);
+                break;
+        }
+    }
+    return lval_num(x);
+}
+
+#if defined(__GNUC__)
+/* Threaded dispatch: jump straight from one instruction to the next. */
+#define VM_DISPATCH goto *vm_labels[*ip++]
+#define VM_CASE(op) L_##op
+#else
+#define VM_DISPATCH continue
+#define VM_CASE(op) case op
+#endif
+
+/* Run the chunk c in the environment e, returning the result (which may be
+ * a tail call, see OP_TAIL). */
+lval *vm_run(lenv *e, lchunk *c)
+{
+    int i, n;
+    lval *f, *x;
+    lval *stack[c->depth + 1];
+    lval **sp = stack;
+    int *ip = c->code;
+
+    gc_push(GC_STACK, stack, &sp);
+    gc_push(GC_ENV, &e, NULL);
+    gc_push(GC_CHUNK, &c, NULL);
+    gc_safepoint();
+
+#if defined(__GNUC__)
+    static void *vm_labels[] = {
+        &&L_OP_CONST, &&L_OP_LOAD, &&L_OP_SEXPR, &&L_OP_CALL, &&L_OP_TAIL,
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_LT, &&L_OP_GT,
+        &&L_OP_LE, &&L_OP_GE, &&L_OP_EQ,
+        &&L_OP_IF, &&L_OP_JUMP, &&L_OP_LAMBDA, &&L_OP_RETURN
+    };
+    VM_DISPATCH;
+#else
+    for (;;) switch (*ip++) {
+#endif
+
+    VM_CASE(OP_CONST):
+        *sp++ = lval_copy(c->consts[*ip++]);
+        VM_DISPATCH;
+
+    VM_CASE(OP_LOAD):
+        *sp++ = lenv_get(e, c->consts[*ip++]);
+        VM_DISPATCH;
+
+    VM_CASE(OP_SEXPR):
+        *sp++ = lval_sexpr();
+        VM_DISPATCH;
+
+    VM_CASE(OP_CALL):
+        n = *ip++;
+        sp -= n;
+        *sp = vm_apply(e, NULL, sp, n);
+        sp++;
+        VM_DISPATCH;
+
+    VM_CASE(OP_TAIL):
+        n = *ip++;
+        sp -= n;
+        gc_pop(3);
+        return lval_apply(e, vm_sexpr(NULL, sp, n));
+
+    VM_CASE(OP_ADD):
+    VM_CASE(OP_SUB):
+    VM_CASE(OP_MUL):
+    VM_CASE(OP_DIV):
+    VM_CASE(OP_LT):
+    VM_CASE(OP_GT):
+    VM_CASE(OP_LE):
+    VM_CASE(OP_GE):
+    VM_CASE(OP_EQ):
+        f = lval_lookup(e, c->consts[ip[0]]);
+        n = ip[1];
+        sp -= n;
+        x = NULL;
+        if (f && LTYPE(f) == LVAL_FUN &&
+            f->builtin_fun == vm_prims[ip[-1] - OP_ADD].fun) {
+            x = vm_prim(ip[-1], sp, n);
+        }
+        if (x) {
+            for (i = 0; i < n; i++) {
+                lval_del(sp[i]);
+            }
+        } else {
+            x = vm_apply(e, lenv_get(e, c->consts[ip[0]]), sp, n);
+        }
+        *sp++ = x;
+        ip += 2;
+        VM_DISPATCH;
+
+    VM_CASE(OP_IF):
+        f = lval_lookup(e, c->consts[ip[0]]);
+        x = sp[-1];
+        if (f && LTYPE(f) == LVAL_FUN && f->builtin_fun == builtin_if &&
+            LTYPE(x) == LVAL_NUM) {
+            sp--;
+            ip = LNUM(x) ? ip + 5 : c->code + ip[3];
+            lval_del(x);
+            VM_DISPATCH;
+        }
+        sp[-1] = lenv_get(e, c->consts[ip[0]]);
+        *sp++ = x;
+        *sp++ = lval_copy(c->consts[ip[1]]);
+        n = 2;
+        if (ip[2] >= 0) {
+            *sp++ = lval_copy(c->consts[ip[2]]);
+            n++;
+        }
+        sp -= n + 1;
+        *sp = vm_apply(e, NULL, sp, n + 1);
+        sp++;
+        ip = c->code + ip[4];
+        VM_DISPATCH;
+
+    VM_CASE(OP_JUMP):
+        ip = c->code + *ip;
+        VM_DISPATCH;
+
+    VM_CASE(OP_LAMBDA):
+        f = lval_lookup(e, c->consts[ip[0]]);
+        if (f && LTYPE(f) == LVAL_FUN && f->builtin_fun == builtin_lambda) {
+            x = lval_lambda(lval_copy(c->consts[ip[1]]),
+                            lval_copy(c->consts[ip[2]]));
+            lenv_capture(x->env, e, c->consts[ip[4]]);
+            x->chunk = c->subs[ip[3]];
+            refs_inc(&x->chunk->refs);
+            *sp++ = x;
+        } else {
+            sp[0] = lenv_get(e, c->consts[ip[0]]);
+            sp[1] = lval_copy(c->consts[ip[1]]);
+            sp[2] = lval_copy(c->consts[ip[2]]);
+            *sp = vm_apply(e, NULL, sp, 3);
+            sp++;
+        }
+        ip += 5;
+        VM_DISPATCH;
+
+    VM_CASE(OP_RETURN):
+        gc_pop(3);
+        return sp[-1];
+
+#if !defined(__GNUC__)
+    }
+#endif
+}
+
+/*************************************************************/
+
+/*************** Functions to handle builtins ****************/
+
+/* Every builtin, with the name it was first registered with (by any
+ * interpreter, see caballa_new). Heap images refer to builtins by these
+ * names, which don't change from one build to the next (unlike the
+ * addresses of the functions). */
+struct builtin {
+    char *name;
+    lbuiltin fun;
+};
+static struct builtin *builtins;
+static int nbuiltins;
+static pthread_mutex_t builtins_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The name of the builtin fun, or NULL if it was not registered. */
+char *builtin_name(lbuiltin fun)
+{
+    int i;
+    char *name = NULL;
+    pthread_mutex_lock(&builtins_lock);
+    for (i = 0; i < nbuiltins && ! name; i++) {
+        if (builtins[i].fun == fun) {
+            name = builtins[i].name;
+        }
+    }
+    pthread_mutex_unlock(&builtins_lock);
+    return name;
+}
+
+/* The builtin registered as the len chars at s, or NULL. */
+lbuiltin builtin_find(const char *s, size_t len)
+{
+    int i;
+    lbuiltin fun = NULL;
+    pthread_mutex_lock(&builtins_lock);
+    for (i = 0; i < nbuiltins && ! fun; i++) {
+        if (strncmp(builtins[i].name, s, len) == 0 &&
+            builtins[i].name[len] == '\0') {
+            fun = builtins[i].fun;
+        }
+    }
+    pthread_mutex_unlock(&builtins_lock);
+    return fun;
+}
+
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
+{
+    lval *k = lval_sym(name);
+    lval *v = lval_fun(func);
+    lenv_put(e, k, v);
+    if (! builtin_name(func)) {
+        pthread_mutex_lock(&builtins_lock);
+        builtins = realloc(builtins, sizeof(struct builtin) * (nbuiltins + 1));
+        builtins[nbuiltins].name = k->sym;
+        builtins[nbuiltins].fun = func;
+        nbuiltins++;
+        pthread_mutex_unlock(&builtins_lock);
+    }
+    lval_del(k);
+    lval_del(v);
+}
+
+void lenv_add_builtins(lenv *e)
+{
+    /* List functions */
+    lenv_add_builtin(e, "list", (lbuiltin)builtin_list);
+    lenv_add_builtin(e, "head", (lbuiltin)builtin_head);
+    lenv_add_builtin(e, "join", (lbuiltin)builtin_join);
+    lenv_add_builtin(e, "eval", (lbuiltin)builtin_eval);
+    lenv_add_builtin(e, "tail", (lbuiltin)builtin_tail);
+
+    /* Mathematical functions */
+    lenv_add_builtin(e, "+", (lbuiltin)builtin_add);
+    lenv_add_builtin(e, "-", (lbuiltin)builtin_sub);
+    lenv_add_builtin(e, "*", (lbuiltin)builtin_mul);
+    lenv_add_builtin(e, "/", (lbuiltin)builtin_div);
+
+    /* Variable handling functions */
+    lenv_add_builtin(e, "def", (lbuiltin)builtin_def);
+    lenv_add_builtin(e, "=", (lbuiltin)builtin_put);
+    lenv_add_builtin(e, "\\", (lbuiltin)builtin_lambda);
+
+    /* Comparison */
+    lenv_add_builtin(e, "not", (lbuiltin)builtin_not);
+    lenv_add_builtin(e, "<", (lbuiltin)builtin_lt);
+    lenv_add_builtin(e, "<=", (lbuiltin)builtin_le);
+    lenv_add_builtin(e, ">", (lbuiltin)builtin_gt);
+    lenv_add_builtin(e, ">=", (lbuiltin)builtin_ge);
+    lenv_add_builtin(e, "eq", (lbuiltin)builtin_eq);
+
+    /* Conditionals */
+    lenv_add_builtin(e, "if", (lbuiltin)builtin_if);
+    lenv_add_builtin(e, "and", (lbuiltin)builtin_and);
+    lenv_add_builtin(e, "or", (lbuiltin)builtin_or);
+
+    /* Vectors */
+    lenv_add_builtin(e, "vec", (lbuiltin)builtin_vec);
+    lenv_add_builtin(e, "vec-range", (lbuiltin)builtin_vec_range);
+    lenv_add_builtin(e, "vec-list", (lbuiltin)builtin_vec_list);
+    lenv_add_builtin(e, "vec-len", (lbuiltin)builtin_vec_len);
+    lenv_add_builtin(e, "vec-eq", (lbuiltin)builtin_vec_eq);
+    lenv_add_builtin(e, "sum", (lbuiltin)builtin_sum);
+    lenv_add_builtin(e, "min", (lbuiltin)builtin_min);
+    lenv_add_builtin(e, "max", (lbuiltin)builtin_max);
+    lenv_add_builtin(e, "dot", (lbuiltin)builtin_dot);
+    lenv_add_builtin(e, "gather", (lbuiltin)builtin_gather);
+    lenv_add_builtin(e, "scatter", (lbuiltin)builtin_scatter);
+
+    /* Memoization */
+    lenv_add_builtin(e, "memo", (lbuiltin)builtin_memo);
+    lenv_add_builtin(e, "memo-stats", (lbuiltin)builtin_memo_stats);
+
+    /* Maps */
+    lenv_add_builtin(e, "map-new", (lbuiltin)builtin_map_new);
+    lenv_add_builtin(e, "map-get", (lbuiltin)builtin_map_get);
+    lenv_add_builtin(e, "map-put", (lbuiltin)builtin_map_put);
+    lenv_add_builtin(e, "map-del", (lbuiltin)builtin_map_del);
+    lenv_add_builtin(e, "map-keys", (lbuiltin)builtin_map_keys);
+    lenv_add_builtin(e, "map-count", (lbuiltin)builtin_map_count);
+
+    /* Strings */
+    lenv_add_builtin(e, "str-concat", (lbuiltin)builtin_str_concat);
+    lenv_add_builtin(e, "str-join", (lbuiltin)builtin_str_join);
+    lenv_add_builtin(e, "substr", (lbuiltin)builtin_substr);
+    lenv_add_builtin(e, "str-len", (lbuiltin)builtin_str_len);
+    lenv_add_builtin(e, "str-find", (lbuiltin)builtin_str_find);
+
+    /* Parallel */
+    lenv_add_builtin(e, "pmap", (lbuiltin)builtin_pmap);
+    lenv_add_builtin(e, "preduce", (lbuiltin)builtin_preduce);
+    lenv_add_builtin(e, "future", (lbuiltin)builtin_future);
+    lenv_add_builtin(e, "touch", (lbuiltin)builtin_touch);
+
+    /* Other */
+    lenv_add_builtin(e, "profile", (lbuiltin)builtin_profile);
+    lenv_add_builtin(e, "stats", (lbuiltin)builtin_stats);
+    lenv_add_builtin(e, "stats-reset", (lbuiltin)builtin_stats_reset);
+}
+
+/* The builtins that act on the process rather than on the interpreter:
+ * exiting it, writing files, printing the environment to stdout. Only the
+ * interpreter of the caballa binary has them, not those of the library or
+ * of the server (see caballa_new). */
+void lenv_add_process_builtins(lenv *e)
+{
+    lenv_add_builtin(e, "exit", (lbuiltin)builtin_exit);
+    lenv_add_builtin(e, "save-image", (lbuiltin)builtin_save_image);
+    lenv_add_builtin(e, "getenv", (lbuiltin)builtin_getenv);
+}
+
+/*************************************************************/
+
+/*********************** Heap images. ************************/
+
+/* (save-image "file") writes the bindings of the global environment, with
+ * every value reachable from them, to an image file; caballa --image file
+ * loads them back at startup instead of evaluating all the definitions
+ * again. An image is a header, followed by the values (each after the
+ * ones it refers to, by index) and the bindings:
+ *
+ *   header   : IMAGE_MAGIC, IMAGE_VERSION, IMAGE_ORDER, number of values
+ *   value    : type (a byte) then, by type:
+ *              Number       the number
+ *              Symbol       name, slot
+ *              String/Error text
+ *              S/Q-Expr     number of children, index of each child
+ *              Vector       number of numbers, the numbers
+ *              Map          number of keys, index of each key and value
+ *              Function     0, name of the builtin (see builtins); or
+ *                           1, formals, body, number of variables it
+ *                           captured, name and index of each value; or
+ *                           2, function applied, arguments (for a partial
+ *                           application); or
+ *                           3, function applied, capacity of the cache (for
+ *                           a memoized function, whose cache starts empty)
+ *   bindings : number of bindings, name and index of each value
+ *
+ * Numbers are 64 bits, other integers 32 bits and names and texts are
+ * their length followed by their chars, all in native byte order: images
+ * are not portable between architectures (which IMAGE_ORDER checks).
+ * Shared values are written once, so they are shared again when loaded.
+ */
+#define IMAGE_MAGIC "caballa image\n"
+#define IMAGE_VERSION 1
+#define IMAGE_ORDER 0x01020304
+
+struct image_writer {
+    FILE *f;
+    /* Values written so far, by index: a hash table from lval to index. */
+    int count;
+    int size;
+    lval **keys;
+    int *ids;
+};
+
+void image_word(struct image_writer *w, uint32_t x)
+{
+    fwrite(&x, sizeof(x), 1, w->f);
+}
+
+void image_text(struct image_writer *w, const char *s)
+{
+    uint32_t len = strlen(s);
+    image_word(w, len);
+    fwrite(s, 1, len, w->f);
+}
+
+void image_chars_put(const char *s, long n, void *f)
+{
+    fwrite(s, 1, n, f);
+}
+
+/* Slot of v in the hash table of w. */
+int image_slot(struct image_writer *w, lval *v)
+{
+    unsigned long i = ((uintptr_t) v >> 3) * 2654435761UL;
+    i &= w->size - 1;
+    while (w->keys[i] && w->keys[i] != v) {
+        i = (i + 1) & (w->size - 1);
     }
-    return lval_sexpr();
+    return i;
 }
 
+/* Add the key and value to the array of lvals at *kv, for image_put. */
+int image_map_pair(lval *k, lval *v, void *kv)
+{
+    *(*(lval ***) kv)++ = k;
+    *(*(lval ***) kv)++ = v;
+    return 1;
+}
 
-/* Given an environment, a symbol (or set of symbols) inside a Q-Expression,
- * and the same name of values, assign each value to each symbol in order inside the
- * provided environment.
- */
-lval *builtin_var(lenv *e, lval *a, char *op)
+/* Write v (after what it refers to) unless it was written already, and
+ * return its index. */
+int image_put(struct image_writer *w, lval *v)
 {
-    int i;
-    lval *sym, *val;
-    LASSERT(a, (a->count >= 2),
-            "'def' must have at least two arguments: a quoted expression"
-            " and an expression");
+    int i, n, *ids;
+    lval **keys;
 
-    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "def");
-    LASSERT(a, (a->cell[0]->count > 0),
-            "first argument of 'def' cannot be the empty Q-Expression {}");
-    LASSERT(a, (a->cell[0]->count == a->count - 1),
-            "number of symbols in Q-Expression must match the number of values");
-    for (i = 0; i < a->cell[0]->count; i++) {
-        LASSERT_TYPE(a, a->cell[0]->cell[i], LVAL_SYM, i, "def");
+    /* A future is saved as its value (see builtin_save_image). */
+    if (LTYPE(v) == LVAL_FUT) {
+        return image_put(w, v->fut->val);
     }
-    /* Add all the symbols to the environment. */
-    while (a->count > 1) {
-        sym = lval_pop(a->cell[0], 0);
-        val = lval_pop(a, 1);
-        if (STREQ(op, "def")) {
-            lenv_def(e, sym, val);
+    i = image_slot(w, v);
+    if (w->keys[i]) {
+        return w->ids[i];
+    }
+
+    switch (LTYPE(v)) {
+        case LVAL_NUM: {
+            int64_t x = LNUM(v);
+            fputc(LVAL_NUM, w->f);
+            fwrite(&x, sizeof(x), 1, w->f);
+            break;
         }
-        if (STREQ(op, "=")) {
-            lenv_put(e, sym, val);
+        case LVAL_SYM:
+            fputc(LVAL_SYM, w->f);
+            image_text(w, v->sym);
+            image_word(w, v->slot);
+            break;
+        case LVAL_STR:
+            /* Written a piece at a time, without flattening a rope. */
+            fputc(LVAL_STR, w->f);
+            image_word(w, lval_str_len(v));
+            rope_each(v, image_chars_put, w->f);
+            break;
+        case LVAL_ERR:
+            fputc(LVAL_ERR, w->f);
+            image_text(w, v->err);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            ids = malloc(sizeof(int) * (v->count + 1));
+            for (n = 0; n < v->count; n++) {
+                ids[n] = image_put(w, v->cell[n]);
+            }
+            fputc(v->type, w->f);
+            image_word(w, v->count);
+            for (n = 0; n < v->count; n++) {
+                image_word(w, ids[n]);
+            }
+            free(ids);
+            break;
+        case LVAL_VEC:
+            fputc(LVAL_VEC, w->f);
+            image_word(w, v->len);
+            fwrite(v->nums, sizeof(int64_t), v->len, w->f);
+            break;
+        case LVAL_MAP: {
+            lval **kv = malloc(sizeof(lval *) * (2 * v->nkeys + 1)), **p = kv;
+            hamt_each(v->root, image_map_pair, &p);
+            ids = malloc(sizeof(int) * (2 * v->nkeys + 1));
+            for (n = 0; n < 2 * v->nkeys; n++) {
+                ids[n] = image_put(w, kv[n]);
+            }
+            fputc(LVAL_MAP, w->f);
+            image_word(w, v->nkeys);
+            for (n = 0; n < 2 * v->nkeys; n++) {
+                image_word(w, ids[n]);
+            }
+            free(kv);
+            free(ids);
+            break;
+        }
+        case LVAL_FUN:
+            if (v->builtin_fun) {
+                char *name = builtin_name(v->builtin_fun);
+                fputc(LVAL_FUN, w->f);
+                fputc(0, w->f);
+                image_text(w, name ? name : "");
+                break;
+            }
+            if (v->args) {
+                i = image_put(w, v->applied);
+                n = image_put(w, v->args);
+                fputc(LVAL_FUN, w->f);
+                fputc(2, w->f);
+                image_word(w, i);
+                image_word(w, n);
+                break;
+            }
+            if (v->applied) {
+                i = image_put(w, v->applied);
+                fputc(LVAL_FUN, w->f);
+                fputc(3, w->f);
+                image_word(w, i);
+                image_word(w, v->memo->capacity);
+                break;
+            }
+            ids = malloc(sizeof(int) * (v->env->count + 2));
+            ids[0] = image_put(w, v->formals);
+            ids[1] = image_put(w, v->body);
+            for (n = 0; n < v->env->count; n++) {
+                ids[n + 2] = image_put(w, v->env->vals[n]);
+            }
+            fputc(LVAL_FUN, w->f);
+            fputc(1, w->f);
+            image_word(w, ids[0]);
+            image_word(w, ids[1]);
+            image_word(w, v->env->count);
+            for (n = 0; n < v->env->count; n++) {
+                image_text(w, v->env->syms[n]);
+                image_word(w, ids[n + 2]);
+            }
+            free(ids);
+            break;
+    }
+
+    /* Record the index (the slot may have moved if the table grew while
+     * writing the children). */
+    if (2 * (w->count + 1) > w->size) {
+        keys = w->keys;
+        ids = w->ids;
+        n = w->size;
+        w->size *= 2;
+        w->keys = calloc(w->size, sizeof(lval *));
+        w->ids = malloc(sizeof(int) * w->size);
+        for (i = 0; i < n; i++) {
+            if (keys[i]) {
+                int j = image_slot(w, keys[i]);
+                w->keys[j] = keys[i];
+                w->ids[j] = ids[i];
+            }
+        }
+        free(keys);
+        free(ids);
+    }
+    i = image_slot(w, v);
+    w->keys[i] = v;
+    w->ids[i] = w->count;
+    return w->count++;
+}
+
+/* Save the global environment to the image file a. */
+lval *builtin_save_image(lenv *e, lval *a)
+{
+    int i, n, *ids;
+    struct image_writer w;
+    uint32_t header[3] = { IMAGE_VERSION, IMAGE_ORDER, 0 };
+
+    LASSERT_NARGS(a, a->count, 1, "save-image");
+    LASSERT_TYPE(a, a->cell[0], LVAL_STR, 0, "save-image");
+    LASSERT(a, ! par_running,
+            "Function 'save-image' called from a parallel task.");
+
+    /* Every future gets its value. */
+    par_wait_all();
+    w.f = fopen(lval_str_flat(a->cell[0]), "wb");
+    LASSERT(a, w.f, "Could not write image '%s': %s", a->cell[0]->str,
+            strerror(errno));
+    w.count = 0;
+    w.size = 1024;
+    w.keys = calloc(w.size, sizeof(lval *));
+    w.ids = malloc(sizeof(int) * w.size);
+    while (e->parent) {
+        e = e->parent;
+    }
+
+    /* The number of values is only known at the end. */
+    fwrite(IMAGE_MAGIC, 1, sizeof(IMAGE_MAGIC), w.f);
+    fwrite(header, sizeof(header), 1, w.f);
+
+    ids = malloc(sizeof(int) * (LENV_SLOTS(e) + 1));
+    for (i = 0, n = 0; i < LENV_SLOTS(e); i++) {
+        if (e->syms[i]) {
+            ids[i] = image_put(&w, e->vals[i]);
+            n++;
         }
-        lval_del(sym);
-        lval_del(val);
+    }
+    image_word(&w, n);
+    for (i = 0; i < LENV_SLOTS(e); i++) {
+        if (e->syms[i]) {
+            image_text(&w, e->syms[i]);
+            image_word(&w, ids[i]);
+        }
+    }
+    free(ids);
+    free(w.keys);
+    free(w.ids);
+
+    header[2] = w.count;
+    fseek(w.f, sizeof(IMAGE_MAGIC), SEEK_SET);
+    fwrite(header, sizeof(header), 1, w.f);
+    if (ferror(w.f) | fclose(w.f)) {
+        LASSERT(a, 0, "Could not write image '%s': %s", a->cell[0]->str,
+                strerror(errno));
     }
     lval_del(a);
     return lval_sexpr();
 }
 
-lval *builtin_def(lenv *e, lval *a)
+/* Reading an image, mapped in memory from p to end. */
+struct image_reader {
+    const char *p;
+    const char *end;
+    /* The values read so far. */
+    int count;
+    lval **vals;
+    /* Where the values are loaded, the parent of closures. */
+    lenv *global;
+};
+
+/* Read n bytes into x, returning 0 if the image is too short. */
+int image_read(struct image_reader *r, void *x, size_t n)
 {
-    return builtin_var(e, a, "def");
+    if ((size_t) (r->end - r->p) < n) {
+        return 0;
+    }
+    memcpy(x, r->p, n);
+    r->p += n;
+    return 1;
 }
 
-lval *builtin_put(lenv *e, lval *a)
+/* Read the index of a value already read, or return -1. */
+int image_index(struct image_reader *r)
 {
-    return builtin_var(e, a, "=");
+    uint32_t i;
+    return image_read(r, &i, sizeof(i)) && i < (uint32_t) r->count ? (int) i : -1;
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op)
+/* Read a name or text, returning where it is in the image (not
+ * null-terminated), or NULL. */
+const char *image_chars(struct image_reader *r, uint32_t *len)
 {
-    /* Ensure all arguments are numbers. */
-    int i;
-    for (i = 0; i < a->count; i++) {
-        LASSERT_TYPE(a, a->cell[i], LVAL_NUM, i, op);
+    const char *s;
+    if (! image_read(r, len, sizeof(*len)) || *len > (size_t) (r->end - r->p)) {
+        return NULL;
     }
+    s = r->p;
+    r->p += *len;
+    return s;
+}
 
-    /* Pop the first element. */
-    lval *x = lval_pop(a, 0);
+/* Read the next value, or return NULL if the image is invalid. */
+lval *image_get(struct image_reader *r)
+{
+    int i, j, k;
+    uint32_t n, len;
+    int64_t x;
+    unsigned char type, kind;
+    const char *s;
+    lval *v, *sym, *m;
+    lbuiltin fun;
+
+    if (! image_read(r, &type, 1)) {
+        return NULL;
+    }
+    switch (type) {
+        case LVAL_NUM:
+            if (! image_read(r, &x, sizeof(x))) {
+                return NULL;
+            }
+            return lval_num(x);
+        case LVAL_SYM:
+            if (! (s = image_chars(r, &len)) || ! image_read(r, &n, sizeof(n))) {
+                return NULL;
+            }
+            v = lval_sym_n(s, len);
+            v->slot = (int) n;
+            return v;
+        case LVAL_STR:
+        case LVAL_ERR:
+            if (! (s = image_chars(r, &len))) {
+                return NULL;
+            }
+            v = lval_new(type);
+            memcpy(lval_text_alloc(v, len), s, len);
+            v->str[len] = '\0';
+            return v;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (! image_read(r, &n, sizeof(n))) {
+                return NULL;
+            }
+            v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            lval_reserve(v, n);
+            while (n--) {
+                if ((i = image_index(r)) < 0) {
+                    lval_del(v);
+                    return NULL;
+                }
+                lval_add(v, lval_copy(r->vals[i]));
+            }
+            return v;
+        case LVAL_VEC:
+            if (! image_read(r, &n, sizeof(n)) ||
+                n > (size_t) (r->end - r->p) / sizeof(int64_t)) {
+                return NULL;
+            }
+            v = lval_vec(n);
+            if (LTYPE(v) == LVAL_ERR) {
+                lval_del(v);
+                return NULL;
+            }
+            if (n) {
+                image_read(r, v->nums, sizeof(int64_t) * n);
+            }
+            return v;
+        case LVAL_MAP:
+            if (! image_read(r, &n, sizeof(n))) {
+                return NULL;
+            }
+            v = lval_map();
+            while (n--) {
+                if ((i = image_index(r)) < 0 || (j = image_index(r)) < 0) {
+                    lval_del(v);
+                    return NULL;
+                }
+                m = lval_map_put(v, r->vals[i], r->vals[j]);
+                lval_del(v);
+                v = m;
+            }
+            return v;
+        case LVAL_FUN:
+            if (! image_read(r, &kind, 1)) {
+                return NULL;
+            }
+            if (kind == 0) {
+                if (! (s = image_chars(r, &len))) {
+                    return NULL;
+                }
+                fun = builtin_find(s, len);
+                return fun ? lval_fun(fun) : NULL;
+            }
+            if (kind == 2) {
+                if ((i = image_index(r)) < 0 || (j = image_index(r)) < 0) {
+                    return NULL;
+                }
+                v = r->vals[i];
+                if (LTYPE(v) != LVAL_FUN || v->builtin_fun || v->args ||
+                    LTYPE(r->vals[j]) != LVAL_SEXPR ||
+                    r->vals[j]->count >= v->formals->count) {
+                    return NULL;
+                }
+                return lval_partial(lval_copy(v), lval_copy(r->vals[j]));
+            }
+            if (kind == 3) {
+                if ((i = image_index(r)) < 0 || ! image_read(r, &n, sizeof(n))) {
+                    return NULL;
+                }
+                v = r->vals[i];
+                if (LTYPE(v) != LVAL_FUN || v->builtin_fun || n < 1 || n > INT_MAX) {
+                    return NULL;
+                }
+                return lval_memo(lval_copy(v), n);
+            }
+            /* As checked by builtin_lambda. */
+            if ((i = image_index(r)) < 0 || (j = image_index(r)) < 0 ||
+                ! image_read(r, &n, sizeof(n)) ||
+                LTYPE(r->vals[i]) != LVAL_QEXPR ||
+                LTYPE(r->vals[j]) != LVAL_QEXPR) {
+                return NULL;
+            }
+            for (k = 0; k < r->vals[i]->count; k++) {
+                if (LTYPE(r->vals[i]->cell[k]) != LVAL_SYM) {
+                    return NULL;
+                }
+            }
+            v = lval_new(LVAL_FUN);
+            v->builtin_fun = NULL;
+            v->applied = NULL;
+            v->args = NULL;
+            v->env = lenv_new();
+            v->env->parent = r->global;
+            v->formals = lval_copy(r->vals[i]);
+            v->body = lval_copy(r->vals[j]);
+            v->chunk = vm_enabled ? vm_compile_body(v->body) : NULL;
+            while (n--) {
+                if (! (s = image_chars(r, &len)) || (k = image_index(r)) < 0) {
+                    lval_del(v);
+                    return NULL;
+                }
+                sym = lval_sym_n(s, len);
+                lenv_put(v->env, sym, r->vals[k]);
+                lval_del(sym);
+            }
+            return v;
+    }
+    return NULL;
+}
 
-    /* If no arguments and sub then perform unary negation. */
-    if (STREQ(op, "-") && a->count == 0) {
-        x->num = - x->num;
+/* Load the image at path into the global environment e. Returns an error,
+ * or the empty S-Expression. */
+lval *image_load(lenv *e, const char *path)
+{
+    int fd, i, ok = 0;
+    struct stat st;
+    struct image_reader r = { NULL, NULL, 0, NULL, e };
+    char magic[sizeof(IMAGE_MAGIC)];
+    uint32_t header[3], n, len;
+    const char *s;
+    void *map;
+    lval *sym;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return lval_err("Could not read image '%s': %s", path, strerror(errno));
+    }
+    map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) :
+                       MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return lval_err("Could not read image '%s'", path);
+    }
+    r.p = map;
+    r.end = r.p + st.st_size;
+
+    if (image_read(&r, magic, sizeof(magic)) &&
+        memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0 &&
+        image_read(&r, header, sizeof(header)) &&
+        header[0] == IMAGE_VERSION && header[1] == IMAGE_ORDER &&
+        /* Each value takes a byte at least. */
+        header[2] <= (size_t) (r.end - r.p)) {
+        r.vals = malloc(sizeof(lval *) * (header[2] + 1));
+        while (r.count < (int) header[2] &&
+               (r.vals[r.count] = image_get(&r))) {
+            r.count++;
+        }
+        ok = r.count == (int) header[2] && image_read(&r, &n, sizeof(n));
+        while (ok && n--) {
+            ok = (s = image_chars(&r, &len)) && (i = image_index(&r)) >= 0;
+            if (ok) {
+                sym = lval_sym_n(s, len);
+                lenv_def(e, sym, r.vals[i]);
+                lval_del(sym);
+            }
+        }
+        for (i = 0; i < r.count; i++) {
+            lval_del(r.vals[i]);
+        }
+        free(r.vals);
     }
+    munmap(map, st.st_size);
+    return ok ? lval_sexpr() : lval_err("Invalid image '%s'", path);
+}
 
-    /* While there are still elements remainin... */
-    while (a->count > 0) {
-        /* Pop the next element. */
-        lval *y = lval_pop(a, 0);
+/******************** Top-level evaluation. ******************/
 
-        if (STREQ(op, "+")) { x->num += y->num; }
-        if (STREQ(op, "-")) { x->num -= y->num; }
-        if (STREQ(op, "*")) { x->num *= y->num; }
-        if (STREQ(op, "/")) {
-            /* Ensure we're not dividing by zero. */
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero!");
+/* The value of the top-level expression x. */
+lval *top_value(lenv *e, lval *x)
+{
+    if (LTYPE(x) != LVAL_ERR) {
+        x = vm_enabled ? vm_eval(e, x) : lval_eval(e, x);
+    }
+    /* Futures left untouched still finish before the next expression. */
+    par_wait_all();
+    return x;
+}
+
+/* Evaluate the top-level expression x and print the result. Returns 1 if
+ * it was an error, else 0. */
+int top_eval(lenv *e, lval *x)
+{
+    int err;
+    x = top_value(e, x);
+    err = LTYPE(x) == LVAL_ERR;
+    lval_println(stdout, x);
+    lval_del(x);
+    gc_safepoint();
+    return err;
+}
+
+/* Initial size of the input buffer of stream_eval. */
+#ifndef STREAM_BUFFER
+#define STREAM_BUFFER (64 * 1024)
+#endif
+
+/* What stream_eval knows of an incomplete expression from the input read
+ * after it, so that it doesn't read it again until it may be complete. */
+struct stream_scan {
+    /* Brackets open, and whether in a string (just after a backslash in
+     * it), or in a number or symbol at top level. */
+    int depth;
+    int str;
+    int esc;
+    int atom;
+};
+
+/* Scan buf from *i up to len, for the expression the reader found
+ * incomplete, leaving *i at the end of what was scanned. Returns 1 as soon
+ * as the expression may be complete or have a syntax error, 0 if it
+ * certainly goes on after len. */
+int stream_scan(struct stream_scan *s, const char *buf, size_t *i, size_t len)
+{
+    int c;
+    while (*i < len) {
+        c = (unsigned char) buf[(*i)++];
+        if (s->str) {
+            if (s->esc) {
+                s->esc = 0;
+            } else if (c == '\\') {
+                s->esc = 1;
+            } else if (c == '"') {
+                s->str = 0;
+                if (s->depth == 0) {
+                    return 1;
+                }
+            }
+        } else if (s->atom && ! reader_symchar(c)) {
+            return 1;
+        } else if (c == '(' || c == '{') {
+            s->depth++;
+        } else if (c == ')' || c == '}') {
+            if (--s->depth <= 0) {
+                return 1;
+            }
+        } else if (c == '"') {
+            s->str = 1;
+        } else if (reader_symchar(c)) {
+            s->atom = s->depth == 0;
+        } else if (! isspace(c)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Non-interactive mode: evaluate the top-level expressions of the file at
+ * path ("-" for stdin), in turn. The input is read into a buffer that is
+ * refilled as expressions are consumed, and every expression is evaluated
+ * as soon as it is complete, so memory use depends on the size of the
+ * largest expression, not on the size of the input. An incomplete
+ * expression is only read again once what follows may complete it (see
+ * stream_scan), so reading a large one takes linear time. Returns the exit
+ * status: 1 if the input could not be read or parsed, or if an expression
+ * evaluated to an error, else 0.
+ */
+int stream_eval(lenv *e, const char *path)
+{
+    int fd, status = 0, eof = 0, line = 1, col = 1;
+    /* The buffer holds len bytes, of which the first pos are consumed, and
+     * the first scanned were scanned (see stream_scan). */
+    size_t size = STREAM_BUFFER, len = 0, pos = 0, scanned = 0;
+    ssize_t n;
+    char *buf;
+    struct reader r;
+    struct stream_scan scan;
+    lval *x;
+
+    fd = STREQ(path, "-") ? 0 : open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    path = fd ? path : "<stdin>";
+    buf = malloc(size);
+    buf[0] = '\0';
+
+    for (;;) {
+        reader_init(&r, path, buf + pos);
+        r.line = line;
+        r.col = col;
+        r.more = ! eof;
+        x = lval_read_expr(&r);
+        if (r.err) {
+            lval_println(stdout, r.err);
+            lval_del(r.err);
+            status = 1;
+            break;
+        }
+        if (! x && eof) {
+            break;
+        }
+
+        /* Need more input: move what's left to the start of the buffer
+         * (growing it if it's full of it), and read more after it, until
+         * the expression at pos may be complete if it's incomplete. */
+        if (! x) {
+            memset(&scan, 0, sizeof(scan));
+            scanned = pos;
+            do {
+                len -= pos;
+                memmove(buf, buf + pos, len);
+                scanned -= pos;
+                pos = 0;
+                if (len + 1 == size) {
+                    size *= 2;
+                    buf = realloc(buf, size);
+                }
+                n = read(fd, buf + len, size - len - 1);
+                if (n < 0) {
+                    break;
+                }
+                eof = (n == 0);
+                len += n;
+                buf[len] = '\0';
+            } while (r.partial && ! eof &&
+                     ! stream_scan(&scan, buf, &scanned, len));
+            if (n < 0) {
+                perror(path);
+                status = 1;
                 break;
             }
-            x->num /= y->num;
+            continue;
         }
 
-        lval_del(y);
+        /* Consume the expression and evaluate it. */
+        reader_locate(buf + pos, r.p, &line, &col);
+        pos = r.p - buf;
+        if (top_eval(e, x)) {
+            status = 1;
+        }
     }
-    lval_del(a);
-    return x;
+
+    free(buf);
+    if (fd) {
+        close(fd);
+    }
+    return status;
 }
 
+/*********************** Embedding. **************************/
 
-lval *builtin_add(lenv *e, lval *a)
+/* An interpreter (see caballa.h). Everything else evaluation uses is
+ * either per thread (the pools, the counters, the profile) or shared and
+ * guarded (the symbol table, the builtins, the threads of par_start). */
+struct caballa {
+    lenv *env;
+    /* Its unfinished tasks (see par_owner). */
+    int pending;
+    /* See caballa_set_max_depth. */
+    int max_depth;
+};
+
+static pthread_once_t caballa_once = PTHREAD_ONCE_INIT;
+
+/* What is set up once per process. */
+void caballa_init(void)
 {
-    return builtin_op(e, a, "+");
+    sym_init();
+    rope_init();
+#if VEC_X86
+    vec_avx2();
+#endif
 }
 
-lval *builtin_sub(lenv *e, lval *a)
+caballa *caballa_new(void)
 {
-    return builtin_op(e, a, "-");
+    caballa *c = malloc(sizeof(caballa));
+    pthread_once(&caballa_once, caballa_init);
+    c->env = lenv_new_global();
+    c->pending = 0;
+    c->max_depth = 0;
+    lenv_add_builtins(c->env);
+    return c;
 }
 
-lval *builtin_mul(lenv *e, lval *a)
+void caballa_set_max_depth(caballa *c, int depth)
 {
-    return builtin_op(e, a, "*");
+    c->max_depth = depth;
 }
 
-lval *builtin_div(lenv *e, lval *a)
+void caballa_free(caballa *c)
 {
-    return builtin_op(e, a, "/");
+    lenv_del(c->env);
+    free(c);
 }
 
-lval* builtin_head(lenv *e, lval *a)
+int caballa_eval_string(caballa *c, const char *src, char **out)
 {
-    /* Check error conditions. */
-    LASSERT_NARGS(a, a->count, 1, "head");
-    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "head");
-    LASSERT(a, a->cell[0]->count != 0,
-            "Function 'head' expected a non-emtpy Q-Expr, but was passed '{}'.");
+    struct reader r;
+    lval *x, *v = lval_sexpr();
+    size_t len;
+    FILE *f;
+    int status, *owner = par_owner, max_depth = eval_max_depth;
+
+    par_owner = &c->pending;
+    eval_max_depth = c->max_depth;
+    reader_init(&r, "<string>", src);
+    while (LTYPE(v) != LVAL_ERR && (x = lval_read_expr(&r))) {
+        lval_del(v);
+        v = top_value(c->env, x);
+    }
+    if (r.err) {
+        lval_del(v);
+        v = r.err;
+    }
+    status = LTYPE(v) == LVAL_ERR ? -1 : 0;
+    if (out) {
+        f = open_memstream(out, &len);
+        lval_print(f, v);
+        fclose(f);
+    }
+    lval_del(v);
+    par_owner = owner;
+    eval_max_depth = max_depth;
+    return status;
+}
 
-    /* Otherwise take first argument. */
-    lval *v = lval_take(a, 0);
+void caballa_register_builtin(caballa *c, const char *name, lbuiltin fun)
+{
+    lenv_add_builtin(c->env, (char *) name, fun);
+}
+
+int caballa_nargs(lval *a)
+{
+    return a->count;
+}
+
+lval *caballa_arg(lval *a, int i)
+{
+    return a->cell[i];
+}
 
-    /* Delete all elements that are not head and return. */
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
+int caballa_get_num(lval *v, long *x)
+{
+    if (LTYPE(v) != LVAL_NUM) {
+        return 0;
     }
-    return v;
+    *x = LNUM(v);
+    return 1;
 }
 
-lval* builtin_tail(lenv *e, lval *a)
+const char *caballa_get_str(lval *v)
 {
-    /* Check error conditions. */
-    LASSERT_NARGS(a, a->count, 1, "tail");
-    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "tail");
-    LASSERT(a, a->cell[0]->count != 0,
-            "Function 'tail' expected a non-emtpy Q-Expr, but was passed '{}'.");
+    return LTYPE(v) == LVAL_STR ? lval_str_flat(v) : NULL;
+}
+
+#ifndef CABALLA_LIB
+
+/*************************** Server. **************************/
+
+#ifdef __linux__
+
+/* caballa --serve path: answer the clients of the Unix domain socket at
+ * path. A request is source text, as a file would hold, preceded by its
+ * length in bytes (4 bytes, most significant first). The answer, framed the
+ * same way, is what caballa_eval_string gives for it: the printed value of
+ * the last expression, or the error. A client may send requests without
+ * waiting for the answers, which come in order.
+ *
+ * The main thread runs an epoll loop, which accepts the clients and reads
+ * and writes them without blocking. A complete request is queued for a
+ * pool of worker threads (--serve-workers=N, one per processor by default,
+ * and only one with --gc), each with an interpreter of its own, loaded once
+ * at startup with the image (--image) and the script given: a request only
+ * pays for its own evaluation. What a request defines stays in the
+ * interpreter that evaluated it, so requests should not rely on each other.
+ * Like those of the library, these interpreters don't have the builtins
+ * that act on the process (see lenv_add_process_builtins), such as exit
+ * and save-image. Their evaluation nests at most SERVE_MAX_DEPTH levels
+ * deep, so that a runaway recursion is an error rather than a stack
+ * overflow.
+ *
+ * (serve-stats {}) returns the counters of the server, which are printed on
+ * stderr as well when it stops (on SIGINT or SIGTERM).
+ */
+
+/* The largest request: a client sending a larger one is disconnected. */
+#ifndef SERVE_MAX_REQUEST
+#define SERVE_MAX_REQUEST (16 * 1024 * 1024)
+#endif
+
+/* The limit of nesting of the workers' interpreters (see
+ * caballa_set_max_depth). At most about 1 KB of stack per level was seen,
+ * unoptimized and through pmap, so THREAD_STACK leaves a wide margin. */
+#ifndef SERVE_MAX_DEPTH
+#define SERVE_MAX_DEPTH 10000
+#endif
+
+/* Events handled per epoll_wait. */
+#define SERVE_EVENTS 64
+
+/* Latencies are counted in buckets: bucket i for those under 2^i
+ * microseconds (and not under 2^(i-1)). */
+#define SERVE_BUCKETS 40
+
+/* A client. */
+struct serve_conn {
+    /* -1 once closed. */
+    int fd;
+    /* The events it's polled for. */
+    int events;
+    /* Read, and not taken as a request yet. */
+    char *in;
+    size_t in_len, in_size;
+    /* The answer being written, of which out_pos bytes are written. */
+    char *out;
+    size_t out_len, out_pos;
+    /* A request of it is being evaluated: the next one waits for the
+     * answer to be written, so that answers come in order. */
+    int busy;
+    /* It won't send more. */
+    int eof;
+};
+
+/* A request, from the loop to a worker and back. */
+struct serve_job {
+    struct serve_conn *conn;
+    char *src;
+    /* The answer, and whether it's an error. */
+    char *out;
+    int status;
+    /* When it was read. */
+    double start;
+    struct serve_job *next;
+};
+
+struct serve_queue {
+    struct serve_job *head, *tail;
+    int len;
+};
+
+struct serve_server {
+    pthread_mutex_t lock;
+    /* Signaled when a request is queued in todo. */
+    pthread_cond_t work;
+    /* Requests for the workers, and answers for the loop, which is woken
+     * by writing to the eventfd done_fd. */
+    struct serve_queue todo, done;
+    int done_fd;
+    /* Counters, see serve_stats. */
+    long requests, errors, clients, queued_max;
+    double latency_total, latency_max;
+    long latency[SERVE_BUCKETS];
+};
+
+struct serve_server serve = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+/* Set by SIGINT and SIGTERM. */
+static volatile sig_atomic_t serve_stop = 0;
+
+void serve_signal(int sig)
+{
+    serve_stop = 1;
+}
+
+void serve_push(struct serve_queue *q, struct serve_job *j)
+{
+    j->next = NULL;
+    if (q->tail) {
+        q->tail->next = j;
+    } else {
+        q->head = j;
+    }
+    q->tail = j;
+    q->len++;
+}
+
+struct serve_job *serve_pop(struct serve_queue *q)
+{
+    struct serve_job *j = q->head;
+    q->head = j->next;
+    if (! q->head) {
+        q->tail = NULL;
+    }
+    q->len--;
+    return j;
+}
+
+/* The latency under which p percent of the requests were answered,
+ * rounded up to a power of two microseconds. Under serve.lock. */
+long serve_percentile(long p)
+{
+    long n = 0, want = (p * serve.requests + 99) / 100;
+    int i;
+
+    for (i = 0; i < SERVE_BUCKETS; i++) {
+        n += serve.latency[i];
+        if (n > 0 && n >= want) {
+            return 1L << i;
+        }
+    }
+    return 0;
+}
 
-    /* Take first argument. */
-    lval *v = lval_take(a, 0);
+/* The counters: requests answered (and how many were errors), clients
+ * connected, requests waiting for a worker (now, and at most), and the
+ * latency of requests from being read to being answered, in microseconds
+ * (mean, median, 99th percentile and max). */
+lval *serve_stats(void)
+{
+    lval *m = lval_map();
+
+    pthread_mutex_lock(&serve.lock);
+    m = stats_put(m, "requests", lval_num(serve.requests));
+    m = stats_put(m, "errors", lval_num(serve.errors));
+    m = stats_put(m, "clients", lval_num(serve.clients));
+    m = stats_put(m, "queued", lval_num(serve.todo.len));
+    m = stats_put(m, "queued-max", lval_num(serve.queued_max));
+    m = stats_put(m, "latency-mean-us", lval_num(serve.requests ?
+        (long) (serve.latency_total * 1e6 / serve.requests) : 0));
+    m = stats_put(m, "latency-p50-us", lval_num(serve_percentile(50)));
+    m = stats_put(m, "latency-p99-us", lval_num(serve_percentile(99)));
+    m = stats_put(m, "latency-max-us",
+                  lval_num((long) (serve.latency_max * 1e6)));
+    pthread_mutex_unlock(&serve.lock);
+    return m;
+}
 
-    /* Delete first element and return. */
-    lval_del(lval_pop(v, 0));
-    return v;
+lval *builtin_serve_stats(lenv *e, lval *a)
+{
+    LASSERT_NARGS(a, a->count, 1, "serve-stats");
+    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "serve-stats");
+    lval_del(a);
+    return serve_stats();
 }
 
-/* Turn an S-Expression into a Q-Expression. */
-lval* builtin_list(lenv *e, lval *a)
+void serve_report(void)
 {
-    a->type = LVAL_QEXPR;
-    return a;
+    pthread_mutex_lock(&serve.lock);
+    fprintf(stderr, "serve: %ld requests, %ld errors, at most %ld queued\n",
+            serve.requests, serve.errors, serve.queued_max);
+    fprintf(stderr, "serve: latency mean %.0f us, p50 %ld us, p99 %ld us, "
+            "max %.0f us\n", serve.requests ?
+            serve.latency_total * 1e6 / serve.requests : 0.0,
+            serve_percentile(50), serve_percentile(99),
+            serve.latency_max * 1e6);
+    pthread_mutex_unlock(&serve.lock);
 }
 
-/* Join two Q-Expressions. */
-lval* builtin_join(lenv *e, lval *a)
+void *serve_worker(void *arg)
 {
+    caballa *c = arg;
+    struct serve_job *j;
+    uint64_t one = 1;
+    double t;
     int i;
-    for (i = 0; i < a->count; i++) {
-        LASSERT_TYPE(a, a->cell[i], LVAL_QEXPR, i, "join");
-    }
 
-    lval *x = lval_pop(a, 0);
+    /* As gc_init does for the main thread. */
+    refs_slow = gc.enabled;
+    for (;;) {
+        pthread_mutex_lock(&serve.lock);
+        while (! serve.todo.head) {
+            pthread_cond_wait(&serve.work, &serve.lock);
+        }
+        j = serve_pop(&serve.todo);
+        pthread_mutex_unlock(&serve.lock);
 
-    while (a->count) {
-        x = lval_join(e, x, lval_pop(a, 0));
+        j->status = caballa_eval_string(c, j->src, &j->out);
+        gc_safepoint();
+
+        t = gc_now() - j->start;
+        for (i = 0; i < SERVE_BUCKETS - 1 && (1L << i) <= t * 1e6; i++) {
+        }
+        pthread_mutex_lock(&serve.lock);
+        serve_push(&serve.done, j);
+        serve.requests++;
+        serve.errors += j->status != 0;
+        serve.latency_total += t;
+        serve.latency_max = max(serve.latency_max, t);
+        serve.latency[i]++;
+        pthread_mutex_unlock(&serve.lock);
+        if (write(serve.done_fd, &one, sizeof(one)) < 0) {
+            perror("serve");
+        }
     }
+    return NULL;
+}
 
-    lval_del(a);
-    return x;
+void serve_free(struct serve_conn *conn)
+{
+    free(conn->in);
+    free(conn->out);
+    free(conn);
 }
 
-/* Exit from the program. */
-lval *builtin_exit(lenv *e, lval *v)
+/* Close conn. It's freed once its request, if any, is answered. */
+void serve_close(struct serve_conn *conn)
 {
-    int out = 0;
-    LASSERT_NARGS_RANGE(v, v->count, 0, 1, "exit");
-    if (v->count) {
-        LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, "exit");
-        out = v->cell[0]->num;
+    close(conn->fd);
+    conn->fd = -1;
+    pthread_mutex_lock(&serve.lock);
+    serve.clients--;
+    pthread_mutex_unlock(&serve.lock);
+    if (! conn->busy) {
+        serve_free(conn);
     }
-    exit(out);
 }
 
-lval *builtin_lambda(lenv *e, lval *a)
+/* Read what conn sent, up to a request more than the largest. Returns 0
+ * on an error. */
+int serve_read(struct serve_conn *conn)
 {
-    int i;
-    /* Check for two arguments, each a Q-Expression. */
-    LASSERT_NARGS(a, a->count, 2, "\\");
-    LASSERT_TYPE(a, a->cell[0], LVAL_QEXPR, 0, "\\");
-    LASSERT_TYPE(a, a->cell[1], LVAL_QEXPR, 1, "\\");
+    ssize_t n;
 
-    /* Check first Q-Expression contains only Symbols. */
-    for (i = 0; i < a->cell[0]->count; i++) {
-        LASSERT_TYPE(a, a->cell[0]->cell[i], LVAL_SYM, i, "\\");
+    while (conn->in_len < SERVE_MAX_REQUEST + 4) {
+        if (conn->in_len == conn->in_size) {
+            conn->in_size = conn->in_size ? conn->in_size * 2 : 4096;
+            conn->in = realloc(conn->in, conn->in_size);
+        }
+        n = read(conn->fd, conn->in + conn->in_len,
+                 conn->in_size - conn->in_len);
+        if (n == 0) {
+            conn->eof = 1;
+            break;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->in_len += n;
     }
+    return 1;
+}
 
-    /* Pop first two arguments and pass them to lval_lambda */
-    lval *formals = lval_pop(a, 0);
-    lval *body = lval_pop(a, 0);
-    lval_del(a);
+/* Write what's left of the answer of conn. Returns 0 on an error. */
+int serve_write(struct serve_conn *conn)
+{
+    ssize_t n;
 
-    return lval_lambda(formals, body);
+    while (conn->out_pos < conn->out_len) {
+        n = send(conn->fd, conn->out + conn->out_pos,
+                 conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_pos += n;
+    }
+    free(conn->out);
+    conn->out = NULL;
+    conn->out_len = conn->out_pos = 0;
+    return 1;
 }
 
-/*** Builtins for comparison ***/
-
-lval *builtin_ord(lenv *e, lval *v, char *op)
+/* Queue the next request of conn for the workers, if it's read whole and
+ * conn isn't waiting for an answer. Returns 0 if it's too large. */
+int serve_next(struct serve_conn *conn)
 {
-    LASSERT_NARGS(v, v->count, 2, op);
-    LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, op);
-    LASSERT_TYPE(v, v->cell[1], LVAL_NUM, 1, op);
-
-    int r;
-    int a = v->cell[0]->num;
-    int b = v->cell[1]->num;
-    lval_del(v);
+    struct serve_job *j;
+    unsigned char *p = (unsigned char *) conn->in;
+    size_t len;
 
-    if (STREQ(op, "equal")) {
-        r = (a == b);
-    }
-    if (STREQ(op, "<=")) {
-        r = (a <= b);
-    }
-    if (STREQ(op, ">=")) {
-        r = (a >= b);
+    if (conn->busy || conn->out || conn->in_len < 4) {
+        return 1;
     }
-    if (STREQ(op, "<")) {
-        r = (a < b);
+    len = (size_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    if (len > SERVE_MAX_REQUEST) {
+        return 0;
     }
-    if (STREQ(op, ">")) {
-        r = (a > b);
+    if (conn->in_len < len + 4) {
+        return 1;
     }
-
-    return lval_num(r);
+    j = malloc(sizeof(struct serve_job));
+    j->conn = conn;
+    j->src = malloc(len + 1);
+    memcpy(j->src, conn->in + 4, len);
+    j->src[len] = '\0';
+    j->out = NULL;
+    j->start = gc_now();
+    conn->in_len -= len + 4;
+    memmove(conn->in, conn->in + len + 4, conn->in_len);
+    conn->busy = 1;
+
+    pthread_mutex_lock(&serve.lock);
+    serve_push(&serve.todo, j);
+    serve.queued_max = max(serve.queued_max, serve.todo.len);
+    pthread_cond_signal(&serve.work);
+    pthread_mutex_unlock(&serve.lock);
+    return 1;
 }
 
-/* equal */
-lval *builtin_eq(lenv *e, lval *v)
+/* After conn was read or written (ok is 0 on an error): queue its next
+ * request, and close it or poll it for what it's waiting for. */
+void serve_update(int ep, struct serve_conn *conn, int ok)
 {
-    int res = lval_eq(v->cell[0], v->cell[1]);
-    lval_del(v);
-    return lval_num(res);
-}
+    struct epoll_event ev;
+    int events;
 
-/* greater */
-lval *builtin_gt(lenv *e, lval *v)
-{
-    return builtin_ord(e, v, ">");
+    if (! ok || ! serve_next(conn) ||
+        (conn->eof && ! conn->busy && ! conn->out)) {
+        serve_close(conn);
+        return;
+    }
+    events = (! conn->eof && conn->in_len < SERVE_MAX_REQUEST + 4 ?
+              EPOLLIN : 0) | (conn->out ? EPOLLOUT : 0);
+    if (events != conn->events) {
+        ev.events = conn->events = events;
+        ev.data.ptr = conn;
+        epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
 }
 
-/* lesser */
-lval *builtin_lt(lenv *e, lval *v)
+/* Handle the events of conn. Returns 0 on an error. */
+int serve_event(struct serve_conn *conn, int events)
 {
-    return builtin_ord(e, v, "<");
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return 0;
+    }
+    if ((events & EPOLLIN) && ! serve_read(conn)) {
+        return 0;
+    }
+    return ! (events & EPOLLOUT) || serve_write(conn);
 }
 
-/* greater or equal */
-lval *builtin_ge(lenv *e, lval *v)
+void serve_accept(int ep, int lfd)
 {
-    return builtin_ord(e, v, ">=");
+    struct serve_conn *conn;
+    struct epoll_event ev;
+    int fd;
+
+    while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        conn = calloc(1, sizeof(struct serve_conn));
+        conn->fd = fd;
+        ev.events = conn->events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        pthread_mutex_lock(&serve.lock);
+        serve.clients++;
+        pthread_mutex_unlock(&serve.lock);
+    }
 }
 
-/* lesser or equal */
-lval *builtin_le(lenv *e, lval *v)
+/* Start writing the answers the workers are done with. */
+void serve_answers(int ep)
 {
-    return builtin_ord(e, v, "<=");
+    struct serve_job *j, *next;
+    struct serve_conn *conn;
+    uint64_t n;
+    size_t len;
+
+    if (read(serve.done_fd, &n, sizeof(n)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&serve.lock);
+    j = serve.done.head;
+    serve.done.head = serve.done.tail = NULL;
+    serve.done.len = 0;
+    pthread_mutex_unlock(&serve.lock);
+
+    for (; j; j = next) {
+        next = j->next;
+        conn = j->conn;
+        conn->busy = 0;
+        if (conn->fd < 0) {
+            serve_free(conn);
+        } else {
+            len = strlen(j->out);
+            conn->out = malloc(len + 4);
+            conn->out[0] = len >> 24;
+            conn->out[1] = len >> 16;
+            conn->out[2] = len >> 8;
+            conn->out[3] = len;
+            memcpy(conn->out + 4, j->out, len);
+            conn->out_len = len + 4;
+            conn->out_pos = 0;
+            serve_update(ep, conn, serve_write(conn));
+        }
+        free(j->src);
+        free(j->out);
+        free(j);
+    }
 }
 
-/* negation */
-lval *builtin_not(lenv *e, lval *v)
+/* A worker's interpreter, loaded with the image and the script (either
+ * may be NULL), or NULL on an error. */
+caballa *serve_instance(char *image, char *script)
 {
-    /* Check for one argument, a number. */
-    LASSERT_NARGS(v, v->count, 1, "not");
-    LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, "not");
+    caballa *c = caballa_new();
+    char *src, *out;
+    long len;
+    FILE *f;
+    lval *x;
 
-    return lval_num(! v->cell[0]->num);
+    caballa_register_builtin(c, "serve-stats", builtin_serve_stats);
+    caballa_set_max_depth(c, SERVE_MAX_DEPTH);
+    if (image) {
+        x = image_load(c->env, image);
+        if (LTYPE(x) == LVAL_ERR) {
+            lval_println(stderr, x);
+            lval_del(x);
+            caballa_free(c);
+            return NULL;
+        }
+        lval_del(x);
+    }
+    if (! script) {
+        return c;
+    }
+    f = fopen(script, "rb");
+    if (! f || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0) {
+        perror(script);
+        caballa_free(c);
+        return NULL;
+    }
+    rewind(f);
+    src = malloc(len + 1);
+    len = fread(src, 1, len, f);
+    src[len] = '\0';
+    fclose(f);
+    if (caballa_eval_string(c, src, &out) < 0) {
+        fprintf(stderr, "%s: %s\n", script, out);
+        caballa_free(c);
+        c = NULL;
+    }
+    free(src);
+    free(out);
+    return c;
 }
 
-/* and */
-lval *builtin_and(lenv *e, lval *v)
+/* caballa --serve path: returns the exit status. */
+int serve_main(char *path, int workers, char *image, char *script)
 {
-    int i;
-    lval *res;
-    /* Ensure all arguments are of type num. */
-    for (i = 0; i < v->count; i++) {
-        LASSERT_TYPE(v, v->cell[i], LVAL_NUM, i, "and");
+    struct sockaddr_un addr = { AF_UNIX };
+    struct serve_conn listener = { -1 }, waker = { -1 };
+    struct epoll_event ev, evs[SERVE_EVENTS];
+    struct sigaction sa;
+    struct stat st;
+    sigset_t mask, old;
+    caballa **cs;
+    int i, n, ep, woken;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long for a socket\n", path);
+        return 1;
     }
-    for (i = 0; i < v->count; i++) {
-        if (!v->cell[i]->num) {
-            res = lval_pop(v, i);
-            lval_del(v);
-            return res;
+    strcpy(addr.sun_path, path);
+    if (workers <= 0) {
+        workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    /* The collector only runs with one thread evaluating. */
+    workers = gc.enabled ? 1 : max(workers, 1);
+
+    /* Load every interpreter before taking clients. */
+    cs = malloc(sizeof(caballa *) * workers);
+    for (i = 0; i < workers; i++) {
+        if (! (cs[i] = serve_instance(image, script))) {
+            return 1;
         }
+        gc_push(GC_ENV, &cs[i]->env, NULL);
     }
-    res = lval_pop(v, v->count-1);
-    lval_del(v);
-    return res;
-}
 
-/* or */
-lval *builtin_or(lenv *e, lval *v)
-{
-    int i;
-    lval *res;
-    /* Ensure all arguments are of type num. */
-    for (i = 0; i < v->count; i++) {
-        LASSERT_TYPE(v, v->cell[i], LVAL_NUM, i, "or");
+    /* A socket left behind by a server that didn't stop is replaced. */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
     }
-    for (i = 0; i < v->count; i++) {
-        if (v->cell[i]->num) {
-            res = lval_pop(v, i);
-            lval_del(v);
-            return res;
+    listener.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener.fd < 0 ||
+        bind(listener.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listener.fd, SOMAXCONN) < 0) {
+        perror(path);
+        return 1;
+    }
+    fcntl(listener.fd, F_SETFL, O_NONBLOCK);
+    waker.fd = serve.done_fd = eventfd(0, EFD_NONBLOCK);
+    ep = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listener.fd, &ev);
+    ev.data.ptr = &waker;
+    epoll_ctl(ep, EPOLL_CTL_ADD, waker.fd, &ev);
+
+    /* SIGINT and SIGTERM stop the loop: they're blocked, in the workers
+     * too, but while in epoll_pwait. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+    for (i = 0; i < workers; i++) {
+        if ((errno = thread_start(serve_worker, cs[i])) != 0) {
+            perror("serve");
+            return 1;
         }
     }
-    lval_del(v);
-    return lval_num(0);
-}
-
-/* conditional (if (condition) {consequence} {alternative}) */
-lval *builtin_if(lenv *e, lval *v)
-{
-    /* Ensure we have 2 or three arguments,
-     * first is bool (number) and the other one
-     * or two are qexprs (code) */
-    LASSERT_NARGS_RANGE(v, v->count, 2, 3, "if");
-    LASSERT_TYPE(v, v->cell[0], LVAL_NUM, 0, "if");
-    LASSERT_TYPE(v, v->cell[1], LVAL_QEXPR, 1, "if");
-    lval *code = NULL;
-    if (v->cell[0]->num) {
-        code = lval_pop(v, 1);
-    } else if (v->count == 3) {
-        LASSERT_TYPE(v, v->cell[2], LVAL_QEXPR, 2, "if");
-        code = lval_pop(v, 2);
+    free(cs);
+    fprintf(stderr, "serve: %s, %d workers\n", path, workers);
+
+    while (! serve_stop) {
+        n = epoll_pwait(ep, evs, SERVE_EVENTS, -1, &old);
+        woken = 0;
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.ptr == &listener) {
+                serve_accept(ep, listener.fd);
+            } else if (evs[i].data.ptr == &waker) {
+                woken = 1;
+            } else {
+                serve_update(ep, evs[i].data.ptr,
+                             serve_event(evs[i].data.ptr, evs[i].events));
+            }
+        }
+        /* Last: answering may free clients with events in evs. */
+        if (woken) {
+            serve_answers(ep);
+        }
     }
-    code = (code ? code : lval_sexpr());
-    code->type = LVAL_SEXPR;
-    lval *result = lval_eval(e, code);
-    lval_del(v);
-    return result;
+
+    close(listener.fd);
+    unlink(path);
+    serve_report();
+    return 0;
 }
 
-/*************** Functions to handle builtins ****************/
+#else
 
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
+int serve_main(char *path, int workers, char *image, char *script)
 {
-    lval *k = lval_sym(name);
-    lval *v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+    fprintf(stderr, "--serve needs epoll (Linux)\n");
+    return 1;
 }
 
-void lenv_add_builtins(lenv *e)
-{
-    /* List functions */
-    lenv_add_builtin(e, "list", (lbuiltin)builtin_list);
-    lenv_add_builtin(e, "head", (lbuiltin)builtin_head);
-    lenv_add_builtin(e, "join", (lbuiltin)builtin_join);
-    lenv_add_builtin(e, "eval", (lbuiltin)builtin_eval);
-    lenv_add_builtin(e, "tail", (lbuiltin)builtin_tail);
+#endif /* __linux__ */
 
-    /* Mathematical functions */
-    lenv_add_builtin(e, "+", (lbuiltin)builtin_add);
-    lenv_add_builtin(e, "-", (lbuiltin)builtin_sub);
-    lenv_add_builtin(e, "*", (lbuiltin)builtin_mul);
-    lenv_add_builtin(e, "/", (lbuiltin)builtin_div);
+int main(int argc, char *argv[])
+{
+    char *script = NULL, *image = NULL, *serve_path = NULL;
+    int status = 0, serve_workers = 0;
+    caballa *c;
+    lval *x;
 
-    /* Variable handling functions */
-    lenv_add_builtin(e, "def", (lbuiltin)builtin_def);
-    lenv_add_builtin(e, "=", (lbuiltin)builtin_put);
-    lenv_add_builtin(e, "getenv", (lbuiltin)builtin_getenv);
-    lenv_add_builtin(e, "\\", (lbuiltin)builtin_lambda);
+    /* Parse command line options. */
+    for (int i = 1; i < argc; i++) {
+        if (STREQ(argv[i], "--vm")) {
+            vm_enabled = 1;
+        }
+        if (STREQ(argv[i], "--gc") || STREQ(argv[i], "--gc-verbose")) {
+            gc_init(STREQ(argv[i], "--gc-verbose"));
+        }
+        /* Time every call, see builtin_profile. */
+        if (strncmp(argv[i], "--profile=", 10) == 0) {
+            prof_init(argv[i] + 10);
+        }
+        /* Threads for pmap, preduce and future, see par_start. */
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            par_threads = atoi(argv[i] + 10);
+        }
+        /* Print the counters at exit, see builtin_stats. */
+        if (STREQ(argv[i], "--stats")) {
+            atexit(stats_report);
+        }
+        /* Start from a heap image (see builtin_save_image). */
+        if (STREQ(argv[i], "--image") && i + 1 < argc) {
+            image = argv[++i];
+            continue;
+        }
+        /* Answer clients of a socket, see serve_main. */
+        if (STREQ(argv[i], "--serve") && i + 1 < argc) {
+            serve_path = argv[++i];
+            continue;
+        }
+        if (strncmp(argv[i], "--serve-workers=", 16) == 0) {
+            serve_workers = atoi(argv[i] + 16);
+        }
+        /* caballa file.cab, or caballa - to read stdin. */
+        if (argv[i][0] != '-' || STREQ(argv[i], "-")) {
+            script = argv[i];
+        }
+    }
 
-    /* Comparison */
-    lenv_add_builtin(e, "not", (lbuiltin)builtin_not);
-    lenv_add_builtin(e, "<", (lbuiltin)builtin_lt);
-    lenv_add_builtin(e, "<=", (lbuiltin)builtin_le);
-    lenv_add_builtin(e, ">", (lbuiltin)builtin_gt);
-    lenv_add_builtin(e, ">=", (lbuiltin)builtin_ge);
-    lenv_add_builtin(e, "eq", (lbuiltin)builtin_eq);
+    if (serve_path) {
+        return serve_main(serve_path, serve_workers, image, script);
+    }
 
-    /* Conditionals */
-    lenv_add_builtin(e, "if", (lbuiltin)builtin_if);
-    lenv_add_builtin(e, "and", (lbuiltin)builtin_and);
-    lenv_add_builtin(e, "or", (lbuiltin)builtin_or);
+    /* Create environment. */
+    c = caballa_new();
+    lenv_add_process_builtins(c->env);
+    par_owner = &c->pending;
+    gc_push(GC_ENV, &c->env, NULL);
+    if (image) {
+        x = image_load(c->env, image);
+        if (LTYPE(x) == LVAL_ERR) {
+            lval_println(stdout, x);
+            return 1;
+        }
+        lval_del(x);
+    }
 
-    /* Other */
-    lenv_add_builtin(e, "exit", (lbuiltin)builtin_exit);
-}
+    if (script) {
+        status = stream_eval(c->env, script);
+        caballa_free(c);
+        return status;
+    }
 
-/*************************************************************/
-int main(int argc, char *argv[])
-{
-    /* Create some parsers. */
-    mpc_parser_t *Number       =     mpc_new("number");
-    mpc_parser_t *Symbol       =     mpc_new("symbol");
-    mpc_parser_t *String       =     mpc_new("string");
-    mpc_parser_t *Sexpr        =     mpc_new("sexpr");
-    mpc_parser_t *Qexpr        =     mpc_new("qexpr");
-    mpc_parser_t *Expr         =     mpc_new("expr");
-    mpc_parser_t *Caballa      =     mpc_new("caballa");
-
-    /* Define them with the following language. */
-    mpca_lang(MPCA_LANG_DEFAULT,
-            "                                                      \
-            number      : /-?[0-9]+/ ;                             \
-            symbol      : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;       \
-            string      : /\"(\\\\.|[^\"])*\"/ ;                   \
-            sexpr       : '(' <expr>* ')' ;                        \
-            qexpr       : '{' <expr>* '}' ;                        \
-            expr        : <number> | <symbol> | <sexpr> | <qexpr> | <string>; \
-            caballa     : /^/ <expr>* /$/ ;                        \
-            ",
-            Number, Symbol, String, Sexpr, Qexpr, Expr, Caballa);
     /* Print version and Exit information. */
     puts("Caballa Version 0.0.0.0.1");
     puts("Press Ctrl+c to Exit\n");
 
-    mpc_result_t r;
-    lval *x;
-
-    /* Create environment. */
-    lenv *e = lenv_new();
-    lenv_add_builtins(e);
-
     char *input;
     /* Main loop. */
     while (1) {
         /* Output our prompt and get input. */
         input = readline("caballa> ");
+        /* End of input (Ctrl+d). */
+        if (! input) {
+            break;
+        }
 
         /* Add input to history. */
         add_history(input);
 
-        /* Attempt to parse the user input. */
-        if (mpc_parse("<stdin>", input, Caballa, &r)) {
-            /* On success print the result of evaluation */
-            x = lval_eval(e, lval_read(r.output));
-            lval_println(x);
-            lval_del(x);
-        } else {
-            /* Otherwise print the error. */
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
-        }
+        /* Parse the user input, and evaluate it (or print the error). */
+        top_eval(c->env, lval_read("<stdin>", input));
 
         free(input);
     }
-    lenv_del(e);
-    mpc_cleanup(6, Number, Symbol, String, Sexpr, Qexpr, Expr, Caballa);
+    caballa_free(c);
     return 0;
 }
+
+#endif /* CABALLA_LIB */
@@ -0,0 +1,83 @@
+/* libcaballa: the interpreter of caballa.c as a library (make lib builds
+ * libcaballa.a and libcaballa.so).
+ *
+ * Each interpreter (see caballa_new) has a global environment of its own:
+ * what is defined in one is not seen by the others. An interpreter may be
+ * used by one thread at a time, and different interpreters by different
+ * threads at once. Settings of the caballa command line (--vm, --gc,
+ * --threads) are process-wide, and the library runs with their defaults.
+ *
+ * The threads of pmap, preduce and future are one pool for the whole
+ * process: the tasks of all interpreters share them. A def, and the end of
+ * caballa_eval_string, wait only for the tasks of their own interpreter;
+ * but while tasks of any interpreter are running, reference counts are
+ * updated atomically in all of them, which is slower.
+ */
+#ifndef CABALLA_H
+#define CABALLA_H
+
+/* libcaballa is built with -fvisibility=hidden: only what is declared
+ * here is exported. */
+#if defined(__GNUC__)
+#define CABALLA_API __attribute__((visibility("default")))
+#else
+#define CABALLA_API
+#endif
+
+typedef struct caballa caballa;
+typedef struct lval lval;
+typedef struct lenv lenv;
+
+/* lbuiltin is a pointer to a function which takes an environment (lenv)
+ * and a lvalue (lval) and returns a lval.
+ * The lval is a S-Expression of the arguments, which the function owns:
+ * it must delete it (with lval_del) or make it part of what it returns.
+ * Errors are returned as Error values (see lval_err).
+ */
+typedef lval*(*lbuiltin)(lenv *, lval *);
+
+/* A new interpreter, with the builtins defined, except those that act on
+ * the whole process (exit, save-image, getenv): the host owns it. */
+CABALLA_API caballa *caballa_new(void);
+
+/* Evaluate the expressions of src in c in turn, as the caballa binary
+ * evaluates those of a file, stopping at the first that gives an error.
+ * Returns 0, or -1 on an error (syntax or evaluation). If out is not
+ * NULL, *out is set to the printed value of the last expression evaluated
+ * (or to the error), which the caller must free. */
+CABALLA_API int caballa_eval_string(caballa *c, const char *src,
+                                    char **out);
+
+/* Limit the nesting of evaluation in c to depth levels (0, the default,
+ * is no limit): recursing deeper is an error, instead of overflowing the
+ * stack of the thread evaluating. */
+CABALLA_API void caballa_set_max_depth(caballa *c, int depth);
+
+/* Define name in c as the builtin function fun. */
+CABALLA_API void caballa_register_builtin(caballa *c, const char *name,
+                                          lbuiltin fun);
+
+/* Free c and everything defined in it. */
+CABALLA_API void caballa_free(caballa *c);
+
+/* For builtins: the number of arguments in a, and argument i. */
+CABALLA_API int caballa_nargs(lval *a);
+CABALLA_API lval *caballa_arg(lval *a, int i);
+
+/* If v is a Number, set *x to it and return 1, else return 0. */
+CABALLA_API int caballa_get_num(lval *v, long *x);
+
+/* The text of v if it's a String, else NULL. It lasts as long as v. */
+CABALLA_API const char *caballa_get_str(lval *v);
+
+/* Values, for builtins to return. */
+CABALLA_API lval *lval_num(long x);
+CABALLA_API lval *lval_str(char *s);
+CABALLA_API lval *lval_err(char *fmt, ...);
+CABALLA_API lval *lval_qexpr(void);
+/* Add x to the end of the Q-Expression v, and return v. */
+CABALLA_API lval *lval_add(lval *v, lval *x);
+CABALLA_API lval *lval_copy(lval *v);
+CABALLA_API void lval_del(lval *v);
+
+#endif